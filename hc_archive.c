@@ -0,0 +1,236 @@
+/* houseclock - A simple GPS Time Server with Web console
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * hc_archive.c - A multi-resolution archive of the drift and traffic.
+ *
+ * This module keeps a round-robin archive of the clock drift and of the
+ * NTP traffic in the live database, at four resolutions (tiers):
+ *
+ *    1 second     for 10 minutes,
+ *    1 minute     for 1 day,
+ *    15 minutes   for 1 week,
+ *    1 hour       for 31 days.
+ *
+ * Each bucket stores the min, max, sum and count of the drift samples,
+ * and the count of received, client and broadcast packets. New data is
+ * only added to the 1 second tier: when a bucket closes, it is merged
+ * into the current bucket of the next tier. The cost is thus constant
+ * per sample, and the memory used is fixed.
+ *
+ * A bucket is valid only if its start time matches its position in the
+ * tier: slots that were not used in the latest round still hold older
+ * data, which readers must ignore.
+ *
+ * SYNOPSYS:
+ *
+ * void hc_archive_initialize (void);
+ *
+ *    Create the archive in the live database.
+ *
+ * void hc_archive_drift (time_t timestamp, long long drift);
+ *
+ *    Add one drift sample (ns). The timestamps are expected to increase:
+ *    data older than the current bucket is added to the current bucket.
+ *
+ * void hc_archive_traffic (time_t timestamp,
+ *                          int received, int client, int broadcast);
+ *
+ *    Add NTP traffic counts. These are accumulated by the NTP module
+ *    over 10 seconds, so the 1 second tier shows traffic only in one
+ *    bucket out of 10.
+ *
+ * time_t hc_archive_periodic (time_t now);
+ *
+ *    Close the current bucket if its time has passed, even if there was
+ *    no new data. Returns the time when this should be called next.
+ *
+ * int hc_archive_tier (int resolution, int *offset, int *depth);
+ *
+ *    Return the tier for the specified resolution (seconds), or -1 if
+ *    there is no such tier. The position of the tier in the archive
+ *    table and its count of buckets are returned in offset and depth.
+ */
+
+#include <time.h>
+#include <limits.h>
+
+#include "houseclock.h"
+#include "hc_db.h"
+#include "hc_archive.h"
+
+#define HC_ARCHIVE_TIERS 4
+
+static const struct {
+    int period; // seconds.
+    int depth;  // buckets.
+} hc_archive_layout[HC_ARCHIVE_TIERS] = {
+    {1, 600},
+    {60, 1440},
+    {900, 672},
+    {3600, 744}
+};
+
+static hc_archive_bucket *hc_archive_db = 0;
+static hc_archive_bucket *hc_archive_base[HC_ARCHIVE_TIERS];
+static hc_archive_bucket *hc_archive_current[HC_ARCHIVE_TIERS];
+
+
+int hc_archive_tier (int resolution, int *offset, int *depth) {
+
+    int i;
+    int position = 0;
+
+    for (i = 0; i < HC_ARCHIVE_TIERS; ++i) {
+        if (hc_archive_layout[i].period == resolution) {
+            *offset = position;
+            *depth = hc_archive_layout[i].depth;
+            return i;
+        }
+        position += hc_archive_layout[i].depth;
+    }
+    return -1;
+}
+
+void hc_archive_initialize (void) {
+
+    int i;
+    int size = 0;
+
+    for (i = 0; i < HC_ARCHIVE_TIERS; ++i) size += hc_archive_layout[i].depth;
+
+    i = hc_db_new (HC_ARCHIVE, sizeof(hc_archive_bucket), size);
+    if (i != 0) {
+        fprintf (stderr, "[%s %d] cannot create %s: %s\n",
+                 __FILE__, __LINE__, HC_ARCHIVE, strerror(i));
+        exit (1);
+    }
+    hc_archive_db = (hc_archive_bucket *) hc_db_get (HC_ARCHIVE);
+    hc_db_update_begin (hc_archive_db);
+    memset (hc_archive_db, 0, size * sizeof(hc_archive_bucket));
+    hc_db_update_end (hc_archive_db);
+
+    size = 0;
+    for (i = 0; i < HC_ARCHIVE_TIERS; ++i) {
+        hc_archive_base[i] = hc_archive_db + size;
+        hc_archive_current[i] = 0;
+        size += hc_archive_layout[i].depth;
+    }
+}
+
+static void hc_archive_merge (hc_archive_bucket *to,
+                              const hc_archive_bucket *from) {
+
+    if (from->count > 0) {
+        if (to->count == 0 || from->min < to->min) to->min = from->min;
+        if (to->count == 0 || from->max > to->max) to->max = from->max;
+        to->sum += from->sum;
+        to->count += from->count;
+    }
+    to->received += from->received;
+    to->client += from->client;
+    to->broadcast += from->broadcast;
+}
+
+static hc_archive_bucket *hc_archive_bucket_at (int tier, time_t timestamp);
+
+static void hc_archive_close (int tier) {
+
+    // Roll up the current bucket of this tier into the next tier.
+
+    hc_archive_bucket *bucket = hc_archive_current[tier];
+
+    hc_archive_current[tier] = 0;
+    if ((!bucket) || (tier + 1 >= HC_ARCHIVE_TIERS)) return;
+
+    hc_archive_merge (hc_archive_bucket_at (tier + 1, bucket->start), bucket);
+}
+
+static hc_archive_bucket *hc_archive_bucket_at (int tier, time_t timestamp) {
+
+    int period = hc_archive_layout[tier].period;
+    time_t start = timestamp - (timestamp % period);
+    hc_archive_bucket *bucket = hc_archive_current[tier];
+
+    if (bucket && (bucket->start >= start)) {
+        // A closed bucket is never reopened, or else it would be merged
+        // twice: late data (or time going back) goes to the current one.
+        return bucket;
+    }
+
+    hc_archive_close (tier);
+
+    bucket = hc_archive_base[tier]
+                 + ((start / period) % hc_archive_layout[tier].depth);
+    if (bucket->start != start) {
+        memset (bucket, 0, sizeof(hc_archive_bucket));
+        bucket->start = start;
+    }
+    hc_archive_current[tier] = bucket;
+    return bucket;
+}
+
+void hc_archive_drift (time_t timestamp, long long drift) {
+
+    hc_archive_bucket sample;
+
+    if (!hc_archive_db) return;
+
+    memset (&sample, 0, sizeof(sample));
+    sample.count = 1;
+    sample.min = sample.max = sample.sum = drift;
+    hc_db_update_begin (hc_archive_db);
+    hc_archive_merge (hc_archive_bucket_at (0, timestamp), &sample);
+    hc_db_update_end (hc_archive_db);
+}
+
+void hc_archive_traffic (time_t timestamp,
+                         int received, int client, int broadcast) {
+
+    hc_archive_bucket *bucket;
+
+    if (!hc_archive_db) return;
+
+    hc_db_update_begin (hc_archive_db);
+    bucket = hc_archive_bucket_at (0, timestamp);
+    bucket->received += received;
+    bucket->client += client;
+    bucket->broadcast += broadcast;
+    hc_db_update_end (hc_archive_db);
+}
+
+time_t hc_archive_periodic (time_t now) {
+
+    int tier;
+
+    if (!hc_archive_db) return now + 60;
+
+    // Close the buckets that ended, lowest tier first since closing a
+    // bucket adds to the next tier.
+    //
+    hc_db_update_begin (hc_archive_db);
+    for (tier = 0; tier < HC_ARCHIVE_TIERS; ++tier) {
+        hc_archive_bucket *bucket = hc_archive_current[tier];
+        if (!bucket) continue;
+        if (now >= bucket->start + hc_archive_layout[tier].period)
+            hc_archive_close (tier);
+    }
+    hc_db_update_end (hc_archive_db);
+    return now - (now % 60) + 60;
+}
@@ -0,0 +1,44 @@
+/* houseclock - A simple GPS Time Server with Web console
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * hc_archive.h - A multi-resolution archive of the drift and traffic.
+ */
+void   hc_archive_initialize (void);
+void   hc_archive_drift   (time_t timestamp, long long drift);
+void   hc_archive_traffic (time_t timestamp,
+                           int received, int client, int broadcast);
+time_t hc_archive_periodic (time_t now);
+
+int hc_archive_tier (int resolution, int *offset, int *depth);
+
+/* Live database.
+ */
+#define HC_ARCHIVE "ClockArchive"
+
+typedef struct {
+    time_t    start;     // 0: never used.
+    int       count;     // Count of drift samples.
+    long long min;       // ns
+    long long max;       // ns
+    long long sum;       // ns
+    int       received;
+    int       client;
+    int       broadcast;
+} hc_archive_bucket;
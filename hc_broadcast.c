@@ -24,9 +24,19 @@
  *
  * SYNOPSYS:
  *
- * int hc_broadcast_open (const char *service)
+ * int hc_broadcast_open (const char *service, int shared)
  *
- *    Open the broadcast UDP socket and returns the socket ID.
+ *    Open the broadcast UDP socket and returns the socket ID. The kernel
+ *    is asked to timestamp each received packet. If shared is true, the
+ *    port can be shared with worker sockets (see below).
+ *
+ * int hc_broadcast_open_worker (void)
+ *
+ *    Open an additional server socket on the same port, for use by a
+ *    worker thread. The kernel distributes the incoming unicast packets
+ *    between all the sockets, while broadcast packets are delivered to
+ *    every socket. This requires that hc_broadcast_open() was called first
+ *    with shared set. Returns the socket ID.
  *
  * void hc_broadcast_enumerate (void);
  *
@@ -39,16 +49,66 @@
  *    on each network interface. If address is not null, the interface's
  *    IPv4 address is written to it before each transmission.
  *
+ * void hc_broadcast_send_stamped (char *data, int length,
+ *                                 hc_broadcast_stamp *stamp);
+ *
+ *    Same as hc_broadcast_send(), except that the stamp function is called
+ *    before each transmission with the kernel transmit timestamp of the
+ *    previous broadcast on that interface (0 if not known). This is used
+ *    to implement the NTP interleaved broadcast mode.
+ *
+ * int hc_broadcast_enable_txstamp (int server);
+ *
+ *    Ask the kernel to timestamp every packet sent on the specified socket.
+ *    Each packet sent is identified by a counter, starting at 0. Use -1 to
+ *    enable transmit timestamps on the broadcast sockets. Return 0 on
+ *    success, -1 if not supported.
+ *
+ * int hc_broadcast_get_txstamp (int server,
+ *                               hc_broadcast_txstamp *stamps, int count);
+ *
+ *    Retrieve up to count pending transmit timestamps from the specified
+ *    socket. Returns the number of timestamps retrieved. This must be called
+ *    whenever the socket is reported as readable, since pending transmit
+ *    timestamps make the socket readable.
+ *
  * void hc_broadcast_reply (const char *data, int length,
  *                          const struct sockaddr_in *destination)
  *
  *    Send a response packet to the specified unicast address.
  *
- * int hc_broadcast_receive (char *buffer, int size, in_addr_t *source)
+ * int hc_broadcast_receive (char *buffer, int size,
+ *                           struct sockaddr_in *source,
+ *                           struct timespec *timestamp)
  *
- *    Get the data and source address of a received packet.
+ *    Get the data, source address and kernel receive time of a received
+ *    packet. The timestamp is set to 0 if the kernel did not provide one.
  *    Returns the length of the data, or -1.
  *
+ * int hc_broadcast_receive_batch (int server,
+ *                                 hc_broadcast_message *messages, int count);
+ *
+ *    Get up to count pending packets from the specified server socket,
+ *    in one system call. For each message, the data and size fields must
+ *    have been set by the caller. The length, address and timestamp fields
+ *    are set for each packet received. A packet larger than the buffer is
+ *    truncated. Returns the number of packets received, which is 0 if no
+ *    packet was pending.
+ *
+ * int hc_broadcast_reply_batch (int server,
+ *                               const hc_broadcast_message *messages,
+ *                               int count);
+ *
+ *    Send count response packets through the specified server socket, each
+ *    to its own unicast address, using as few system calls as possible.
+ *    Returns the number of packets sent.
+ *
+ * void hc_broadcast_timestamp (struct msghdr *header,
+ *                              struct timespec *timestamp);
+ *
+ *    Retrieve the kernel receive time from the control data of a received
+ *    message. The timestamp is set to 0 if there is none.
+ *
  * const char *hc_broadcast_format (const struct sockaddr_in *addr);
  *
  *    Get a string representation of the network address. This
@@ -64,9 +124,11 @@
  *
  * Only supports IPv4 addresses for the time being.
  * Only supports local broadcast (address 255.255.255.255).
- * Only supports one socket per process.
+ * Only supports one port per process.
  */
 
+#define _GNU_SOURCE // For recvmmsg() and sendmmsg().
+
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
@@ -74,6 +136,9 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/socket.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
 #include <arpa/inet.h>
 #include <ifaddrs.h>
 
@@ -82,6 +147,7 @@
 
 static int udpserver = -1;
 static int serverport = 0;
+static const char *servicename = "";
 
 #define UDPCLIENT_MAX 16
 typedef struct {
@@ -90,14 +156,20 @@ typedef struct {
     int address;
     int mask;
     int broadcast;
+    struct timespec transmit; // Kernel timestamp of the latest broadcast.
 } NetworkInterface;
 
 static NetworkInterface udpclient[UDPCLIENT_MAX];
 static int udpclient_count = 0;
+static int udpclient_txstamp = 0;
+
+#define HC_BROADCAST_TXSTAMP_FLAGS \
+    (SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE | \
+     SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY)
 
 static struct sockaddr_in netaddress;
 
-static int hc_broadcast_socket (int ipv4, int port) {
+static int hc_broadcast_socket (int ipv4, int port, int shared) {
 
     int value;
     int flags;
@@ -120,6 +192,16 @@ static int hc_broadcast_socket (int ipv4, int port) {
        exit (1);
     }
 
+    if (shared) {
+        value = 1;
+        if (setsockopt(s,
+                       SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value)) < 0) {
+           fprintf (stderr, "[%s %d] cannot share port %d: %s\n",
+                    __FILE__, __LINE__, port, strerror(errno));
+           exit (1);
+        }
+    }
+
     memset(&netaddress, 0, sizeof(netaddress));
     netaddress.sin_family = AF_INET;
     netaddress.sin_addr.s_addr = ipv4;
@@ -145,6 +227,22 @@ void hc_broadcast_enumerate (void) {
     struct ifaddrs *cards;
     struct sockaddr_in *ia;
 
+    NetworkInterface former[UDPCLIENT_MAX];
+    int former_count = udpclient_count;
+    int i;
+
+    // Keep the transmit timestamp of the latest broadcast on each interface,
+    // since these sockets are about to be closed.
+    //
+    for (i = 0; i < udpclient_count; ++i) {
+        hc_broadcast_txstamp stamp;
+        if (udpclient[i].socket < 0) continue;
+        while (hc_broadcast_get_txstamp (udpclient[i].socket, &stamp, 1) > 0) {
+            udpclient[i].transmit = stamp.timestamp;
+        }
+        former[i] = udpclient[i];
+    }
+
     while (--udpclient_count >= 0) {
         if (udpclient[udpclient_count].socket >= 0) {
             close (udpclient[udpclient_count].socket);
@@ -178,18 +276,58 @@ void hc_broadcast_enumerate (void) {
 
             client->broadcast = client->address | (~ client->mask);
 
-            client->socket = hc_broadcast_socket(client->address, 0);
+            client->socket = hc_broadcast_socket(client->address, 0, 0);
             strncpy (client->name, cursor->ifa_name, sizeof(client->name));
 
+            client->transmit.tv_sec = client->transmit.tv_nsec = 0;
+            if (udpclient_txstamp) {
+                int value = HC_BROADCAST_TXSTAMP_FLAGS;
+                setsockopt (client->socket,
+                            SOL_SOCKET, SO_TIMESTAMPING, &value, sizeof(value));
+                for (i = 0; i < former_count; ++i) {
+                    if (strcmp (former[i].name, client->name)) continue;
+                    if (former[i].address != client->address) continue;
+                    client->transmit = former[i].transmit;
+                    break;
+                }
+            }
+
             if (++udpclient_count >= UDPCLIENT_MAX) break;
         }
         freeifaddrs(cards);
     }
 }
 
-int hc_broadcast_open (const char *service) {
+static int hc_broadcast_server (int shared) {
 
     int value;
+    int s = hc_broadcast_socket(INADDR_ANY, serverport, shared);
+
+    value = 1024 * 1024;
+    if (setsockopt(s, SOL_SOCKET, SO_RCVBUF, &value, sizeof(value)) < 0) {
+       fprintf (stderr, "[%s %d] cannot set receive buffer to %d for service %s: %s\n",
+                __FILE__, __LINE__, value, servicename, strerror(errno));
+       exit (1);
+    }
+    value = 1024 * 1024;
+    if (setsockopt(s, SOL_SOCKET, SO_SNDBUF, &value, sizeof(value)) < 0) {
+       fprintf (stderr, "[%s %d] cannot set send buffer to %d for service %s: %s\n",
+                __FILE__, __LINE__, value, servicename, strerror(errno));
+       exit (1);
+    }
+
+    // Ask the kernel to timestamp received packets. This is not fatal:
+    // the caller's own receive time is used if not supported.
+    //
+    value = 1;
+    if (setsockopt(s, SOL_SOCKET, SO_TIMESTAMPNS, &value, sizeof(value)) < 0) {
+       DEBUG printf ("cannot enable receive timestamps for service %s: %s\n",
+                     servicename, strerror(errno));
+    }
+    return s;
+}
+
+int hc_broadcast_open (const char *service, int shared) {
 
     // Open the UDP server socket for receiving NTP requests and sending
     // responses.
@@ -214,27 +352,44 @@ int hc_broadcast_open (const char *service) {
 
     DEBUG printf ("Opening UDP port %d (name: %s)\n", serverport, service);
 
-    udpserver = hc_broadcast_socket(INADDR_ANY, serverport);
+    servicename = service;
+    udpserver = hc_broadcast_server (shared);
+    return udpserver;
+}
 
-    value = 1024 * 1024;
-    if (setsockopt(udpserver,
-                   SOL_SOCKET, SO_RCVBUF, &value, sizeof(value)) < 0) {
-       fprintf (stderr, "[%s %d] cannot set receive buffer to %d for service %s: %s\n",
-                __FILE__, __LINE__, value, service, strerror(errno));
-       exit (1);
-    }
-    value = 1024 * 1024;
-    if (setsockopt(udpserver,
-                   SOL_SOCKET, SO_SNDBUF, &value, sizeof(value)) < 0) {
-       fprintf (stderr, "[%s %d] cannot set send buffer to %d for service %s: %s\n",
-                __FILE__, __LINE__, value, service, strerror(errno));
-       exit (1);
-    }
+int hc_broadcast_open_worker (void) {
 
-    return udpserver;
+    if (udpserver < 0) return -1;
+
+    DEBUG printf ("Opening worker socket for UDP port %d\n", serverport);
+    return hc_broadcast_server (1);
 }
 
 
+void hc_broadcast_send_stamped (char *data, int length,
+                                hc_broadcast_stamp *stamp) {
+
+    int i;
+
+    netaddress.sin_addr.s_addr = INADDR_BROADCAST;
+    netaddress.sin_port = htons(serverport);
+
+    for (i = 0; i < udpclient_count; ++i) {
+        NetworkInterface *client = udpclient + i;
+        if (client->socket < 0) continue;
+        stamp (data, length, &(client->transmit));
+        netaddress.sin_addr.s_addr = client->broadcast;
+        if (sendto (client->socket, data, length, 0,
+                    (struct sockaddr *)&netaddress, sizeof(netaddress)) < 0) {
+            fprintf (stderr, "cannot send broadcast on interface %s: %s\n",
+                     client->name, strerror(errno));
+            continue;
+        }
+        DEBUG printf ("Packet sent to address %s on interface %s\n",
+                      hc_broadcast_format(&netaddress), client->name);
+    }
+}
+
 void hc_broadcast_send (const char *data, int length, int *address) {
 
     int i;
@@ -297,16 +452,189 @@ void hc_broadcast_reply
 }
 
 int hc_broadcast_receive (char *buffer, int size,
-                          struct sockaddr_in *source) {
+                          struct sockaddr_in *source,
+                          struct timespec *timestamp) {
 
-    int length;
-    socklen_t srclength = sizeof(struct sockaddr_in);
+    hc_broadcast_message message;
 
     if (udpserver < 0) return 0;
 
-    length = recvfrom (udpserver, buffer, size, 0,
-		               (struct sockaddr *)source, &srclength);
+    message.data = buffer;
+    message.size = size;
+    if (hc_broadcast_receive_batch (udpserver, &message, 1) <= 0) return -1;
+
+    *source = message.address;
+    if (timestamp) *timestamp = message.timestamp;
+    return message.length;
+}
+
+void hc_broadcast_timestamp (struct msghdr *header,
+                             struct timespec *timestamp) {
+
+    struct cmsghdr *cmsg;
+
+    timestamp->tv_sec = 0;
+    timestamp->tv_nsec = 0;
 
-    return length;
+    for (cmsg = CMSG_FIRSTHDR(header);
+         cmsg != NULL; cmsg = CMSG_NXTHDR(header, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET) continue;
+        if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            memcpy (timestamp, CMSG_DATA(cmsg), sizeof(*timestamp));
+            return;
+        }
+    }
 }
 
+
+int hc_broadcast_receive_batch (int server,
+                                hc_broadcast_message *messages, int count) {
+
+    int i;
+    int received;
+    struct mmsghdr headers[HC_BROADCAST_BATCH];
+    struct iovec   vectors[HC_BROADCAST_BATCH];
+    // If transmit timestamps are enabled, the kernel also reports
+    // the receive time as a SCM_TIMESTAMPING control message.
+    union {
+        char buffer[CMSG_SPACE(sizeof(struct timespec))
+                    + CMSG_SPACE(sizeof(struct scm_timestamping))];
+        struct cmsghdr align;
+    } control[HC_BROADCAST_BATCH];
+
+    if (server < 0) return 0;
+    if (count > HC_BROADCAST_BATCH) count = HC_BROADCAST_BATCH;
+
+    memset (headers, 0, count * sizeof(headers[0]));
+    for (i = 0; i < count; ++i) {
+        vectors[i].iov_base = messages[i].data;
+        vectors[i].iov_len = messages[i].size;
+        headers[i].msg_hdr.msg_name = &(messages[i].address);
+        headers[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        headers[i].msg_hdr.msg_iov = vectors + i;
+        headers[i].msg_hdr.msg_iovlen = 1;
+        headers[i].msg_hdr.msg_control = control[i].buffer;
+        headers[i].msg_hdr.msg_controllen = sizeof(control[i].buffer);
+    }
+
+    received = recvmmsg (server, headers, count, MSG_DONTWAIT, NULL);
+    if (received <= 0) return 0;
+
+    for (i = 0; i < received; ++i) {
+        messages[i].length = (int)(headers[i].msg_len);
+        hc_broadcast_timestamp (&(headers[i].msg_hdr), &(messages[i].timestamp));
+    }
+    return received;
+}
+
+int hc_broadcast_reply_batch (int server,
+                              const hc_broadcast_message *messages, int count) {
+
+    int i;
+    int sent = 0;
+    struct mmsghdr headers[HC_BROADCAST_BATCH];
+    struct iovec   vectors[HC_BROADCAST_BATCH];
+
+    if (server < 0) return 0;
+    if (count > HC_BROADCAST_BATCH) count = HC_BROADCAST_BATCH;
+
+    memset (headers, 0, count * sizeof(headers[0]));
+    for (i = 0; i < count; ++i) {
+        vectors[i].iov_base = messages[i].data;
+        vectors[i].iov_len = messages[i].length;
+        headers[i].msg_hdr.msg_name = (void *)&(messages[i].address);
+        headers[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        headers[i].msg_hdr.msg_iov = vectors + i;
+        headers[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    // sendmmsg() may stop short if the socket's buffer is full: retry
+    // with the remaining packets until this cannot progress anymore.
+    //
+    while (sent < count) {
+        int result = sendmmsg (server, headers+sent, count-sent, 0);
+        if (result <= 0) {
+            DEBUG printf ("sendmmsg() error after %d packets: %s\n",
+                          sent, strerror(errno));
+            break;
+        }
+        sent += result;
+    }
+    return sent;
+}
+
+int hc_broadcast_enable_txstamp (int server) {
+
+    int value = HC_BROADCAST_TXSTAMP_FLAGS;
+
+    if (server < 0) {
+        udpclient_txstamp = 1; // Applied when the sockets are (re)opened.
+        return 0;
+    }
+    if (setsockopt(server,
+                   SOL_SOCKET, SO_TIMESTAMPING, &value, sizeof(value)) < 0) {
+        DEBUG printf ("cannot enable transmit timestamps: %s\n",
+                      strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int hc_broadcast_get_txstamp (int server,
+                              hc_broadcast_txstamp *stamps, int count) {
+
+    int received = 0;
+
+    while (received < count) {
+
+        char data[64];
+        struct iovec vector;
+        struct msghdr header;
+        struct cmsghdr *cmsg;
+        // The receive timestamp option, if enabled, adds its own control
+        // message to the error queue messages as well.
+        union {
+            char buffer[CMSG_SPACE(sizeof(struct scm_timestamping))
+                        + CMSG_SPACE(sizeof(struct timespec))
+                        + CMSG_SPACE(sizeof(struct sock_extended_err)
+                                     + sizeof(struct sockaddr_in))];
+            struct cmsghdr align;
+        } control;
+        int found = 0;
+
+        vector.iov_base = data;
+        vector.iov_len = sizeof(data);
+        memset (&header, 0, sizeof(header));
+        header.msg_iov = &vector;
+        header.msg_iovlen = 1;
+        header.msg_control = control.buffer;
+        header.msg_controllen = sizeof(control.buffer);
+
+        if (recvmsg (server, &header, MSG_ERRQUEUE|MSG_DONTWAIT) < 0) break;
+
+        // A timestamp comes with two control messages: the timestamp itself
+        // and an extended error that carries the packet identifier.
+        //
+        for (cmsg = CMSG_FIRSTHDR(&header);
+             cmsg != NULL; cmsg = CMSG_NXTHDR(&header, cmsg)) {
+
+            if ((cmsg->cmsg_level == SOL_SOCKET) &&
+                (cmsg->cmsg_type == SCM_TIMESTAMPING)) {
+                struct scm_timestamping kernel;
+                memcpy (&kernel, CMSG_DATA(cmsg), sizeof(kernel));
+                stamps[received].timestamp = kernel.ts[0];
+                found |= 1;
+
+            } else if ((cmsg->cmsg_level == SOL_IP) &&
+                       (cmsg->cmsg_type == IP_RECVERR)) {
+                struct sock_extended_err error;
+                memcpy (&error, CMSG_DATA(cmsg), sizeof(error));
+                if (error.ee_origin != SO_EE_ORIGIN_TIMESTAMPING) continue;
+                stamps[received].id = error.ee_data;
+                found |= 2;
+            }
+        }
+        if (found == 3) received += 1;
+    }
+    return received;
+}
@@ -26,16 +26,49 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 
-int hc_broadcast_open (const char *service);
+int hc_broadcast_open (const char *service, int shared);
+int hc_broadcast_open_worker (void);
 
 void hc_broadcast_enumerate (void);
 void hc_broadcast_send (const char *data, int length, int *address);
 
+typedef void hc_broadcast_stamp
+                (char *data, int length, const struct timespec *previous);
+void hc_broadcast_send_stamped (char *data, int length,
+                                hc_broadcast_stamp *stamp);
+
 void hc_broadcast_reply
         (const char *data, int length, const struct sockaddr_in *destination);
 
-int  hc_broadcast_receive
-        (char *buffer, int size, struct sockaddr_in *source);
+int  hc_broadcast_receive (char *buffer, int size,
+                           struct sockaddr_in *source,
+                           struct timespec *timestamp);
+
+#define HC_BROADCAST_BATCH 64 // Max number of messages per batch.
+
+typedef struct {
+    char  *data;
+    int    size;   // Size of the data buffer (receive only).
+    int    length; // Length of the data.
+    struct sockaddr_in address;
+    struct timespec timestamp; // Kernel receive time, 0 if not available.
+} hc_broadcast_message;
+
+int hc_broadcast_receive_batch
+        (int server, hc_broadcast_message *messages, int count);
+int hc_broadcast_reply_batch
+        (int server, const hc_broadcast_message *messages, int count);
+
+void hc_broadcast_timestamp (struct msghdr *header, struct timespec *timestamp);
+
+typedef struct {
+    uint32_t id;
+    struct timespec timestamp;
+} hc_broadcast_txstamp;
+
+int hc_broadcast_enable_txstamp (int server);
+int hc_broadcast_get_txstamp
+        (int server, hc_broadcast_txstamp *stamps, int count);
 
 const char *hc_broadcast_format (const struct sockaddr_in *addr);
 
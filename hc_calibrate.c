@@ -0,0 +1,304 @@
+/* houseclock - A simple GPS Time Server with Web console
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * hc_calibrate.c - Calibrate the GPS latency against a time reference.
+ *
+ * The GPS latency is the delay between the GPS fix and the reception of
+ * the NMEA data used as its timing. It depends on the receiver model and
+ * its configuration, and cannot be measured from the NMEA data alone.
+ *
+ * This module compares the GPS time with an independent time reference:
+ * either the broadcasts from other stratum 1 NTP servers on the local
+ * network, or a local reference clock device (e.g. a PTP hardware clock).
+ * Each comparison gives one latency sample: when the GPS data was
+ * received, according to the reference, minus the GPS time of the fix.
+ *
+ * The estimate is the median of the latest samples, with a confidence
+ * interval derived from their median absolute deviation. Once the
+ * interval is narrow enough, the estimate is saved in the persistent
+ * state under the name of the GPS device (so that different receivers
+ * keep their own latency), and it is applied live if requested.
+ *
+ * The NTP broadcasts include the network delay, typically less than
+ * one millisecond on a local network.
+ *
+ * SYNOPSYS:
+ *
+ * const char *hc_calibrate_help (int level);
+ *
+ *    Prints the help information, two levels:
+ *      0: short help for one-line argument information.
+ *      1: multi-line description of each argument.
+ *
+ * void hc_calibrate_initialize (int argc, const char **argv);
+ *
+ *    Retrieve the calibration options and open the reference clock.
+ *
+ *    The command line options processed here are:
+ *      -calibrate            Estimate the GPS latency.
+ *      -calibrate-apply      Also use the estimated latency once converged.
+ *      -calibrate-clock=<P>  Use the clock device P as the time reference.
+ *
+ * int hc_calibrate_active (void);
+ *
+ *    True if the latency calibration is running.
+ *
+ * void hc_calibrate_fix (const char *device,
+ *                        const struct timespec *gps,
+ *                        const struct timespec *local);
+ *
+ *    Record a GPS fix: its GPS time and the local time of its timing
+ *    reference in the NMEA data.
+ *
+ * void hc_calibrate_reference (const char *name,
+ *                              const struct timespec *reference,
+ *                              const struct timespec *local);
+ *
+ *    Record the time of a reference (e.g. a NTP broadcast's transmit
+ *    time) and the local time when it was received.
+ */
+
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "houseclock.h"
+#include "hc_db.h"
+#include "hc_clock.h"
+#include "hc_state.h"
+#include "hc_nmea.h"
+#include "hc_calibrate.h"
+
+#define HC_CALIBRATE_DEPTH   64 // The latest samples used for the estimate.
+#define HC_CALIBRATE_MINIMUM 8
+#define HC_CALIBRATE_TARGET  1000000LL // ns, confidence interval required.
+#define HC_CALIBRATE_MAXIMUM 1000000000LL // ns, ignore larger samples.
+
+// A clock device is accessed through a clock ID derived from its file
+// descriptor (see FD_TO_CLOCKID in the kernel documentation).
+#define HC_CALIBRATE_CLOCKID(fd) ((~(clockid_t)(fd) << 3) | 3)
+
+static hc_calibrate_status *hc_calibrate_db = 0;
+
+static const char *hc_calibrate_clock = 0;
+static int hc_calibrate_clockfd = -1;
+
+static long long hc_calibrate_samples[HC_CALIBRATE_DEPTH];
+static int hc_calibrate_count = 0;
+static int hc_calibrate_next = 0;
+
+static const char *hc_calibrate_device = 0;
+static struct timespec hc_calibrate_gps;   // The latest fix.
+static struct timespec hc_calibrate_local;
+
+
+const char *hc_calibrate_help (int level) {
+
+    static const char *calibrateHelp[] = {
+        " [-calibrate] [-calibrate-apply] [-calibrate-clock=PATH]",
+        "-calibrate:   estimate the GPS latency using other time references.",
+        "-calibrate-apply: use the estimated GPS latency once converged.",
+        "-calibrate-clock=PATH: use this clock device as the time reference.",
+        NULL
+    };
+    return calibrateHelp[level];
+}
+
+void hc_calibrate_initialize (int argc, const char **argv) {
+
+    int i;
+    int active = 0;
+    int apply = 0;
+
+    for (i = 1; i < argc; ++i) {
+        active |= echttp_option_present ("-calibrate", argv[i]);
+        apply |= echttp_option_present ("-calibrate-apply", argv[i]);
+        echttp_option_match ("-calibrate-clock=", argv[i],
+                             &hc_calibrate_clock);
+    }
+
+    i = hc_db_new (HC_CALIBRATE_STATUS, sizeof(hc_calibrate_status), 1);
+    if (i != 0) {
+        fprintf (stderr, "[%s %d] cannot create %s: %s\n",
+                 __FILE__, __LINE__, HC_CALIBRATE_STATUS, strerror(i));
+        exit (1);
+    }
+    hc_calibrate_db = (hc_calibrate_status *) hc_db_get (HC_CALIBRATE_STATUS);
+
+    hc_db_update_begin (hc_calibrate_db);
+    memset (hc_calibrate_db, 0, sizeof(hc_calibrate_status));
+    hc_calibrate_db->active = active || apply || (hc_calibrate_clock != 0);
+    hc_calibrate_db->apply = apply;
+    hc_db_update_end (hc_calibrate_db);
+
+    if (hc_calibrate_clock) {
+        hc_calibrate_clockfd = open (hc_calibrate_clock, O_RDONLY);
+        if (hc_calibrate_clockfd < 0) {
+            fprintf (stderr, "[%s %d] cannot open %s: %s\n",
+                     __FILE__, __LINE__, hc_calibrate_clock, strerror(errno));
+            exit (1);
+        }
+    }
+}
+
+int hc_calibrate_active (void) {
+    return hc_calibrate_db && hc_calibrate_db->active;
+}
+
+static int hc_calibrate_compare (const void *a, const void *b) {
+    long long x = *((const long long *)a);
+    long long y = *((const long long *)b);
+    return (x > y) - (x < y);
+}
+
+static void hc_calibrate_estimate (void) {
+
+    long long sorted[HC_CALIBRATE_DEPTH];
+    long long median;
+    long long mad;
+    double interval;
+    int i;
+    int n = hc_calibrate_count;
+
+    memcpy (sorted, hc_calibrate_samples, n * sizeof(long long));
+    qsort (sorted, n, sizeof(long long), hc_calibrate_compare);
+    median = sorted[n/2];
+
+    for (i = 0; i < n; ++i) sorted[i] = llabs (sorted[i] - median);
+    qsort (sorted, n, sizeof(long long), hc_calibrate_compare);
+    mad = sorted[n/2];
+
+    // 1.4826 converts the MAD into a standard deviation, 1.2533 accounts
+    // for the efficiency of the median, and 1.96 gives a 95% interval.
+    //
+    interval = 1.96 * 1.2533 * 1.4826 * (double)mad / sqrt ((double)n);
+
+    hc_calibrate_db->samples = n;
+    hc_calibrate_db->latency = median;
+    hc_calibrate_db->confidence = (long long)interval;
+    hc_calibrate_db->converged = (n >= HC_CALIBRATE_MINIMUM)
+                                 && (interval <= HC_CALIBRATE_TARGET);
+}
+
+static void hc_calibrate_use (void) {
+
+    // Save the estimated latency for this GPS device, and apply it if
+    // requested. The latency is handled in milliseconds elsewhere.
+
+    char name[128];
+    int latency = (int)((hc_calibrate_db->latency + 500000) / 1000000);
+
+    if (!hc_calibrate_device) return;
+
+    snprintf (name, sizeof(name), "latency:%s", hc_calibrate_device);
+    hc_state_set (name, latency);
+
+    if (hc_calibrate_db->apply && (latency != hc_calibrate_db->applied)) {
+        DEBUG printf ("Calibrated GPS latency: %d ms (+/- %.3f ms)\n",
+                      latency, hc_calibrate_db->confidence / 1000000.0);
+        hc_nmea_set_latency (latency);
+        hc_calibrate_db->applied = latency;
+    }
+}
+
+static void hc_calibrate_sample (const char *name, long long offset) {
+
+    // The offset is the reference time minus the local time, measured
+    // close to the latest GPS fix.
+
+    long long sample = hc_clock_delta (&hc_calibrate_local, &hc_calibrate_gps)
+                       + offset;
+
+    if (llabs(sample) > HC_CALIBRATE_MAXIMUM) {
+        DEBUG printf ("Calibration sample from %s ignored: %.3f ms\n",
+                      name, sample / 1000000.0);
+        return;
+    }
+
+    hc_db_update_begin (hc_calibrate_db);
+
+    hc_calibrate_samples[hc_calibrate_next] = sample;
+    hc_calibrate_next = (hc_calibrate_next + 1) % HC_CALIBRATE_DEPTH;
+    if (hc_calibrate_count < HC_CALIBRATE_DEPTH) hc_calibrate_count += 1;
+
+    snprintf (hc_calibrate_db->reference,
+              sizeof(hc_calibrate_db->reference), "%s", name);
+    hc_calibrate_db->latest = sample;
+    hc_calibrate_db->timestamp = hc_calibrate_local.tv_sec;
+
+    hc_calibrate_estimate ();
+    if (hc_calibrate_db->converged) hc_calibrate_use ();
+
+    hc_db_update_end (hc_calibrate_db);
+}
+
+void hc_calibrate_fix (const char *device,
+                       const struct timespec *gps,
+                       const struct timespec *local) {
+
+    struct timespec before, reference, after;
+    long long offset;
+
+    if (!hc_calibrate_active()) return;
+
+    if ((!hc_calibrate_device) || strcmp (device, hc_calibrate_device)) {
+        // A different GPS device: start over.
+        hc_calibrate_device = device;
+        hc_calibrate_count = hc_calibrate_next = 0;
+    }
+    hc_calibrate_gps = *gps;
+    hc_calibrate_local = *local;
+
+    if (hc_calibrate_clockfd < 0) return;
+
+    // Bracket the reference clock between two readings of the local time.
+    //
+    clock_gettime (CLOCK_REALTIME, &before);
+    if (clock_gettime (HC_CALIBRATE_CLOCKID(hc_calibrate_clockfd),
+                       &reference) != 0) return;
+    clock_gettime (CLOCK_REALTIME, &after);
+
+    offset = hc_clock_delta (&reference, &before)
+             - (hc_clock_delta (&after, &before) / 2);
+
+    // A hardware clock often runs on TAI: ignore the whole seconds.
+    offset %= HC_CLOCK_NSEC;
+    if (offset > HC_CLOCK_NSEC / 2) offset -= HC_CLOCK_NSEC;
+    else if (offset < -(HC_CLOCK_NSEC / 2)) offset += HC_CLOCK_NSEC;
+
+    hc_calibrate_sample (hc_calibrate_clock, offset);
+}
+
+void hc_calibrate_reference (const char *name,
+                             const struct timespec *reference,
+                             const struct timespec *local) {
+
+    if (!hc_calibrate_active()) return;
+    if (hc_calibrate_clockfd >= 0) return; // The clock is a better reference.
+
+    // The fix and the reference must be close: the local clock drifts.
+    if (hc_calibrate_gps.tv_sec == 0) return;
+    if (llabs (hc_clock_delta (local, &hc_calibrate_local)) > 2*HC_CLOCK_NSEC)
+        return;
+
+    hc_calibrate_sample (name, hc_clock_delta (reference, local));
+}
@@ -0,0 +1,50 @@
+/* houseclock - A simple GPS Time Server with Web console
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * hc_calibrate.h - Calibrate the GPS latency against a time reference.
+ */
+const char *hc_calibrate_help (int level);
+
+void hc_calibrate_initialize (int argc, const char **argv);
+int  hc_calibrate_active (void);
+
+void hc_calibrate_fix (const char *device,
+                       const struct timespec *gps,
+                       const struct timespec *local);
+void hc_calibrate_reference (const char *name,
+                             const struct timespec *reference,
+                             const struct timespec *local);
+
+/* Live database.
+ */
+#define HC_CALIBRATE_STATUS "GpsCalibration"
+
+typedef struct {
+    char active;          // Calibration was requested.
+    char apply;           // The calibrated latency is applied live.
+    char converged;       // The confidence interval is narrow enough.
+    char reference[64];   // The latest time reference used.
+    int  samples;         // Count of samples in the current window.
+    long long latency;    // ns, the estimated latency (median).
+    long long confidence; // ns, half-width of the 95% confidence interval.
+    long long latest;     // ns, the latest sample.
+    time_t timestamp;     // When the latest sample was taken.
+    int  applied;         // ms, latency last applied, 0 if none.
+} hc_calibrate_status;
@@ -38,9 +38,66 @@
  *    The command line options processed here are:
  *      -precision=<N>  The clock accuracy target for synchronization (ms).
  *      -drift          Print the measured drift (debug)
+ *      -discipline=<M> How the clock is corrected: adjtime, pll or fll.
+ *      -estimator=<E>  How the drift of a learning period is calculated:
+ *                      mean, median, trimmed, weighted or kalman.
  *
- * void hc_clock_synchronize(const struct timeval *source,
- *                           const struct timeval *local, int latency);
+ *    The samples of each learning period are kept, and reduced to one
+ *    drift value using the selected estimator:
+ *      mean      the arithmetic mean (the default).
+ *      median    the median value, insensitive to a few late samples.
+ *      trimmed   the mean after removing the 20% lowest and highest values.
+ *      weighted  a mean where each sample is weighted by how little it was
+ *                delayed. A sample delayed by the OS shows a lower drift
+ *                (it is received late), so the weight decreases with the
+ *                distance from the highest drift of the period.
+ *      kalman    the offset estimated by a two-state Kalman filter (offset
+ *                and skew), updated on every sample. The measurement noise
+ *                adapts to the observed variance of the innovations, and a
+ *                sample too far from the prediction is ignored. The filter
+ *                models the correction still being slewed by the kernel.
+ *                With the adjtime discipline, the clock is slewed toward
+ *                the offset predicted for the next sample after every
+ *                sample, instead of once per learning period. With the
+ *                pll and fll disciplines, the initial kernel frequency is
+ *                set from the skew estimated by the filter.
+ *    The spread (highest - lowest drift) of the period, and the count
+ *    of outliers (more than 3 standard deviations from the median, as
+ *    estimated from the median absolute deviation), are reported in
+ *    the live database.
+ *
+ *    With the adjtime discipline (the default), the average drift
+ *    calculated at the end of each learning period is corrected using
+ *    adjtime(), which slews the clock until the whole offset was absorbed.
+ *    The clock then drifts freely until the next correction.
+ *
+ *    With the pll and fll disciplines, the clock is steered by the kernel,
+ *    using adjtimex(): the average drift for each learning period is fed to
+ *    the kernel's phase (or frequency) locked loop, which corrects both the
+ *    offset and the oscillator frequency continuously. The frequency is
+ *    first estimated from how the drift changed over one minute, and set
+ *    with ADJ_FREQUENCY. An offset too large for the kernel loop
+ *    (more than HC_CLOCK_STEP) is corrected by stepping the time.
+ *    The kernel only uses its FLL for updates at least 256 seconds apart:
+ *    with the fll discipline, the offset is fed to the kernel at that
+ *    interval instead of at every learning period.
+ *
+ *    With all disciplines, the clock is reported as synchronized once the
+ *    average drift is within the precision target, and only loses that
+ *    status when the drift is 50 times that target.
+ *
+ *    In all cases, the kernel status (frequency, maximum and estimated
+ *    error, status flags) is reported in the live database.
+ *
+ *    The kernel frequency learned, and the time of the latest good
+ *    synchronization, are saved in the persistent state (see hc_state.c).
+ *    With the pll and fll disciplines, a saved frequency that is not too
+ *    old is restored at startup, instead of being measured again. The time
+ *    it took to synchronize within the precision target after startup is
+ *    reported as the convergence time.
+ *
+ * void hc_clock_synchronize(const struct timespec *source,
+ *                           const struct timespec *local, long long latency);
  *
  *    Called to synchronize the local time based on a source clock.
  *    The local time parameter represents an estimate of the exact moment
@@ -48,52 +105,150 @@
  *    of the transmission delay, i.e. the delta between the moment the
  *    time was sampled at the source and the moment when it was received
  *    by this machine. This function calculates a drift between the two
- *    times and corrects the local time if needed.
+ *    times and corrects the local time if needed. The latency is
+ *    in nanoseconds.
  *
  * int hc_clock_synchronized (void)
  *
  *    Return 1 when the local system time was synchronized with
  *    the source clock.
  *
- * void hc_clock_reference  (struct timeval *reference);
- * int  hc_clock_dispersion (void);
+ * void hc_clock_reference  (struct timespec *reference);
+ * long long hc_clock_dispersion (void);
  *
  *    These two functions are intended for supporting the NTP module.
  *    The reference time is the time of the latest clock adjustment.
  *    The dispersion is the average drift from the source clock
- *    for the latest period. (This does not use the maximum drift
+ *    for the latest period, in nanoseconds. (This does not use the maximum drift
  *    because this is too influenced by the OS response time, which
  *    is unrelated to the accuracy of the local clock.)
+ *
+ * int  hc_clock_generation (void);
+ *
+ *    Return a number that changes each time the clock state reported
+ *    by the functions above changes. This allows a client module to
+ *    cache information derived from the clock state.
+ *
+ * long long hc_clock_delta (const struct timespec *a,
+ *                           const struct timespec *b);
+ * void hc_clock_shift (struct timespec *t, long long delta);
+ *
+ *    Helpers for the time arithmetic: the delta function returns a - b
+ *    and the shift function adds delta to t. All values are nanoseconds.
+ *
+ *    All drift values stored in the live database are in nanoseconds.
  */
 
 #include <time.h>
 #include <errno.h>
+#include <math.h>
+#include <sys/timex.h>
 
 #include "houseclock.h"
 #include "hc_clock.h"
 #include "hc_db.h"
+#include "hc_state.h"
+#include "hc_stability.h"
+#include "hc_archive.h"
 
 #define HC_CLOCK_LEARNING_PERIOD 10
 
 static int clockShowDrift = 0;
 
+// The kernel discipline. The time constant matches the learning period
+// (about 2^3 seconds), and the kernel loop does not accept offsets larger
+// than 0.5 second: ntpd uses a lower step threshold, which is used here.
+//
+#define HC_CLOCK_KERNEL_TC 3
+#define HC_CLOCK_STEP      128000000LL // ns
+#define HC_CLOCK_MAXFREQ   (500LL << 16) // 500 ppm.
+#define HC_CLOCK_FREQSPAN  60 // Seconds, for the initial frequency estimate.
+#define HC_CLOCK_FLLSPAN   256 // Seconds, the kernel's minimum FLL interval.
+
+static char clockDiscipline = 'A';
+
+// The samples of the current learning period.
+//
+static char clockEstimator = 'M';
+static long long clockSamples[HC_CLOCK_LEARNING_PERIOD];
+
+#define HC_CLOCK_TRIM   5       // Remove 1/5th of the samples at each end.
+#define HC_CLOCK_WEIGHT 1000000 // Delay (ns) that halves a sample's weight.
+
+// The frequency estimation state for the kernel discipline:
+//   0: waiting for the first learning period after a time step.
+//   1: the drift of the first learning period was recorded, and the drift
+//      is being measured until HC_CLOCK_FREQSPAN seconds have passed.
+//   2: the frequency was set, the kernel loop is running.
+//
+static int clockKernelState = 0;
+static struct timespec clockKernelTime;
+static long long clockKernelDrift;
+static time_t clockKernelUpdate = 0; // Latest offset fed to the kernel.
+
+// The frequency restored from the persistent state, if any. A frequency
+// saved too long ago is ignored: the oscillator might have changed.
+//
+#define HC_CLOCK_STATE_EXPIRES (30 * 24 * 3600)
+
+static int  clockRestored = 0;
+static long clockRestoredFreq = 0;
+
+static struct timespec clockStarted; // CLOCK_MONOTONIC.
+
+// The Kalman filter state: x[0] is the offset (ns), x[1] the skew (ns/s),
+// both as source - local. The process noise (q) is fixed, the measurement
+// noise (r) adapts to the variance of the innovations.
+//
+#define HC_CLOCK_KALMAN_QOFFSET 1.0e8   // ns^2/s, white phase noise.
+#define HC_CLOCK_KALMAN_QSKEW   100.0   // (ns/s)^2/s, frequency wander.
+#define HC_CLOCK_KALMAN_RMIN    1.0e8   // ns^2, (10 us)^2.
+#define HC_CLOCK_KALMAN_RSTART  1.0e12  // ns^2, (1 ms)^2.
+#define HC_CLOCK_KALMAN_PSKEW   2.5e9   // (ns/s)^2, (50 ppm)^2.
+#define HC_CLOCK_KALMAN_ADAPT   16      // Innovation variance time constant.
+#define HC_CLOCK_KALMAN_GATE    25.0    // 5 sigma, squared.
+#define HC_CLOCK_KALMAN_REJECTS 5       // Consecutive rejects before reset.
+#define HC_CLOCK_KALMAN_LEAD    1.0     // s, how far ahead to correct.
+
+// How fast a correction is applied: adjtime() slews at a fixed rate,
+// while the kernel loop applies 1/2^(SHIFT_PLL + time constant) of the
+// remaining offset every second.
+//
+#define HC_CLOCK_ADJTIME_SLEW   500000.0 // ns/s.
+#define HC_CLOCK_KERNEL_SLEW    ((double)(1 << (2 + HC_CLOCK_KERNEL_TC))) // s.
+
+static int clockKalmanActive = 0;
+static int clockKalmanRejects = 0;
+static struct timespec clockKalmanTime;
+static double clockKalmanX[2];
+static double clockKalmanP[2][2];
+static double clockKalmanInnovations;
+static double clockKalmanPending; // Correction not yet applied (ns).
+
 #define HC_CLOCK_DRIFT_DEPTH 120
 static hc_clock_status *hc_clock_status_db = 0;
-static int *hc_clock_drift_db = 0;
+static long long *hc_clock_drift_db = 0;
 
 
 const char *hc_clock_help (int level) {
 
     static const char *clockHelp[] = {
-        " [-drift] [-precision=N]",
+        " [-drift] [-precision=N] [-discipline=adjtime|pll|fll]"
+        " [-estimator=mean|median|trimmed|weighted|kalman]",
         "-drift        Print the measured drift (test mode).\n"
-        "-precision=N: precision of the time synchronization in milliseconds.",
+        "-precision=N: precision of the time synchronization in milliseconds.\n"
+        "-discipline=M: correct the clock using adjtime or the kernel PLL/FLL.\n"
+        "-estimator=E: how to calculate the drift of a learning period.",
         NULL
     };
     return clockHelp[level];
 }
 
-static void hc_clock_start_learning (const struct timeval *local) {
+static void hc_clock_changed (void) {
+    hc_clock_status_db->generation += 1;
+}
+
+static void hc_clock_start_learning (const struct timespec *local) {
     hc_clock_status_db->count = 0;
     hc_clock_status_db->accumulator = 0;
     hc_clock_status_db->cycle = *local;
@@ -104,23 +259,58 @@ void hc_clock_initialize (int argc, const char **argv) {
     int i;
     int precision;
     const char *precision_option = "10"; // ms
+    const char *discipline_option = "adjtime";
+    const char *estimator_option = "mean";
 
     clockShowDrift = 0;
 
     for (i = 1; i < argc; ++i) {
         echttp_option_match ("-precision=", argv[i], &precision_option);
+        echttp_option_match ("-discipline=", argv[i], &discipline_option);
+        echttp_option_match ("-estimator=", argv[i], &estimator_option);
         clockShowDrift |= echttp_option_present ("-drift", argv[i]);
     }
     precision = atoi(precision_option);
 
-    i = hc_db_new (HC_CLOCK_DRIFT, sizeof(int), HC_CLOCK_DRIFT_DEPTH);
+    if (strcmp (discipline_option, "adjtime") == 0) {
+        clockDiscipline = 'A';
+    } else if ((strcmp (discipline_option, "pll") == 0) ||
+               (strcmp (discipline_option, "kernel") == 0)) {
+        clockDiscipline = 'P';
+    } else if (strcmp (discipline_option, "fll") == 0) {
+        clockDiscipline = 'F';
+    } else {
+        fprintf (stderr, "[%s %d] invalid discipline %s\n",
+                 __FILE__, __LINE__, discipline_option);
+        exit (1);
+    }
+
+    if (strcmp (estimator_option, "mean") == 0) {
+        clockEstimator = 'M';
+    } else if (strcmp (estimator_option, "median") == 0) {
+        clockEstimator = 'D';
+    } else if (strcmp (estimator_option, "trimmed") == 0) {
+        clockEstimator = 'T';
+    } else if (strcmp (estimator_option, "weighted") == 0) {
+        clockEstimator = 'W';
+    } else if (strcmp (estimator_option, "kalman") == 0) {
+        clockEstimator = 'K';
+    } else {
+        fprintf (stderr, "[%s %d] invalid estimator %s\n",
+                 __FILE__, __LINE__, estimator_option);
+        exit (1);
+    }
+
+    i = hc_db_new (HC_CLOCK_DRIFT, sizeof(long long), HC_CLOCK_DRIFT_DEPTH);
     if (i != 0) {
         fprintf (stderr, "[%s %d] cannot create %s: %s\n",
                  __FILE__, __LINE__, HC_CLOCK_DRIFT, strerror(i));
         exit (1);
     }
-    hc_clock_drift_db = (int *) hc_db_get (HC_CLOCK_DRIFT);
+    hc_clock_drift_db = (long long *) hc_db_get (HC_CLOCK_DRIFT);
+    hc_db_update_begin (hc_clock_drift_db);
     for (i = 0; i < HC_CLOCK_DRIFT_DEPTH; ++i) hc_clock_drift_db[i] = 0;
+    hc_db_update_end (hc_clock_drift_db);
 
     i = hc_db_new (HC_CLOCK_STATUS, sizeof(hc_clock_status), 1);
     if (i != 0) {
@@ -129,62 +319,242 @@ void hc_clock_initialize (int argc, const char **argv) {
         exit (1);
     }
     hc_clock_status_db = (hc_clock_status *)hc_db_get (HC_CLOCK_STATUS);
+    hc_db_update_begin (hc_clock_status_db);
     hc_clock_status_db->synchronized = 0;
     hc_clock_status_db->precision = precision;
     hc_clock_status_db->drift = 0;
+    hc_clock_status_db->generation = 0;
+    hc_clock_status_db->discipline = clockDiscipline;
+    memset (&(hc_clock_status_db->kernel), 0,
+            sizeof(hc_clock_status_db->kernel));
+    hc_clock_status_db->convergence = 0;
+    hc_clock_status_db->estimator = clockEstimator;
+    hc_clock_status_db->spread = 0;
+    hc_clock_status_db->outliers = 0;
+    memset (&(hc_clock_status_db->kalman), 0,
+            sizeof(hc_clock_status_db->kalman));
+    hc_clock_status_db->restored = 0;
+
+    clock_gettime (CLOCK_MONOTONIC, &clockStarted);
+    if (clockDiscipline != 'A') {
+        long long frequency;
+        long long synchronized;
+        if (hc_state_get ("frequency", &frequency) &&
+            hc_state_get ("synchronized", &synchronized) &&
+            (synchronized + HC_CLOCK_STATE_EXPIRES > time(0))) {
+            clockRestored = 1;
+            clockRestoredFreq = (long)frequency;
+            hc_clock_status_db->restored = 1;
+        }
+    }
 
-    struct timeval now;
-    gettimeofday (&now, NULL);
+    struct timespec now;
+    clock_gettime (CLOCK_REALTIME, &now);
     hc_clock_start_learning (&now);
+    hc_db_update_end (hc_clock_status_db);
+}
+
+long long hc_clock_delta (const struct timespec *a, const struct timespec *b) {
+    return ((long long)(a->tv_sec - b->tv_sec) * HC_CLOCK_NSEC)
+           + (a->tv_nsec - b->tv_nsec);
+}
+
+void hc_clock_shift (struct timespec *t, long long delta) {
+    long long nsec = t->tv_nsec + (delta % HC_CLOCK_NSEC);
+    t->tv_sec += (time_t)(delta / HC_CLOCK_NSEC);
+    if (nsec >= HC_CLOCK_NSEC) {
+        t->tv_sec += 1;
+        nsec -= HC_CLOCK_NSEC;
+    } else if (nsec < 0) {
+        t->tv_sec -= 1;
+        nsec += HC_CLOCK_NSEC;
+    }
+    t->tv_nsec = (long)nsec;
+}
+
+static void hc_clock_kalman_export (void) {
+    hc_clock_status_db->kalman.active = clockKalmanActive;
+    hc_clock_status_db->kalman.offset = clockKalmanX[0];
+    hc_clock_status_db->kalman.skew = clockKalmanX[1];
+    hc_clock_status_db->kalman.covariance[0] = clockKalmanP[0][0];
+    hc_clock_status_db->kalman.covariance[1] = clockKalmanP[0][1];
+    hc_clock_status_db->kalman.covariance[2] = clockKalmanP[1][1];
+}
+
+static void hc_clock_kalman_reset (void) {
+    clockKalmanActive = 0;
+    clockKalmanRejects = 0;
+    clockKalmanPending = 0;
+    if (hc_clock_status_db) hc_clock_status_db->kalman.active = 0;
+}
+
+static void hc_clock_kalman_shift (long long skew) {
+
+    // The clock frequency was corrected: the filter state moves with it.
+
+    if (!clockKalmanActive) return;
+    clockKalmanX[1] -= skew;
+    hc_clock_kalman_export ();
+}
+
+static void hc_clock_kalman_correct (long long offset) {
+
+    // A correction was handed to the kernel. It replaces any correction
+    // still pending, and is applied progressively (see
+    // hc_clock_kalman_slew()).
+
+    clockKalmanPending = offset;
+}
+
+static void hc_clock_kalman_slew (double dt) {
+
+    // Remove from the offset the part of the pending correction that the
+    // kernel applied during the last dt seconds.
+
+    double applied;
+
+    if (clockKalmanPending == 0) return;
+
+    if (clockDiscipline == 'A') {
+        double limit = HC_CLOCK_ADJTIME_SLEW * dt;
+        applied = clockKalmanPending;
+        if (applied > limit) applied = limit;
+        else if (applied < 0 - limit) applied = 0 - limit;
+    } else {
+        applied = clockKalmanPending * (1 - exp (0 - dt / HC_CLOCK_KERNEL_SLEW));
+    }
+    clockKalmanX[0] -= applied;
+    clockKalmanPending -= applied;
+}
+
+static void hc_clock_kalman_update (long long drift,
+                                    const struct timespec *local) {
+
+    double dt, innovation, s, k0, k1;
+    double p00, p01, p11;
+
+    if (!clockKalmanActive) {
+        clockKalmanX[0] = drift;
+        clockKalmanX[1] = 0;
+        clockKalmanP[0][0] = HC_CLOCK_KALMAN_RSTART;
+        clockKalmanP[0][1] = clockKalmanP[1][0] = 0;
+        clockKalmanP[1][1] = HC_CLOCK_KALMAN_PSKEW;
+        clockKalmanInnovations = HC_CLOCK_KALMAN_RSTART;
+        clockKalmanTime = *local;
+        clockKalmanActive = 1;
+        hc_clock_status_db->kalman.noise = HC_CLOCK_KALMAN_RSTART;
+        hc_clock_status_db->kalman.innovation = 0;
+        hc_clock_kalman_export ();
+        return;
+    }
+
+    // Predict: the offset moves with the skew, and the uncertainty grows.
+    //
+    dt = hc_clock_delta (local, &clockKalmanTime) / (double)HC_CLOCK_NSEC;
+    if (dt <= 0) return;
+    clockKalmanTime = *local;
+
+    clockKalmanX[0] += clockKalmanX[1] * dt;
+    hc_clock_kalman_slew (dt);
+
+    p00 = clockKalmanP[0][0] + dt * (2 * clockKalmanP[0][1]
+                                     + dt * clockKalmanP[1][1])
+          + (HC_CLOCK_KALMAN_QOFFSET * dt)
+          + (HC_CLOCK_KALMAN_QSKEW * dt * dt * dt / 3);
+    p01 = clockKalmanP[0][1] + dt * clockKalmanP[1][1]
+          + (HC_CLOCK_KALMAN_QSKEW * dt * dt / 2);
+    p11 = clockKalmanP[1][1] + (HC_CLOCK_KALMAN_QSKEW * dt);
+
+    // Adapt the measurement noise: the variance of the innovations is
+    // the predicted variance plus the measurement noise.
+    //
+    innovation = drift - clockKalmanX[0];
+    hc_clock_status_db->kalman.innovation = innovation;
+
+    s = p00 + hc_clock_status_db->kalman.noise;
+    if ((innovation * innovation) > HC_CLOCK_KALMAN_GATE * s) {
+        if (++clockKalmanRejects < HC_CLOCK_KALMAN_REJECTS) {
+            DEBUG printf ("Kalman filter rejected drift %.3f ms\n",
+                          drift / 1000000.0);
+            hc_clock_status_db->kalman.rejected += 1;
+            clockKalmanP[0][0] = p00;
+            clockKalmanP[0][1] = clockKalmanP[1][0] = p01;
+            clockKalmanP[1][1] = p11;
+            hc_clock_kalman_export ();
+            return;
+        }
+        // Not an outlier anymore: the source itself changed.
+        DEBUG printf ("Kalman filter restarted\n");
+        hc_clock_kalman_reset ();
+        hc_clock_kalman_update (drift, local);
+        return;
+    }
+    clockKalmanRejects = 0;
+
+    clockKalmanInnovations +=
+        ((innovation * innovation) - clockKalmanInnovations)
+            / HC_CLOCK_KALMAN_ADAPT;
+    hc_clock_status_db->kalman.noise = clockKalmanInnovations - p00;
+    if (hc_clock_status_db->kalman.noise < HC_CLOCK_KALMAN_RMIN)
+        hc_clock_status_db->kalman.noise = HC_CLOCK_KALMAN_RMIN;
+
+    // Correct.
+    //
+    s = p00 + hc_clock_status_db->kalman.noise;
+    k0 = p00 / s;
+    k1 = p01 / s;
+    clockKalmanX[0] += k0 * innovation;
+    clockKalmanX[1] += k1 * innovation;
+    clockKalmanP[0][0] = (1 - k0) * p00;
+    clockKalmanP[0][1] = clockKalmanP[1][0] = (1 - k0) * p01;
+    clockKalmanP[1][1] = p11 - (k1 * p01);
+
+    hc_clock_kalman_export ();
 }
 
-static void hc_clock_force (const struct timeval *source,
-                            const struct timeval *local, int latency) {
+static void hc_clock_force (const struct timespec *source,
+                            const struct timespec *local, long long latency) {
 
-    struct timeval now;
-    struct timeval corrected = *source;
+    struct timespec now;
+    struct timespec corrected = *source;
 
-    gettimeofday (&now, NULL);
+    clock_gettime (CLOCK_REALTIME, &now);
 
     // Correct the source time to adjust for the time spent since it was
     // acquired, as estimated using the local clock (now).
     //
-    corrected.tv_sec += (now.tv_sec - local->tv_sec);
-    corrected.tv_usec += (now.tv_usec - local->tv_usec) + (latency * 1000);
-    if (corrected.tv_usec > 1000000) {
-        corrected.tv_sec += 1;
-        corrected.tv_usec -= 1000000;
-    } else if (corrected.tv_usec < 0) {
-        corrected.tv_sec -= 1;
-        corrected.tv_usec += 1000000;
-    }
+    hc_clock_shift (&corrected, hc_clock_delta (&now, local) + latency);
 
     DEBUG {
         printf ("Forcing time from %ld.%03.3d to %ld.%03.3d, "
-                    "based on source clock %ld.%03.3d & latency %d\n",
-                (long)(now.tv_sec), (int)(now.tv_usec/1000),
-                (long)(corrected.tv_sec), (int)(corrected.tv_usec/1000),
-                (long)(source->tv_sec), (int)(source->tv_usec/1000), latency);
+                    "based on source clock %ld.%03.3d & latency %lld ns\n",
+                (long)(now.tv_sec), (int)(now.tv_nsec / 1000000),
+                (long)(corrected.tv_sec), (int)(corrected.tv_nsec / 1000000),
+                (long)(source->tv_sec), (int)(source->tv_nsec / 1000000), latency);
     }
-    if (settimeofday (&corrected, NULL) != 0) {
-        printf ("settimeofday() error %d\n", errno);
+    if (clock_settime (CLOCK_REALTIME, &corrected) != 0) {
+        printf ("clock_settime() error %d\n", errno);
         return;
     }
     DEBUG {
-       gettimeofday (&corrected, 0);
+       clock_gettime (CLOCK_REALTIME, &corrected);
        printf ("Time set to %ld.%03.3d\n",
-               (long)(corrected.tv_sec), (int)(corrected.tv_usec/1000));
+               (long)(corrected.tv_sec), (int)(corrected.tv_nsec / 1000000));
     }
     hc_clock_status_db->reference = corrected;
     hc_clock_status_db->synchronized = 1;
+    hc_clock_kalman_reset ();
+    hc_stability_restart ();
+    hc_clock_changed ();
 }
 
-static void hc_clock_adjust (time_t drift) {
+static void hc_clock_adjust (long long drift) {
 
-    struct timeval delta;
+    struct timeval delta; // adjtime() does not support nanoseconds.
 
-    delta.tv_sec = (drift / 1000);
-    delta.tv_usec = (drift % 1000) * 1000;
+    drift /= 1000; // Nanoseconds to microseconds.
+    delta.tv_sec = (drift / 1000000);
+    delta.tv_usec = drift % 1000000;
     if (delta.tv_usec < 0) {
         // Per the GNU libc documentation, tv_usec must be positive, and
         // microsecond time = (tv_sec * 1000000) + tv_usec.
@@ -193,43 +563,261 @@ static void hc_clock_adjust (time_t drift) {
     }
     if (adjtime (&delta, NULL) != 0) {
         printf ("adjtime() error %d\n", errno);
+    } else {
+        hc_clock_kalman_correct (drift * 1000);
     }
-    gettimeofday (&hc_clock_status_db->reference, NULL);
+    clock_gettime (CLOCK_REALTIME, &hc_clock_status_db->reference);
+    hc_clock_changed ();
 }
 
-void hc_clock_synchronize(const struct timeval *source,
-                          const struct timeval *local, int latency) {
+static void hc_clock_kernel_status (struct timex *tx) {
+
+    hc_clock_status_db->kernel.state = adjtimex (tx);
+    hc_clock_status_db->kernel.freq = tx->freq;
+    hc_clock_status_db->kernel.maxerror = tx->maxerror;
+    hc_clock_status_db->kernel.esterror = tx->esterror;
+    hc_clock_status_db->kernel.status = tx->status;
+    if (hc_clock_status_db->kernel.state < 0) {
+        DEBUG printf ("adjtimex() error %d\n", errno);
+    }
+}
+
+static void hc_clock_kernel_query (void) {
+
+    struct timex tx;
+
+    memset (&tx, 0, sizeof(tx)); // Read only.
+    hc_clock_kernel_status (&tx);
+}
+
+static void hc_clock_kernel_start (void) {
+
+    // Reset the kernel loop: clear any pending offset and select the mode.
+
+    struct timex tx;
+
+    memset (&tx, 0, sizeof(tx));
+    tx.modes = ADJ_STATUS | ADJ_NANO | ADJ_OFFSET | ADJ_TIMECONST;
+    tx.status = STA_PLL | STA_NANO;
+    if (clockDiscipline == 'F') tx.status |= STA_FLL;
+    tx.offset = 0;
+    tx.constant = HC_CLOCK_KERNEL_TC;
+    clockKernelState = 0;
+
+    if (clockRestored) {
+        DEBUG printf ("Kernel frequency restored to %.3f ppm\n",
+                      clockRestoredFreq / 65536.0);
+        tx.modes |= ADJ_FREQUENCY;
+        tx.freq = clockRestoredFreq;
+        clockKernelState = 2; // No need to measure it.
+    }
+    hc_clock_kernel_status (&tx);
+}
+
+static void hc_clock_converged (const struct timespec *local) {
+
+    // Record the time to synchronize after startup, and the state
+    // worth remembering for the next startup.
+
+    if (hc_clock_status_db->convergence == 0) {
+        struct timespec now;
+        clock_gettime (CLOCK_MONOTONIC, &now);
+        hc_clock_status_db->convergence = hc_clock_delta (&now, &clockStarted);
+        DEBUG printf ("Converged in %.3f seconds\n",
+                      hc_clock_status_db->convergence / (double)HC_CLOCK_NSEC);
+    }
+    if ((clockDiscipline != 'A') && (clockKernelState == 2)) {
+        hc_state_set ("frequency", hc_clock_status_db->kernel.freq);
+    }
+    hc_state_set ("synchronized", (long long)(local->tv_sec));
+}
+
+static void hc_clock_kernel_frequency (long long drift,
+                                       const struct timespec *local) {
+
+    // The drift changed by (drift - clockKernelDrift) while the time
+    // moved by the elapsed time: this is the frequency error. If the
+    // drift increases, the local clock is too slow.
+
+    struct timex tx;
+    long long elapsed = hc_clock_delta (local, &clockKernelTime);
+    long long skew; // ns/s, i.e. ppm / 1000.
+
+    memset (&tx, 0, sizeof(tx));
+    hc_clock_kernel_status (&tx);
+
+    if (elapsed <= 0) return;
+    if (clockKalmanActive) {
+        skew = (long long)clockKalmanX[1];
+    } else {
+        skew = ((drift - clockKernelDrift) * HC_CLOCK_NSEC) / elapsed;
+    }
+    tx.freq += (long)((skew * 65536LL) / 1000);
+    if (tx.freq > HC_CLOCK_MAXFREQ) tx.freq = HC_CLOCK_MAXFREQ;
+    if (tx.freq < -HC_CLOCK_MAXFREQ) tx.freq = -HC_CLOCK_MAXFREQ;
+
+    DEBUG printf ("Kernel frequency set to %.3f ppm\n", tx.freq / 65536.0);
+
+    tx.modes = ADJ_FREQUENCY;
+    hc_clock_kernel_status (&tx);
+    if (hc_clock_status_db->kernel.state >= 0)
+        hc_clock_kalman_shift (skew);
+}
+
+static void hc_clock_kernel_adjust (long long drift, long long precision) {
+
+    // Feed the average drift to the kernel loop, and tell the kernel
+    // what the error estimates are.
+
+    struct timex tx;
+    long long absdrift = (drift < 0)? (0 - drift) : drift;
+
+    memset (&tx, 0, sizeof(tx));
+    tx.modes = ADJ_OFFSET | ADJ_NANO | ADJ_STATUS
+                   | ADJ_MAXERROR | ADJ_ESTERROR | ADJ_TIMECONST;
+    tx.offset = (long)drift;
+    tx.status = STA_PLL | STA_NANO;
+    if (clockDiscipline == 'F') tx.status |= STA_FLL;
+    tx.constant = HC_CLOCK_KERNEL_TC;
+    tx.esterror = (long)(absdrift / 1000);
+    tx.maxerror = (long)((absdrift + precision) / 1000);
+    hc_clock_kernel_status (&tx);
+    clockKernelUpdate = time(0);
+    if (hc_clock_status_db->kernel.state >= 0)
+        hc_clock_kalman_correct (drift);
+
+    clock_gettime (CLOCK_REALTIME, &hc_clock_status_db->reference);
+}
+
+static int hc_clock_compare (const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+static long long hc_clock_median (const long long *sorted, int count) {
+    if (count & 1) return sorted[count / 2];
+    return (sorted[count / 2 - 1] + sorted[count / 2]) / 2;
+}
+
+static long long hc_clock_estimate (void) {
+
+    // Reduce the samples of the learning period to one drift value,
+    // and calculate the statistics for this period.
+
+    int i;
+    int count = hc_clock_status_db->count;
+    long long sorted[HC_CLOCK_LEARNING_PERIOD];
+    long long deviation[HC_CLOCK_LEARNING_PERIOD];
+    long long median, mad;
+    long long estimate = 0;
+
+    memcpy (sorted, clockSamples, count * sizeof(long long));
+    qsort (sorted, count, sizeof(long long), hc_clock_compare);
+    median = hc_clock_median (sorted, count);
+
+    switch (clockEstimator) {
+        case 'D':
+            estimate = median;
+            break;
+
+        case 'T': {
+            int trim = count / HC_CLOCK_TRIM;
+            long long sum = 0;
+            for (i = trim; i < count - trim; ++i) sum += sorted[i];
+            estimate = sum / (count - (2 * trim));
+            break;
+        }
+
+        case 'W': {
+            // The least delayed sample has the highest drift. Weights
+            // are kept in 1/1024 units, to remain in integer math.
+            long long highest = sorted[count - 1];
+            long long sum = 0;
+            long long weights = 0;
+            for (i = 0; i < count; ++i) {
+                long long delay = highest - sorted[i];
+                long long weight =
+                    (1024LL * HC_CLOCK_WEIGHT) / (HC_CLOCK_WEIGHT + delay);
+                if (weight < 1) weight = 1;
+                sum += sorted[i] * weight;
+                weights += weight;
+            }
+            estimate = sum / weights;
+            break;
+        }
+
+        case 'K':
+            estimate = (long long)clockKalmanX[0];
+            break;
+
+        default:
+            estimate = hc_clock_status_db->accumulator / count;
+    }
+
+    // Statistics: an outlier is more than 3 sigma away from the median,
+    // with sigma estimated as 1.4826 * MAD.
+    //
+    for (i = 0; i < count; ++i) {
+        deviation[i] = sorted[i] - median;
+        if (deviation[i] < 0) deviation[i] = 0 - deviation[i];
+    }
+    qsort (deviation, count, sizeof(long long), hc_clock_compare);
+    mad = hc_clock_median (deviation, count);
+
+    hc_clock_status_db->spread = sorted[count - 1] - sorted[0];
+    hc_clock_status_db->outliers = 0;
+    if (mad > 0) {
+        for (i = 0; i < count; ++i) {
+            long long distance = sorted[i] - median;
+            if (distance < 0) distance = 0 - distance;
+            if (distance * 10000 > mad * 44478) // 3 * 1.4826
+                hc_clock_status_db->outliers += 1;
+        }
+    }
+    return estimate;
+}
+
+static void hc_clock_discipline (const struct timespec *source,
+                                 const struct timespec *local,
+                                 long long latency) {
 
     static int FirstCall = 1;
 
     if (hc_clock_drift_db == 0) return;
     if (hc_clock_status_db == 0) return;
 
-    time_t drift = ((source->tv_sec - local->tv_sec) * 1000)
-                 + ((source->tv_usec - local->tv_usec) / 1000) + latency;
-
-    time_t absdrift = (drift < 0)? (0 - drift) : drift;
+    long long drift = hc_clock_delta (source, local) + latency;
+    long long absdrift = (drift < 0)? (0 - drift) : drift;
+    long long precision = hc_clock_status_db->precision * 1000000LL;
 
-    hc_clock_drift_db[source->tv_sec%HC_CLOCK_DRIFT_DEPTH] = (int)drift;
-    hc_clock_status_db->drift = (int)drift;
+    hc_db_update_begin (hc_clock_drift_db);
+    hc_clock_drift_db[source->tv_sec%HC_CLOCK_DRIFT_DEPTH] = drift;
+    hc_db_update_end (hc_clock_drift_db);
+    hc_clock_status_db->drift = drift;
+    hc_archive_drift (local->tv_sec, drift);
+    if ((!FirstCall) && (absdrift < 10 * HC_CLOCK_NSEC))
+        hc_stability_sample (local, drift);
 
     if (clockShowDrift || hc_test_mode()) {
-        printf ("[%d] %8.3f\n",
-                local->tv_sec%HC_CLOCK_DRIFT_DEPTH, drift/1000.0);
+        printf ("[%d] %11.6f\n",
+                (int)(local->tv_sec%HC_CLOCK_DRIFT_DEPTH),
+                drift / (double)HC_CLOCK_NSEC);
         if (hc_test_mode()) {
-            if (absdrift < hc_clock_status_db->precision) {
-                hc_clock_status_db->synchronized = 1;
-            } else {
-                hc_clock_status_db->synchronized = 0;
+            char synchronized = (absdrift < precision)? 1 : 0;
+            if (synchronized != hc_clock_status_db->synchronized) {
+                hc_clock_status_db->synchronized = synchronized;
+                hc_clock_changed ();
             }
             return;
         }
     }
 
-    if (FirstCall || absdrift >= 10000) {
+    if (FirstCall || absdrift >= 10 * HC_CLOCK_NSEC) {
         // Too much of a difference: force system time.
         hc_clock_force (source, local, latency);
         hc_clock_start_learning(source);
+        if (FirstCall && (clockDiscipline != 'A')) hc_clock_kernel_start ();
         FirstCall = 0;
         return;
     }
@@ -238,48 +826,130 @@ void hc_clock_synchronize(const struct timeval *source,
     // (Do this only if the latency is greater than 0: this indicates
     // a local clock source, sensitive to OS delays.)
     //
-    hc_clock_status_db->accumulator += (int)drift;
+    if (clockEstimator == 'K') {
+        hc_clock_kalman_update (drift, local);
+        if ((clockDiscipline == 'A') && clockKalmanActive) {
+            // Correct continuously, toward the offset predicted for
+            // the next sample.
+            hc_clock_adjust ((long long)(clockKalmanX[0] +
+                             (clockKalmanX[1] * HC_CLOCK_KALMAN_LEAD)));
+        }
+    }
+    clockSamples[(int)hc_clock_status_db->count] = drift;
+    hc_clock_status_db->accumulator += drift;
     hc_clock_status_db->count += 1;
     if ((latency > 0) &&
         (hc_clock_status_db->count < HC_CLOCK_LEARNING_PERIOD)) return;
 
     // We reached the end of a learning period.
-    // At this point we consider only the average drift
-    // calculated over the past learning period.
+    // At this point we consider only the drift estimated
+    // from the samples of the past learning period.
     //
-    drift = hc_clock_status_db->accumulator / hc_clock_status_db->count;
+    drift = hc_clock_estimate ();
     absdrift = (drift < 0)? (0 - drift) : drift;
-    hc_clock_status_db->avgdrift = (int)drift;
+    hc_clock_status_db->avgdrift = drift;
     if (clockShowDrift)
-        printf ("Average drift: %d ms\n", drift);
+        printf ("Average drift: %.3f ms (spread %.3f ms, %d outliers)\n",
+                drift / 1000000.0,
+                hc_clock_status_db->spread / 1000000.0,
+                hc_clock_status_db->outliers);
 
-    if (absdrift < hc_clock_status_db->precision) {
+    if (clockDiscipline != 'A') {
+
+        if (absdrift >= HC_CLOCK_STEP) {
+            // Too far for the kernel loop. The frequency estimate can
+            // still be trusted, if any.
+            DEBUG printf ("Synchronization was lost.\n");
+            hc_clock_status_db->synchronized = 0;
+            hc_clock_force (source, local, latency);
+            hc_clock_start_learning(source);
+            if (clockKernelState < 2) clockKernelState = 0;
+            return;
+        }
+        if (absdrift < precision) {
+            hc_clock_status_db->synchronized = 1;
+            hc_clock_converged (local);
+        } else if (absdrift > 50 * precision) {
+            DEBUG printf ("Synchronization was lost.\n");
+            hc_clock_status_db->synchronized = 0; // Lost it, for now.
+        }
+
+        switch (clockKernelState) {
+            case 0:
+                clockKernelTime = *local;
+                clockKernelDrift = drift;
+                clockKernelState = 1;
+                hc_clock_kernel_query ();
+                break;
+            case 1:
+                if (local->tv_sec
+                        < clockKernelTime.tv_sec + HC_CLOCK_FREQSPAN) {
+                    hc_clock_kernel_query ();
+                    break;
+                }
+                hc_clock_kernel_frequency (drift, local);
+                clockKernelState = 2;
+                clockKernelUpdate = 0;
+                // Also correct the current offset.
+                /* fall through */
+            default:
+                if ((clockDiscipline == 'F') &&
+                    (time(0) < clockKernelUpdate + HC_CLOCK_FLLSPAN)) {
+                    hc_clock_kernel_query (); // Too early for the FLL.
+                    break;
+                }
+                hc_clock_kernel_adjust (drift, precision);
+        }
+        hc_clock_changed ();
+        hc_clock_start_learning(local);
+        return;
+    }
+
+    if (absdrift < precision) {
         DEBUG printf ("Clock is synchronized.\n");
         hc_clock_status_db->synchronized = 1;
+        hc_clock_converged (local);
     } else {
         // Source and local system time have drifted apart
         // by a small difference: adjust the time progressively.
         //
         DEBUG {
-            printf ("Time adjust at %ld.%3.3d (local), drift=%d ms\n",
-                    (long)local->tv_sec, (int)local->tv_usec/1000, drift);
+            printf ("Time adjust at %ld.%3.3d (local), drift=%.3f ms\n",
+                    (long)local->tv_sec, (int)(local->tv_nsec / 1000000),
+                    drift / 1000000.0);
         }
-        if (absdrift > 50 * hc_clock_status_db->precision) {
+        if (absdrift > 50 * precision) {
             DEBUG printf ("Synchronization was lost.\n");
             hc_clock_status_db->synchronized = 0; // Lost it, for now.
         }
-        hc_clock_adjust (drift);
+        // The Kalman filter already corrected the clock on every sample.
+        if (clockEstimator != 'K') hc_clock_adjust (drift);
     }
+    hc_clock_kernel_query ();
+    hc_clock_changed (); // The average drift is the dispersion.
     hc_clock_start_learning(local);
 }
 
+void hc_clock_synchronize(const struct timespec *source,
+                          const struct timespec *local, long long latency) {
+
+    if (hc_clock_status_db == 0) return;
+
+    // The status is changed in many places: make the whole update
+    // visible to the HTTP process at once.
+    //
+    hc_db_update_begin (hc_clock_status_db);
+    hc_clock_discipline (source, local, latency);
+    hc_db_update_end (hc_clock_status_db);
+}
+
 int hc_clock_synchronized (void) {
     if (hc_clock_status_db == 0) return 0;
     return hc_clock_status_db->synchronized;
 }
 
-void hc_clock_reference (struct timeval *reference) {
-    static struct timeval zero = {0, 0};
+void hc_clock_reference (struct timespec *reference) {
+    static struct timespec zero = {0, 0};
     if (hc_clock_status_db == 0) {
         *reference = zero;
         return;
@@ -287,10 +957,15 @@ void hc_clock_reference (struct timeval *reference) {
     *reference = hc_clock_status_db->reference;
 }
 
-int hc_clock_dispersion (void) {
-    int drift;
+int hc_clock_generation (void) {
+    if (hc_clock_status_db == 0) return 0;
+    return hc_clock_status_db->generation;
+}
+
+long long hc_clock_dispersion (void) {
+    long long drift;
     if (hc_clock_status_db == 0) return 0;
-    drift = (int)(hc_clock_status_db->avgdrift);
+    drift = hc_clock_status_db->avgdrift;
     if (drift < 0) return 0 - drift;
     return drift;
 }
@@ -22,12 +22,18 @@
  */
 const char *hc_clock_help (int level);
 
+#define HC_CLOCK_NSEC 1000000000LL // Nanoseconds in one second.
+
 void hc_clock_initialize   (int argc, const char **argv);
-void hc_clock_synchronize  (const struct timeval *source,
-                            const struct timeval *local, int latency);
+void hc_clock_synchronize  (const struct timespec *source,
+                            const struct timespec *local, long long latency);
 int  hc_clock_synchronized (void);
-void hc_clock_reference    (struct timeval *reference);
-int  hc_clock_dispersion   (void);
+void hc_clock_reference    (struct timespec *reference);
+long long hc_clock_dispersion (void);
+int  hc_clock_generation   (void);
+
+long long hc_clock_delta (const struct timespec *a, const struct timespec *b);
+void hc_clock_shift      (struct timespec *t, long long delta);
 
 /* Live database.
  */
@@ -36,13 +42,37 @@ int  hc_clock_dispersion   (void);
 #define HC_CLOCK_STATUS "ClockStatus"
 
 typedef struct {
-    struct timeval cycle;
-    struct timeval reference;
-    int   drift;
-    int   avgdrift;
-    short precision;
+    struct timespec cycle;
+    struct timespec reference;
+    long long drift;    // ns
+    long long avgdrift; // ns
+    short precision;    // ms
     char  synchronized;
     char  count;
-    int   accumulator;
+    long long accumulator;
+    int   generation;
+    char  discipline;   // 'A' (adjtime), 'P' (kernel PLL) or 'F' (kernel FLL).
+    struct {
+        long freq;      // ppm, with a 16 bit fraction.
+        long maxerror;  // us
+        long esterror;  // us
+        int  status;    // STA_xxx flags.
+        int  state;     // TIME_xxx value returned by adjtimex().
+    } kernel;
+    long long convergence; // ns from startup to synchronized, 0 until then.
+    char  restored;     // The kernel frequency was restored at startup.
+    char  estimator;    // 'M' (mean), 'D' (median), 'T' (trimmed), 'W'
+                        // (weighted) or 'K' (Kalman).
+    long long spread;   // ns, highest - lowest drift in the latest period.
+    int   outliers;     // Samples of the latest period far from the median.
+    struct {
+        char   active;
+        double offset;        // ns
+        double skew;          // ns/s
+        double covariance[3]; // offset², offset*skew, skew² (ns, ns/s).
+        double noise;         // ns², the adapted measurement noise.
+        double innovation;    // ns, of the latest sample.
+        int    rejected;      // Samples too far from the prediction.
+    } kalman;
 } hc_clock_status;
 
@@ -52,18 +52,47 @@
  * int hc_db_get_used  (void);
  *
  *    Get information about shared memory usage.
+ *
+ * void hc_db_update_begin (void *data);
+ * void hc_db_update_end   (void *data);
+ *
+ *    Bracket a change to the table, which data was returned by hc_db_get().
+ *    Each table has a sequence counter, which is odd while an update is in
+ *    progress (a seqlock). These never block: there must be only one
+ *    writer for each table at a time, i.e. a single thread, or threads
+ *    serialized by their own lock. Every write to a shared table must be
+ *    within these brackets, including the initialization: a reader may be
+ *    attached at any time. The brackets do not nest.
+ *
+ * unsigned int hc_db_read_begin (const void *data);
+ * int hc_db_read_retry (const void *data, unsigned int sequence);
+ *
+ *    Bracket a read of the table. hc_db_read_begin() waits until no update
+ *    is in progress, and returns the table's sequence. hc_db_read_retry()
+ *    returns true if the table was changed since hc_db_read_begin(): the
+ *    data read is then not consistent and must be read again. The same
+ *    sequence tells if the table was changed since a previous read.
+ *
+ * unsigned int hc_db_snapshot (const void *data, void *copy, int size);
+ *
+ *    Copy the first size bytes of the table consistently, and return the
+ *    sequence of the copy. This never blocks the writer, but retries until
+ *    a copy completes without an update in between.
  */
 
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sched.h>
 
 #include "houseclock.h"
 #include "hc_db.h"
 
 #define HC_DB_DEFAULTSIZE  (1024*1024)
 
+#define HC_DB_ALIGN(x) (((x) + 7) & ~7)
+
 typedef struct {
     int next;
     int size;
@@ -82,6 +111,8 @@ typedef struct {
     hc_db_link link;
     int count;
     int record;
+    unsigned int sequence; // Odd while the table is being updated.
+    int reserved;          // Keep the data aligned on 8 bytes.
 } hc_db_table;
 
 static hc_db_head *hc_db = 0;
@@ -109,7 +140,7 @@ int hc_db_create (int size) {
                  size, strerror(errno));
     }
     hc_db->size = size;
-    hc_db->used = sizeof(hc_db_head);
+    hc_db->used = HC_DB_ALIGN(sizeof(hc_db_head));
     memset (hc_db->index, 0, HC_DB_MODULO * sizeof(int));
     return 0;
 }
@@ -129,7 +160,7 @@ int hc_db_new (const char *name, int size, int count) {
     hc_db_table *table = hc_db_search (name);
     if (table) return EEXIST;
     if (size <= 0 || count <= 0) return EINVAL;
-    int total = sizeof(hc_db_head) + (size * count);
+    int total = HC_DB_ALIGN(sizeof(hc_db_table) + (size * count));
     if (total > hc_db->size - hc_db->used) return ENOMEM;
 
     table = (hc_db_table *)(((char *)hc_db) + hc_db->used);
@@ -140,6 +171,7 @@ int hc_db_new (const char *name, int size, int count) {
     table->link.name[sizeof(table->link.name)-1] = 0;
     table->count = count;
     table->record = size;
+    table->sequence = 0;
     hc_db->index[hash] = hc_db->used;
     hc_db->used += total;
     return 0;
@@ -171,3 +203,47 @@ int hc_db_get_used  (void) {
     return hc_db->used;
 }
 
+static hc_db_table *hc_db_table_of (const void *data) {
+    return ((hc_db_table *)data) - 1;
+}
+
+void hc_db_update_begin (void *data) {
+    hc_db_table *table = hc_db_table_of (data);
+    __atomic_store_n (&table->sequence, table->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence (__ATOMIC_RELEASE);
+}
+
+void hc_db_update_end (void *data) {
+    hc_db_table *table = hc_db_table_of (data);
+    __atomic_store_n (&table->sequence, table->sequence + 1, __ATOMIC_RELEASE);
+}
+
+unsigned int hc_db_read_begin (const void *data) {
+
+    hc_db_table *table = hc_db_table_of (data);
+    unsigned int sequence;
+
+    for (;;) {
+        sequence = __atomic_load_n (&table->sequence, __ATOMIC_ACQUIRE);
+        if ((sequence & 1) == 0) return sequence;
+        sched_yield (); // Let the writer complete its update.
+    }
+}
+
+int hc_db_read_retry (const void *data, unsigned int sequence) {
+    hc_db_table *table = hc_db_table_of (data);
+    __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    return __atomic_load_n (&table->sequence, __ATOMIC_RELAXED) != sequence;
+}
+
+unsigned int hc_db_snapshot (const void *data, void *copy, int size) {
+
+    unsigned int sequence;
+
+    do {
+        sequence = hc_db_read_begin (data);
+        memcpy (copy, data, size);
+    } while (hc_db_read_retry (data, sequence));
+    return sequence;
+}
+
@@ -28,3 +28,11 @@ void *hc_db_get (const char *name);
 int hc_db_get_space (void);
 int hc_db_get_used  (void);
 
+void hc_db_update_begin (void *data);
+void hc_db_update_end   (void *data);
+
+unsigned int hc_db_read_begin (const void *data);
+int hc_db_read_retry (const void *data, unsigned int sequence);
+
+unsigned int hc_db_snapshot (const void *data, void *copy, int size);
+
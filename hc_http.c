@@ -25,6 +25,13 @@
  * void hc_http (int argc, const char **argv);
  *
  *    Run the HTTP server until exit is requested, or the parent dies.
+ *
+ *    The /ntp/latency endpoint returns the histograms of the main loop's
+ *    wakeup latency and of the time spent in the GPS and NTP handlers.
+ *
+ *    The /ntp/drift and /ntp/traffic endpoints accept a resolution
+ *    parameter (1, 60, 900 or 3600 seconds) to return the history kept
+ *    in the archive instead of the latest samples.
  */
 
 #include <sys/mman.h>
@@ -34,6 +41,8 @@
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
+#include <math.h>
+#include <sched.h>
 
 #include "houseclock.h"
 #include "hc_db.h"
@@ -41,6 +50,11 @@
 #include "hc_broadcast.h"
 #include "hc_clock.h"
 #include "hc_ntp.h"
+#include "hc_stability.h"
+#include "hc_archive.h"
+#include "hc_realtime.h"
+#include "hc_latency.h"
+#include "hc_calibrate.h"
 #include "hc_http.h"
 
 #include "echttp_cors.h"
@@ -50,20 +64,89 @@
 
 static pid_t parent;
 
-static long hc_known_clients[256]; // Enough to store IP v4 address.
 static long hc_known_servers[256]; // Enough to store IP v4 address.
 
+// The HTTP process works on private copies of the live tables, which are
+// refreshed only when the table changed (see hc_db_snapshot()). The
+// main process is never blocked, and a copy is always consistent.
+//
+static hc_clock_status *clock_shared = 0;
+static hc_clock_status clock_copy;
+static unsigned int clock_sequence = 1; // Odd: no copy yet.
 static hc_clock_status *clock_db = 0;
+
+static hc_nmea_status *nmea_shared = 0;
+static hc_nmea_status nmea_copy;
+static unsigned int nmea_sequence = 1;
 static hc_nmea_status *nmea_db = 0;
+
+static hc_ntp_status *ntp_shared = 0;
+static hc_ntp_status ntp_copy;
+static unsigned int ntp_sequence = 1;
 static hc_ntp_status *ntp_db = 0;
-static int *drift_db = 0;
+
+// The clients history is split into shards (see hc_ntp.c). The copies
+// of all shards are kept one after the other, and the entries in use are
+// listed from the most recently seen.
+//
+static struct hc_ntp_client *clients_shared[HC_NTP_CLIENT_SHARDS];
+static unsigned int clients_sequence[HC_NTP_CLIENT_SHARDS];
+static struct hc_ntp_client *clients_db = 0;
+static struct hc_ntp_client *clients_spare = 0; // One shard.
+static int clients_size;  // Per shard.
+static int clients_count; // All shards.
+static int *clients_order = 0;
+static int clients_used = 0;
+static unsigned int clients_generation = 0; // Changes with any shard.
+
+// What was reported about each client: these are not stored in the live
+// table, which only the main process writes to.
+//
+struct hc_http_reported {
+    in_addr_t address;
+    int logged;       // The request count when last reported.
+    int synchronized; // Reported as synchronized.
+};
+static struct hc_http_reported *clients_reported = 0;
+
+static struct timespec servers_reported[HC_NTP_POOL];
+
+static hc_realtime_status *realtime_shared = 0;
+static hc_realtime_status realtime_copy;
+static unsigned int realtime_sequence = 1;
+static hc_realtime_status *realtime_db = 0;
+
+static hc_calibrate_status *calibrate_shared = 0;
+static hc_calibrate_status calibrate_copy;
+static unsigned int calibrate_sequence = 1;
+static hc_calibrate_status *calibrate_db = 0;
+
+static long long *drift_shared = 0;
+static unsigned int drift_sequence = 1;
+static long long *drift_db = 0; // ns
 static int drift_count;
 
+static hc_stability_level *stability_shared = 0;
+static unsigned int stability_sequence = 1;
+static hc_stability_level *stability_db = 0;
+static int stability_count;
+
+static hc_archive_bucket *archive_shared = 0;
+static unsigned int archive_sequence = 1;
+static hc_archive_bucket *archive_db = 0;
+static int archive_count;
+
+static hc_latency_metric *latency_shared = 0;
+static unsigned int latency_sequence = 1;
+static hc_latency_metric *latency_db = 0;
+static int latency_count;
+
 static int use_houseportal = 0;
 
 static char hc_hostname[256] = {0};
 
 static char JsonBuffer[16384];
+static char ArchiveBuffer[131072]; // Up to 1440 buckets.
 
 static void *hc_http_attach (const char *name) {
     void *p = hc_db_get (name);
@@ -74,63 +157,284 @@ static void *hc_http_attach (const char *name) {
     return p;
 }
 
+static void hc_http_refresh (const void *shared, void *copy, int size,
+                             unsigned int *sequence) {
+
+    // Copy the table again only if it changed since the latest copy.
+
+    if (hc_db_read_begin (shared) == *sequence) return;
+    *sequence = hc_db_snapshot (shared, copy, size);
+}
+
+static void *hc_http_allocate (const char *name, int size) {
+    void *p = malloc (size);
+    if (!p) {
+        fprintf (stderr, "[%s %d] no memory for a copy of table %s\n",
+                 __FILE__, __LINE__, name);
+        exit (1);
+    }
+    return p;
+}
+
 static int hc_http_attach_clock (void) {
 
-    if (clock_db == 0) {
-        clock_db = (hc_clock_status *) hc_http_attach (HC_CLOCK_STATUS);
-        if (clock_db == 0) return 0;
+    if (clock_shared == 0) {
+        clock_shared = (hc_clock_status *) hc_http_attach (HC_CLOCK_STATUS);
+        if (clock_shared == 0) return 0;
         if (hc_db_get_count (HC_CLOCK_STATUS) != 1
             || hc_db_get_size (HC_CLOCK_STATUS) != sizeof(hc_clock_status)) {
             fprintf (stderr, "[%s %d] wrong data structure for table %s\n",
                      __FILE__, __LINE__, HC_CLOCK_STATUS);
             exit (1);
         }
+        clock_db = &clock_copy;
+    }
+    hc_http_refresh (clock_shared, clock_db, sizeof(clock_copy),
+                     &clock_sequence);
+    return 1;
+}
+
+static int hc_http_attach_realtime (void) {
+
+    if (realtime_shared == 0) {
+        realtime_shared =
+            (hc_realtime_status *) hc_http_attach (HC_REALTIME_STATUS);
+        if (realtime_shared == 0) return 0;
+        if (hc_db_get_count (HC_REALTIME_STATUS) != 1
+            || hc_db_get_size (HC_REALTIME_STATUS)
+                   != sizeof(hc_realtime_status)) {
+            fprintf (stderr, "[%s %d] wrong data structure for table %s\n",
+                     __FILE__, __LINE__, HC_REALTIME_STATUS);
+            exit (1);
+        }
+        realtime_db = &realtime_copy;
+    }
+    hc_http_refresh (realtime_shared, realtime_db, sizeof(realtime_copy),
+                     &realtime_sequence);
+    return 1;
+}
+
+static int hc_http_attach_calibrate (void) {
+
+    if (calibrate_shared == 0) {
+        calibrate_shared =
+            (hc_calibrate_status *) hc_http_attach (HC_CALIBRATE_STATUS);
+        if (calibrate_shared == 0) return 0;
+        if (hc_db_get_count (HC_CALIBRATE_STATUS) != 1
+            || hc_db_get_size (HC_CALIBRATE_STATUS)
+                   != sizeof(hc_calibrate_status)) {
+            fprintf (stderr, "[%s %d] wrong data structure for table %s\n",
+                     __FILE__, __LINE__, HC_CALIBRATE_STATUS);
+            exit (1);
+        }
+        calibrate_db = &calibrate_copy;
+    }
+    hc_http_refresh (calibrate_shared, calibrate_db, sizeof(calibrate_copy),
+                     &calibrate_sequence);
+    return 1;
+}
+
+static int hc_http_attach_ntp (void);
+
+// A clients shard changes with every NTP request from these clients: under
+// heavy load a consistent copy may take many attempts. Give up after a
+// few, and keep the previous copy of that shard until the next refresh.
+//
+#define HC_HTTP_CLIENTS_ATTEMPTS 4
+
+static int hc_http_clients_compare (const void *a, const void *b) {
+
+    // Most recently seen first.
+
+    const struct hc_ntp_client *x = clients_db + *(const int *)a;
+    const struct hc_ntp_client *y = clients_db + *(const int *)b;
+    long long delta = hc_clock_delta (&(y->local), &(x->local));
+    return (delta < 0) ? -1 : ((delta > 0) ? 1 : 0);
+}
+
+static int hc_http_clients_refresh (int shard) {
+
+    // Return 1 if the copy of this shard changed.
+
+    int i;
+    unsigned int sequence;
+    int size = clients_size * sizeof(struct hc_ntp_client);
+
+    sequence = hc_db_read_begin (clients_shared[shard]);
+    if (sequence == clients_sequence[shard]) return 0;
+    for (i = 0; i < HC_HTTP_CLIENTS_ATTEMPTS; ++i) {
+        sequence = hc_db_read_begin (clients_shared[shard]);
+        memcpy (clients_spare, clients_shared[shard], size);
+        if (! hc_db_read_retry (clients_shared[shard], sequence)) break;
+    }
+    if (i >= HC_HTTP_CLIENTS_ATTEMPTS) return 0; // Keep the previous copy.
+
+    memcpy (clients_db + (shard * clients_size), clients_spare, size);
+    clients_sequence[shard] = sequence;
+    return 1;
+}
+
+static int hc_http_attach_clients (void) {
+
+    int i;
+    int changed = 0;
+
+    if (clients_db == 0) {
+        for (i = 0; i < HC_NTP_CLIENT_SHARDS; ++i) {
+            char name[32];
+            snprintf (name, sizeof(name), HC_NTP_CLIENT_SHARD, i);
+            clients_shared[i] = (struct hc_ntp_client *) hc_http_attach (name);
+            if (clients_shared[i] == 0) return 0;
+            if ((hc_db_get_size (name) != sizeof(struct hc_ntp_client)) ||
+                ((i > 0) && (hc_db_get_count (name) != clients_size))) {
+                fprintf (stderr, "[%s %d] wrong data structure for table %s\n",
+                         __FILE__, __LINE__, name);
+                exit (1);
+            }
+            clients_size = hc_db_get_count (name);
+            clients_sequence[i] = 1; // Odd: no copy yet.
+        }
+        clients_count = clients_size * HC_NTP_CLIENT_SHARDS;
+        clients_db = hc_http_allocate
+            (HC_NTP_CLIENTS, clients_count * sizeof(struct hc_ntp_client));
+        clients_spare = hc_http_allocate
+            (HC_NTP_CLIENTS, clients_size * sizeof(struct hc_ntp_client));
+        clients_order = hc_http_allocate
+            (HC_NTP_CLIENTS, clients_count * sizeof(int));
+        memset (clients_db, 0, clients_count * sizeof(struct hc_ntp_client));
+        clients_reported = hc_http_allocate
+            (HC_NTP_CLIENTS, clients_count * sizeof(*clients_reported));
+        memset (clients_reported, 0,
+                clients_count * sizeof(*clients_reported));
     }
+
+    for (i = 0; i < HC_NTP_CLIENT_SHARDS; ++i) {
+        changed |= hc_http_clients_refresh (i);
+    }
+    if (!changed) return 1;
+
+    clients_used = 0;
+    for (i = 0; i < clients_count; ++i) {
+        if (clients_db[i].address.sin_family == 0) continue;
+        clients_order[clients_used++] = i;
+    }
+    qsort (clients_order, clients_used, sizeof(int), hc_http_clients_compare);
+    clients_generation += 1;
     return 1;
 }
 
 static int hc_http_attach_drift (void) {
 
-    if (drift_db == 0) {
-        drift_db = (int *) hc_http_attach (HC_CLOCK_DRIFT);
-        if (drift_db == 0) return 0;
+    if (drift_shared == 0) {
+        drift_shared = (long long *) hc_http_attach (HC_CLOCK_DRIFT);
+        if (drift_shared == 0) return 0;
         drift_count = hc_db_get_count (HC_CLOCK_DRIFT);
-        if (hc_db_get_size (HC_CLOCK_DRIFT) != sizeof(int)) {
+        if (hc_db_get_size (HC_CLOCK_DRIFT) != sizeof(long long)) {
             fprintf (stderr, "[%s %d] wrong data structure for table %s\n",
                      __FILE__, __LINE__, HC_CLOCK_DRIFT);
             exit (1);
         }
+        drift_db = hc_http_allocate
+            (HC_CLOCK_DRIFT, drift_count * sizeof(long long));
+    }
+    hc_http_refresh (drift_shared, drift_db,
+                     drift_count * sizeof(long long), &drift_sequence);
+    return 1;
+}
+
+static int hc_http_attach_stability (void) {
+
+    if (stability_shared == 0) {
+        stability_shared =
+            (hc_stability_level *) hc_http_attach (HC_STABILITY);
+        if (stability_shared == 0) return 0;
+        stability_count = hc_db_get_count (HC_STABILITY);
+        if (hc_db_get_size (HC_STABILITY) != sizeof(hc_stability_level)) {
+            fprintf (stderr, "[%s %d] wrong data structure for table %s\n",
+                     __FILE__, __LINE__, HC_STABILITY);
+            exit (1);
+        }
+        stability_db = hc_http_allocate
+            (HC_STABILITY, stability_count * sizeof(hc_stability_level));
+    }
+    hc_http_refresh (stability_shared, stability_db,
+                     stability_count * sizeof(hc_stability_level),
+                     &stability_sequence);
+    return 1;
+}
+
+static int hc_http_attach_archive (void) {
+
+    if (archive_shared == 0) {
+        archive_shared = (hc_archive_bucket *) hc_http_attach (HC_ARCHIVE);
+        if (archive_shared == 0) return 0;
+        archive_count = hc_db_get_count (HC_ARCHIVE);
+        if (hc_db_get_size (HC_ARCHIVE) != sizeof(hc_archive_bucket)) {
+            fprintf (stderr, "[%s %d] wrong data structure for table %s\n",
+                     __FILE__, __LINE__, HC_ARCHIVE);
+            exit (1);
+        }
+        archive_db = hc_http_allocate
+            (HC_ARCHIVE, archive_count * sizeof(hc_archive_bucket));
+    }
+    hc_http_refresh (archive_shared, archive_db,
+                     archive_count * sizeof(hc_archive_bucket),
+                     &archive_sequence);
+    return 1;
+}
+
+static int hc_http_attach_latency (void) {
+
+    if (latency_shared == 0) {
+        latency_shared = (hc_latency_metric *) hc_http_attach (HC_LATENCY);
+        if (latency_shared == 0) return 0;
+        latency_count = hc_db_get_count (HC_LATENCY);
+        if (hc_db_get_size (HC_LATENCY) != sizeof(hc_latency_metric)) {
+            fprintf (stderr, "[%s %d] wrong data structure for table %s\n",
+                     __FILE__, __LINE__, HC_LATENCY);
+            exit (1);
+        }
+        latency_db = hc_http_allocate
+            (HC_LATENCY, latency_count * sizeof(hc_latency_metric));
     }
+    hc_http_refresh (latency_shared, latency_db,
+                     latency_count * sizeof(hc_latency_metric),
+                     &latency_sequence);
     return 1;
 }
 
 static int hc_http_attach_nmea (void) {
 
-    if (nmea_db == 0) {
-        nmea_db = (hc_nmea_status *) hc_http_attach (HC_NMEA_STATUS);
-        if (nmea_db == 0) return 0;
+    if (nmea_shared == 0) {
+        nmea_shared = (hc_nmea_status *) hc_http_attach (HC_NMEA_STATUS);
+        if (nmea_shared == 0) return 0;
         if (hc_db_get_count (HC_NMEA_STATUS) != 1
             || hc_db_get_size (HC_NMEA_STATUS) != sizeof(hc_nmea_status)) {
             fprintf (stderr, "[%s %d] wrong data structure for table %s\n",
                      __FILE__, __LINE__, HC_NMEA_STATUS);
             exit (1);
         }
+        nmea_db = &nmea_copy;
     }
+    hc_http_refresh (nmea_shared, nmea_db, sizeof(nmea_copy),
+                     &nmea_sequence);
     return 1;
 }
 
 static int hc_http_attach_ntp (void) {
 
-    if (ntp_db == 0) {
-        ntp_db = (hc_ntp_status *) hc_http_attach (HC_NTP_STATUS);
-        if (ntp_db == 0) return 0;
+    if (ntp_shared == 0) {
+        ntp_shared = (hc_ntp_status *) hc_http_attach (HC_NTP_STATUS);
+        if (ntp_shared == 0) return 0;
         if (hc_db_get_count (HC_NTP_STATUS) != 1
             || hc_db_get_size (HC_NTP_STATUS) != sizeof(hc_ntp_status)) {
             fprintf (stderr, "[%s %d] wrong data structure for table %s\n",
                      __FILE__, __LINE__, HC_NTP_STATUS);
             exit (1);
         }
+        ntp_db = &ntp_copy;
     }
+    hc_http_refresh (ntp_shared, ntp_db, sizeof(ntp_copy), &ntp_sequence);
     return 1;
 }
 
@@ -141,6 +445,8 @@ static void hc_background (int fd, int mode) {
     static time_t LastRenewal = 0;
     static time_t LastActivityCheck = 0;
     static time_t LastDriftCheck = 0;
+    static unsigned int LastClientsGeneration = 0;
+    static unsigned int LastNtpSequence = 1;
 
     time_t now = time(0);
 
@@ -169,29 +475,40 @@ static void hc_background (int fd, int mode) {
         }
     }
 
-    if (hc_http_attach_ntp() && (now >= LastActivityCheck + 5)) {
+    if (hc_http_attach_ntp() && hc_http_attach_clients()
+            && (now >= LastActivityCheck + 5)) {
 
         // Generate local events for new or unsynchronized clients.
-        // We generate a local "cache" of known clients to limit the number of
-        // events generated when the clent is not synchronized. The cache key
-        // is the low 7 bits of the IP address, plus the ninth bit: this works
-        // best for me because I have two subnets, while I don't have anywhere
-        // close to 127 machines at home.
-        // This should work fine for most home networks.
+        // A synchronized client is reported only once, until it loses
+        // synchronization. The clients are visited from the most recently
+        // seen, up to the first one not seen since the last check.
+        // Nothing to do if the clients table did not change.
         //
         int i;
-        for (i = 0; i < HC_NTP_DEPTH; ++i) {
-            struct hc_ntp_client *client = ntp_db->clients + i;
+        int used = clients_used;
+        if (clients_generation == LastClientsGeneration) used = 0;
+        LastClientsGeneration = clients_generation;
 
-            // Do not consider events that are empty or too old (risk of
-            // race condition)
+        for (i = 0; i < used; ++i) {
+            int index = clients_order[i];
+            struct hc_ntp_client *client = clients_db + index;
+            struct hc_http_reported *reported = clients_reported + index;
+
+            if (client->address.sin_family == 0) break;
+            if (client->local.tv_sec < LastActivityCheck) break;
+
+            // A different client now uses this entry.
             //
-            if ((client->local.tv_sec < LastActivityCheck)
-                    || (client->local.tv_sec == 0)) continue;
+            if (reported->address != client->address.sin_addr.s_addr) {
+                reported->address = client->address.sin_addr.s_addr;
+                reported->logged = 0;
+                reported->synchronized = 0;
+            }
 
-            // Do not consider events that were already detected.
+            // Do not consider requests that were already detected.
             //
-            if (client->logged) continue;
+            if (reported->logged == client->count) continue;
+            reported->logged = client->count;
 
             int delta = (int)(client->origin.tv_sec - client->local.tv_sec);
             const char *unit = "S";
@@ -199,20 +516,20 @@ static void hc_background (int fd, int mode) {
             if (abs(delta) >= 600) {
                 delta = delta / 60;
                 unit = "MN";
+                reported->synchronized = 0;
             } else if (abs(delta) < 10) {
-                long adr = ntohl(client->address.sin_addr.s_addr);
-                int  hash = (int) ((adr & 0x7f) | ((adr & 0x100) >> 1));
-                if (hc_known_clients[hash] == adr) continue;
-                hc_known_clients[hash] = adr;
+                if (reported->synchronized) continue;
+                reported->synchronized = 1;
 
-                delta = (delta * 1000) +
-                   ((client->origin.tv_usec - client->local.tv_usec) / 1000);
+                delta = (int) (hc_clock_delta (&(client->origin),
+                                               &(client->local)) / 1000000);
                 unit = "MS";
+            } else {
+                reported->synchronized = 0;
             }
             houselog_event_local ("CLIENT",
                                   hc_broadcast_format (&(client->address)),
                                   "ACTIVE", "DELTA %d %s", delta, unit);
-            client->logged = 1;
         }
 
         // Generate events for newly detected servers, using a similar cache
@@ -221,15 +538,18 @@ static void hc_background (int fd, int mode) {
         for (i = 0; i < HC_NTP_POOL; ++i) {
             struct hc_ntp_server *server = ntp_db->pool + i;
 
-            // Do not consider events that are empty or too old (risk of
-            // race condition)
+            if (ntp_sequence == LastNtpSequence) break; // No change.
+
+            // Do not consider events that are empty or too old.
             //
             if ((server->local.tv_sec < LastActivityCheck)
                     || (server->local.tv_sec == 0)) continue;
 
             // Do not consider events that were already detected.
             //
-            if (server->logged) continue;
+            if ((server->local.tv_sec == servers_reported[i].tv_sec)
+                && (server->local.tv_nsec == servers_reported[i].tv_nsec))
+                continue;
  
             int delta = (int)(server->origin.tv_sec - server->local.tv_sec);
             const char *unit = "S";
@@ -243,14 +563,15 @@ static void hc_background (int fd, int mode) {
                 if (hc_known_servers[hash] == adr) continue;
                 hc_known_servers[hash] = adr;
 
-                delta = (delta * 1000) +
-                   ((server->origin.tv_usec - server->local.tv_usec) / 1000);
+                delta = (int) (hc_clock_delta (&(server->origin),
+                                               &(server->local)) / 1000000);
                 unit = "MS";
             }
             houselog_event ("SERVER", server->name, "ACTIVE",
                             "STRATUM %d, DELTA %d %s", server->stratum, delta, unit);
-            server->logged = 1;
+            servers_reported[i] = server->local;
         }
+        LastNtpSequence = ntp_sequence;
         LastActivityCheck = now;
     }
 
@@ -263,7 +584,8 @@ static void hc_background (int fd, int mode) {
         // events would be generated.
         //
         for (i = 0; i < drift_count; ++i) {
-            if (abs(max) < abs(drift_db[i])) max = drift_db[i];
+            int drift = (int) (drift_db[i] / 1000000); // ms
+            if (abs(max) < abs(drift)) max = drift;
         }
         if (max >= 10000) {
             if (abs(max) > MaxDriftLogged) {
@@ -301,7 +623,7 @@ static size_t hc_http_status_gps (char *cursor, int size, const char *prefix) {
 
     char latitude[20];
     char longitude[20];
-    const char *date = "010100";
+    const char *date = "01012000"; // ddmmyyyy
 
     if (! hc_http_attach_nmea()) return 0;
 
@@ -326,12 +648,12 @@ static size_t hc_http_status_gps (char *cursor, int size, const char *prefix) {
     if (nmea_db->fix) {
        snprintf (cursor, size,
                  "%s\"gps\":{\"fix\":true, \"fixtime\":%u"
-                 ",\"gpstime\":\"%s\",\"gpsdate\":\"%4d%2.2s%2.2s\""
+                 ",\"gpstime\":\"%s\",\"gpsdate\":\"%4.4s%2.2s%2.2s\""
                  ",\"latitude\":%s,\"longitude\":%s}",
                  prefix,
                  (unsigned int)nmea_db->fixtime,
                  nmea_db->gpstime,
-                 2000 + (date[4]-'0')*10 + (date[5]-'0'), date+2, date,
+                 date+4, date+2, date,
                  latitude, longitude);
     } else {
        snprintf (cursor, size, "%s\"gps\":{\"fix\":false}", prefix);
@@ -341,23 +663,68 @@ static size_t hc_http_status_gps (char *cursor, int size, const char *prefix) {
 }
 
 static size_t hc_http_status_time (char *cursor, int size, const char *prefix) {
+
+    int length;
+
     if (! hc_http_attach_clock()) return 0;
 
     snprintf (cursor, size,
               "%s\"time\":{\"synchronized\":%s,\"reference\":%zd.%03d"
-              ",\"precision\":%d,\"drift\":%d,\"avgdrift\":%d"
-              ",\"cycle\":%zd.%03d}",
+              ",\"precision\":%d,\"drift\":%.3f,\"avgdrift\":%.3f"
+              ",\"cycle\":%zd.%03d,\"discipline\":\"%s\""
+              ",\"kernel\":{\"freq\":%.3f,\"maxerror\":%ld"
+              ",\"esterror\":%ld,\"status\":%d,\"state\":%d}"
+              ",\"restored\":%s,\"convergence\":%.3f"
+              ",\"estimator\":\"%s\",\"spread\":%.3f,\"outliers\":%d",
               prefix,
               clock_db->synchronized?"true":"false",
               (size_t)clock_db->reference.tv_sec,
-              clock_db->reference.tv_usec/1000,
+              (int)(clock_db->reference.tv_nsec / 1000000),
               clock_db->precision,
-              clock_db->drift,
-              clock_db->avgdrift,
+              clock_db->drift / 1000000.0,
+              clock_db->avgdrift / 1000000.0,
               (size_t) (clock_db->cycle.tv_sec),
-              clock_db->cycle.tv_usec/1000);
-
-    return strlen(cursor);
+              (int)(clock_db->cycle.tv_nsec / 1000000),
+              (clock_db->discipline == 'P') ? "pll" :
+                  ((clock_db->discipline == 'F') ? "fll" : "adjtime"),
+              clock_db->kernel.freq / 65536.0,
+              clock_db->kernel.maxerror,
+              clock_db->kernel.esterror,
+              clock_db->kernel.status,
+              clock_db->kernel.state,
+              clock_db->restored?"true":"false",
+              clock_db->convergence / 1000000000.0,
+              (clock_db->estimator == 'D') ? "median" :
+                  ((clock_db->estimator == 'T') ? "trimmed" :
+                      ((clock_db->estimator == 'W') ? "weighted" :
+                          ((clock_db->estimator == 'K') ? "kalman" : "mean"))),
+              clock_db->spread / 1000000.0,
+              clock_db->outliers);
+    length = strlen(cursor);
+
+    if ((clock_db->estimator == 'K') && (length < size)) {
+        // The filter state, for tuning: offset in ms, skew in ppm,
+        // and the raw covariance & noise (ns and ns/s).
+        snprintf (cursor+length, size-length,
+                  ",\"kalman\":{\"active\":%s,\"offset\":%.3f,\"skew\":%.3f"
+                  ",\"covariance\":[%g,%g,%g],\"noise\":%g"
+                  ",\"innovation\":%.3f,\"rejected\":%d}",
+                  clock_db->kalman.active?"true":"false",
+                  clock_db->kalman.offset / 1000000.0,
+                  clock_db->kalman.skew / 1000.0,
+                  clock_db->kalman.covariance[0],
+                  clock_db->kalman.covariance[1],
+                  clock_db->kalman.covariance[2],
+                  clock_db->kalman.noise,
+                  clock_db->kalman.innovation / 1000000.0,
+                  clock_db->kalman.rejected);
+        length += strlen(cursor+length);
+    }
+    if (length < size - 1) {
+        cursor[length++] = '}';
+        cursor[length] = 0;
+    }
+    return length;
 }
 
 static size_t hc_http_status_ntp (char *cursor, int size, const char *prefix) {
@@ -386,6 +753,28 @@ static size_t hc_http_status_ntp (char *cursor, int size, const char *prefix) {
     return strlen(cursor);
 }
 
+static size_t hc_http_status_realtime (char *cursor, int size,
+                                       const char *prefix) {
+
+    if (! hc_http_attach_realtime()) return 0;
+
+    snprintf (cursor, size,
+              "%s\"realtime\":{\"policy\":\"%s\",\"priority\":%d"
+              ",\"cpu\":%d,\"pinned\":%s,\"locked\":%s,\"timerslack\":%ld"
+              ",\"error\":\"%s\"}",
+              prefix,
+              (realtime_db->policy == SCHED_FIFO) ? "fifo" :
+                  ((realtime_db->policy == SCHED_RR) ? "rr" : "other"),
+              realtime_db->priority,
+              realtime_db->cpu,
+              realtime_db->pinned?"true":"false",
+              realtime_db->locked?"true":"false",
+              realtime_db->timerslack,
+              realtime_db->error);
+
+    return strlen(cursor);
+}
+
 static const char *hc_http_status (const char *method, const char *uri,
                                    const char *data, int length) {
     char *cursor = JsonBuffer;
@@ -425,6 +814,13 @@ static const char *hc_http_status (const char *method, const char *uri,
         prefix = ",";
     }
 
+    added = hc_http_status_realtime(cursor, size, prefix);
+    if (added > 0) {
+        cursor += added;
+        size -= added;
+        prefix = ",";
+    }
+
     snprintf (cursor, size,
               "%s\"mem\":{\"space\":%d,\"used\":%d}}}",
               prefix, hc_db_get_space(), hc_db_get_used());
@@ -442,8 +838,32 @@ static const char *hc_http_gps (const char *method, const char *uri,
 
     if (! hc_http_attach_nmea()) return "";
 
-    snprintf (JsonBuffer, sizeof(JsonBuffer), "{\"gps\":{\"fix\":%s",
-              nmea_db->fix ? "true" : "false");
+    snprintf (JsonBuffer, sizeof(JsonBuffer),
+              "{\"gps\":{\"fix\":%s,\"errors\":{\"checksum\":%d"
+              ",\"framing\":%d},\"timing\":{\"rate\":%d"
+              ",\"jitter\":%.3f,\"bound\":%.3f}",
+              nmea_db->fix ? "true" : "false",
+              nmea_db->checksumerrors, nmea_db->framingerrors,
+              nmea_db->rate,
+              nmea_db->jitter / 1000000.0, nmea_db->bound / 1000000.0);
+
+    if (hc_http_attach_calibrate() && calibrate_db->active) {
+        // All values in milliseconds.
+        snprintf (buffer, sizeof(buffer),
+                  ",\"calibration\":{\"samples\":%d,\"latency\":%.3f"
+                  ",\"confidence\":%.3f,\"converged\":%s"
+                  ",\"reference\":\"%s\",\"latest\":%.3f"
+                  ",\"timestamp\":%lld,\"applied\":%d}",
+                  calibrate_db->samples,
+                  calibrate_db->latency / 1000000.0,
+                  calibrate_db->confidence / 1000000.0,
+                  calibrate_db->converged ? "true" : "false",
+                  calibrate_db->reference,
+                  calibrate_db->latest / 1000000.0,
+                  (long long)(calibrate_db->timestamp),
+                  calibrate_db->applied);
+        strcat (JsonBuffer, buffer);
+    }
 
     if (nmea_db->textcount > 0) {
         prefix = ",\"text\":[\"";
@@ -463,7 +883,8 @@ static const char *hc_http_gps (const char *method, const char *uri,
                   "%s{\"sentence\":\"%s\",\"timestamp\":[%u,%d],\"flags\":%d}",
                   prefix,
                   item->sentence,
-                  item->timing.tv_sec, item->timing.tv_usec / 1000,
+                  (unsigned int)item->timing.tv_sec,
+                  (int)(item->timing.tv_nsec / 1000000),
                   item->flags);
         strcat (JsonBuffer, buffer);
         prefix = ",";
@@ -476,19 +897,179 @@ static const char *hc_http_gps (const char *method, const char *uri,
     return JsonBuffer;
 }
 
+#define HC_ARCHIVE_COUNT     0
+#define HC_ARCHIVE_MIN       1
+#define HC_ARCHIVE_MAX       2
+#define HC_ARCHIVE_MEAN      3
+#define HC_ARCHIVE_RECEIVED  4
+#define HC_ARCHIVE_CLIENT    5
+#define HC_ARCHIVE_BROADCAST 6
+
+static const hc_archive_bucket *hc_http_archive_tier (int *resolution,
+                                                      int *depth,
+                                                      time_t *start) {
+
+    // Validate the resolution parameter and locate its archive tier.
+
+    int offset;
+    time_t now = time(0);
+    const char *parameter = echttp_parameter_get ("resolution");
+
+    *resolution = parameter ? atoi(parameter) : 0;
+    if (hc_archive_tier (*resolution, &offset, depth) < 0) {
+        echttp_error (400, "Invalid resolution");
+        return 0;
+    }
+    if (! hc_http_attach_archive()) return 0;
+
+    *start = (now - (now % *resolution)) - ((*depth - 1) * *resolution);
+    return archive_db + offset;
+}
+
+static char *hc_http_archive_array (char *cursor, const char *name,
+                                    const hc_archive_bucket *tier,
+                                    int resolution, int depth,
+                                    time_t start, int field) {
+
+    // List one field of every bucket, oldest first. The buckets that do
+    // not match the expected start time are missing.
+
+    int i;
+    const char *prefix = "";
+    char *end = ArchiveBuffer + sizeof(ArchiveBuffer) - 8;
+
+    if (cursor >= end) return cursor; // No room left.
+    cursor += snprintf (cursor, end - cursor, ",\"%s\":[", name);
+
+    for (i = 0; i < depth && cursor < end; ++i) {
+        time_t expected = start + ((time_t)i * resolution);
+        const hc_archive_bucket *bucket =
+            tier + ((expected / resolution) % depth);
+
+        if (bucket->start != expected) {
+            if (field <= HC_ARCHIVE_MEAN) {
+                cursor += snprintf (cursor, end - cursor, "%snull", prefix);
+            } else {
+                cursor += snprintf (cursor, end - cursor, "%s0", prefix);
+            }
+            prefix = ",";
+            continue;
+        }
+        switch (field) {
+            case HC_ARCHIVE_COUNT:
+                cursor += snprintf (cursor, end - cursor,
+                                    "%s%d", prefix, bucket->count);
+                break;
+            case HC_ARCHIVE_MIN:
+            case HC_ARCHIVE_MAX:
+            case HC_ARCHIVE_MEAN:
+                if (bucket->count <= 0) {
+                    cursor += snprintf (cursor, end - cursor,
+                                        "%snull", prefix);
+                } else {
+                    long long value = bucket->sum / bucket->count;
+                    if (field == HC_ARCHIVE_MIN) value = bucket->min;
+                    else if (field == HC_ARCHIVE_MAX) value = bucket->max;
+                    cursor += snprintf (cursor, end - cursor,
+                                        "%s%.3f", prefix, value / 1000000.0);
+                }
+                break;
+            case HC_ARCHIVE_RECEIVED:
+                cursor += snprintf (cursor, end - cursor,
+                                    "%s%d", prefix, bucket->received);
+                break;
+            case HC_ARCHIVE_CLIENT:
+                cursor += snprintf (cursor, end - cursor,
+                                    "%s%d", prefix, bucket->client);
+                break;
+            case HC_ARCHIVE_BROADCAST:
+                cursor += snprintf (cursor, end - cursor,
+                                    "%s%d", prefix, bucket->broadcast);
+                break;
+        }
+        prefix = ",";
+    }
+    if (cursor > end) cursor = end;
+    *(cursor++) = ']';
+    *cursor = 0;
+    return cursor;
+}
+
+static const char *hc_http_archive_drift (void) {
+
+    int resolution, depth;
+    time_t start;
+    char *cursor = ArchiveBuffer;
+    const hc_archive_bucket *tier =
+        hc_http_archive_tier (&resolution, &depth, &start);
+
+    if (!tier) return "";
+
+    cursor += snprintf (ArchiveBuffer, sizeof(ArchiveBuffer),
+                        "{\"clock\":{\"resolution\":%d,\"start\":%lld",
+                        resolution, (long long)start);
+    cursor = hc_http_archive_array (cursor, "count", tier,
+                                    resolution, depth, start,
+                                    HC_ARCHIVE_COUNT);
+    cursor = hc_http_archive_array (cursor, "min", tier,
+                                    resolution, depth, start,
+                                    HC_ARCHIVE_MIN);
+    cursor = hc_http_archive_array (cursor, "max", tier,
+                                    resolution, depth, start,
+                                    HC_ARCHIVE_MAX);
+    cursor = hc_http_archive_array (cursor, "mean", tier,
+                                    resolution, depth, start,
+                                    HC_ARCHIVE_MEAN);
+    strcpy (cursor, "}}");
+
+    echttp_content_type_json();
+    return ArchiveBuffer;
+}
+
+static const char *hc_http_archive_traffic (void) {
+
+    int resolution, depth;
+    time_t start;
+    char *cursor = ArchiveBuffer;
+    const hc_archive_bucket *tier =
+        hc_http_archive_tier (&resolution, &depth, &start);
+
+    if (!tier) return "";
+
+    cursor += snprintf (ArchiveBuffer, sizeof(ArchiveBuffer),
+                        "{\"ntp\":{\"mode\":\"%c\",\"resolution\":%d"
+                        ",\"start\":%lld",
+                        ntp_db->mode, resolution, (long long)start);
+    cursor = hc_http_archive_array (cursor, "received", tier,
+                                    resolution, depth, start,
+                                    HC_ARCHIVE_RECEIVED);
+    cursor = hc_http_archive_array (cursor, "client", tier,
+                                    resolution, depth, start,
+                                    HC_ARCHIVE_CLIENT);
+    cursor = hc_http_archive_array (cursor, "broadcast", tier,
+                                    resolution, depth, start,
+                                    HC_ARCHIVE_BROADCAST);
+    strcpy (cursor, "}}");
+
+    echttp_content_type_json();
+    return ArchiveBuffer;
+}
+
 static const char *hc_http_clockdrift (const char *method, const char *uri,
                                        const char *data, int length) {
 
+    if (echttp_parameter_get ("resolution")) return hc_http_archive_drift ();
+
     if (! hc_http_attach_drift()) return "";
 
     snprintf (JsonBuffer, sizeof(JsonBuffer),
-              "{\"clock\":{\"drift\":[%d", drift_db[0]);
+              "{\"clock\":{\"drift\":[%.3f", drift_db[0] / 1000000.0);
 
     int room = sizeof(JsonBuffer) - strlen(JsonBuffer);
     char *p = JsonBuffer + (sizeof(JsonBuffer)-room);
     int i;
     for (i = 1; i < drift_count; ++i) {
-        snprintf (p, room, ",%d", drift_db[i]);
+        snprintf (p, room, ",%.3f", drift_db[i] / 1000000.0);
         room -= strlen(p);
         p = JsonBuffer + (sizeof(JsonBuffer)-room);
     }
@@ -497,6 +1078,132 @@ static const char *hc_http_clockdrift (const char *method, const char *uri,
     return JsonBuffer;
 }
 
+static const char *hc_http_stability (const char *method, const char *uri,
+                                      const char *data, int length) {
+
+    int i;
+    char buffer[256];
+    const char *prefix = "";
+
+    if (! hc_http_attach_stability()) return "";
+
+    // ADEV and MDEV are dimensionless, TDEV and MTIE are in milliseconds.
+    //
+    snprintf (JsonBuffer, sizeof(JsonBuffer),
+              "{\"clock\":{\"stability\":[");
+
+    for (i = 0; i < stability_count; ++i) {
+        hc_stability_level *level = stability_db + i;
+        double tau = level->tau * (double)HC_CLOCK_NSEC;
+        double adev = 0.0;
+        double mdev = 0.0;
+
+        if (level->terms <= 0 && level->mtie <= 0) break;
+
+        if (level->terms > 0) {
+            adev = sqrt (level->adev / (2 * tau * tau * level->terms));
+            mdev = sqrt (level->mdev / (2 * tau * tau * level->terms));
+        }
+        snprintf (buffer, sizeof(buffer),
+                  "%s{\"tau\":%d,\"terms\":%d,\"adev\":%.3e,\"mdev\":%.3e"
+                  ",\"tdev\":%.6f,\"mtie\":%.6f}",
+                  prefix, level->tau, level->terms, adev, mdev,
+                  (tau * mdev / sqrt(3.0)) / 1000000.0,
+                  level->mtie / 1000000.0);
+        strcat (JsonBuffer, buffer);
+        prefix = ",";
+    }
+    strcat (JsonBuffer, "]}}");
+
+    echttp_content_type_json();
+    return JsonBuffer;
+}
+
+static int hc_http_latency_summary (char *buffer, int size,
+                                    const char *name, const int *histogram,
+                                    int count, long long max) {
+
+    return snprintf (buffer, size,
+                     "\"%s\":{\"count\":%d,\"p50\":%.3f,\"p99\":%.3f"
+                     ",\"max\":%.3f}",
+                     name, count,
+                     hc_latency_percentile (histogram, count, 50) / 1000000.0,
+                     hc_latency_percentile (histogram, count, 99) / 1000000.0,
+                     max / 1000000.0);
+}
+
+static const char *hc_http_latency (const char *method, const char *uri,
+                                    const char *data, int length) {
+
+    int i, j;
+    char *p = ArchiveBuffer;
+    int room = sizeof(ArchiveBuffer);
+    int written;
+    const char *prefix = "";
+
+    if (! hc_http_attach_latency()) return "";
+
+    // All values are in milliseconds. Each bucket is listed as its lowest
+    // value and its count since startup; empty buckets are omitted.
+    //
+    written = snprintf (p, room,
+                        "{\"timestamp\":%lld,\"latency\":{",
+                        (long long)time(0));
+    p += written;
+    room -= written;
+
+    for (i = 0; i < latency_count && room > 512; ++i) {
+        hc_latency_metric *metric = latency_db + i;
+        const char *separator = "";
+
+        written = snprintf (p, room, "%s\"%s\":{", prefix, metric->name);
+        p += written;
+        room -= written;
+
+        written = hc_http_latency_summary (p, room, "total", metric->total,
+                                           metric->count, metric->max);
+        p += written;
+        room -= written;
+
+        if (metric->latesttime > 0) {
+            *(p++) = ',';
+            room -= 1;
+            written = hc_http_latency_summary (p, room, "latest",
+                                               metric->latest,
+                                               metric->latestcount,
+                                               metric->latestmax);
+            p += written;
+            room -= written;
+            written = snprintf (p, room, ",\"window\":%d,\"end\":%lld",
+                                HC_LATENCY_WINDOW,
+                                (long long)(metric->latesttime));
+            p += written;
+            room -= written;
+        }
+
+        written = snprintf (p, room, ",\"buckets\":[");
+        p += written;
+        room -= written;
+        for (j = 0; j < HC_LATENCY_BUCKETS && room > 64; ++j) {
+            if (metric->total[j] <= 0) continue;
+            written = snprintf (p, room, "%s[%.3f,%d]", separator,
+                                hc_latency_bucket(j) / 1000000.0,
+                                metric->total[j]);
+            p += written;
+            room -= written;
+            separator = ",";
+        }
+        written = snprintf (p, room, "]}");
+        p += written;
+        room -= written;
+        prefix = ",";
+    }
+    snprintf (p, room, "}}");
+
+    echttp_content_type_json();
+    return ArchiveBuffer;
+}
+
 static const char *hc_http_ntp (const char *method, const char *uri,
                                 const char *data, int length) {
 
@@ -509,41 +1216,67 @@ static const char *hc_http_ntp (const char *method, const char *uri,
     snprintf (JsonBuffer, sizeof(JsonBuffer),
               "{\"ntp\":{\"mode\":\"%c\"", ntp_db->mode);
 
+    // The clients are listed from the most recently seen, until
+    // the buffer is almost full.
+    //
     prefix = ",\"clients\":[";
-    for (i = 0; i < HC_NTP_DEPTH; ++i) {
-        int delta;
-        struct hc_ntp_client *client = ntp_db->clients + i;
+    if (hc_http_attach_clients()) {
+        int room = sizeof(JsonBuffer) - strlen(JsonBuffer) - 2048;
+
+        for (i = 0; i < clients_used; ++i) {
+            int j;
+            long long interval = 0;
+            struct hc_ntp_client *client = clients_db + clients_order[i];
+            if (client->count > 1)
+                interval = hc_clock_delta (&(client->local), &(client->first))
+                               / (client->count - 1);
+            snprintf (buffer, sizeof(buffer),
+               "%s{\"address\":\"%s\",\"timestamp\":%d.%03d,"
+               "\"delta\":%.3f,\"first\":%d,\"count\":%d,"
+               "\"interval\":%.3f,\"offsets\":[",
+               prefix,
+               hc_broadcast_format(&(client->address)),
+               (int)client->local.tv_sec,
+               (int)(client->local.tv_nsec / 1000000),
+               hc_clock_delta (&(client->origin), &(client->local))
+                   / 1000000.0,
+               (int)client->first.tv_sec, client->count,
+               interval / 1000000000.0);
+
+            // The latest offsets, most recent first.
+            for (j = 1; (j <= HC_NTP_OFFSETS) && (j <= client->count); ++j) {
+                char offset[32];
+                int slot = (client->count - j) % HC_NTP_OFFSETS;
+                snprintf (offset, sizeof(offset), "%s%.3f",
+                          (j > 1) ? "," : "",
+                          client->offset[slot] / 1000000.0);
+                strcat (buffer, offset);
+            }
+            strcat (buffer, "]}");
 
-        if (client->local.tv_sec == 0) continue;
-        delta = ((client->origin.tv_sec - client->local.tv_sec) * 1000)
-                + ((client->origin.tv_usec - client->local.tv_usec) / 1000);
-        snprintf (buffer, sizeof(buffer),
-           "%s{\"address\":\"%s\",\"timestamp\":%d.%03d,"
-           "\"delta\":%d}",
-           prefix,
-           hc_broadcast_format(&(client->address)),
-           client->local.tv_sec, client->local.tv_usec / 1000, delta);
-        strcat (JsonBuffer, buffer);
-        prefix = ",";
+            room -= strlen(buffer);
+            if (room <= 0) break;
+            strcat (JsonBuffer, buffer);
+            prefix = ",";
+        }
     }
     if (prefix[1] == 0) strcat(JsonBuffer, "]");
 
     prefix = ",\"servers\":[";
     for (i = 0; i < HC_NTP_POOL; ++i) {
-        int delta;
+        long long delta;
         struct hc_ntp_server *server = ntp_db->pool + i;
 
         if (server->local.tv_sec == 0) continue;
-        delta = ((server->origin.tv_sec - server->local.tv_sec) * 1000)
-                + ((server->origin.tv_usec - server->local.tv_usec) / 1000);
+        delta = hc_clock_delta (&(server->origin), &(server->local));
         snprintf (buffer, sizeof(buffer),
            "%s{\"address\":\"%s\",\"timestamp\":%d.%03d,"
-               "\"delta\":%d,\"stratum\":%d}",
+               "\"delta\":%.3f,\"stratum\":%d}",
            prefix,
            server->name,
-           server->local.tv_sec,
-           server->local.tv_usec / 1000,
-           delta, server->stratum);
+           (int)server->local.tv_sec,
+           (int)(server->local.tv_nsec / 1000000),
+           delta / 1000000.0, server->stratum);
         strcat (JsonBuffer, buffer);
         prefix = ",";
     }
@@ -563,6 +1296,8 @@ static const char *hc_http_traffic (const char *method, const char *uri,
 
     if (! hc_http_attach_ntp()) return "";
 
+    if (echttp_parameter_get ("resolution")) return hc_http_archive_traffic ();
+
     snprintf (JsonBuffer, sizeof(JsonBuffer),
               "{\"ntp\":{\"mode\":\"%c\"", ntp_db->mode);
 
@@ -576,9 +1311,35 @@ static const char *hc_http_traffic (const char *method, const char *uri,
            "%s{\"timestamp\":%d,"
            "\"received\":%d,"
            "\"client\":%d,"
-           "\"broadcast\":%d}",
+           "\"broadcast\":%d,"
+           "\"batches\":%d,"
+           "\"maxbatch\":%d,"
+           "\"rebuilds\":%d,"
+           "\"xdp\":%d,"
+           "\"limited\":%d,"
+           "\"dropped\":%d}",
            prefix, sample->timestamp,
-           sample->received, sample->client, sample->broadcast);
+           sample->received, sample->client, sample->broadcast,
+           sample->batches, sample->maxbatch, sample->rebuilds, sample->xdp,
+           sample->limited, sample->dropped);
+        strcat (JsonBuffer, buffer);
+        prefix = ",";
+    }
+    if (prefix[1] == 0) strcat(JsonBuffer, "]");
+
+    prefix = ",\"workers\":[";
+    for (i = 0; i < ntp_db->workers; ++i) {
+        struct hc_ntp_worker *worker = ntp_db->worker + i;
+
+        snprintf (buffer, sizeof(buffer),
+           "%s{\"cpu\":%d,"
+           "\"received\":%d,"
+           "\"client\":%d,"
+           "\"batches\":%d,"
+           "\"maxbatch\":%d}",
+           prefix, worker->cpu,
+           worker->traffic.received, worker->traffic.client,
+           worker->traffic.batches, worker->traffic.maxbatch);
         strcat (JsonBuffer, buffer);
         prefix = ",";
     }
@@ -622,6 +1383,8 @@ void hc_http (int argc, const char **argv) {
     echttp_route_uri ("/ntp/status", hc_http_status);
     echttp_route_uri ("/ntp/traffic", hc_http_traffic);
     echttp_route_uri ("/ntp/drift", hc_http_clockdrift);
+    echttp_route_uri ("/ntp/stability", hc_http_stability);
+    echttp_route_uri ("/ntp/latency", hc_http_latency);
     echttp_route_uri ("/ntp/gps", hc_http_gps);
     echttp_route_uri ("/ntp/server", hc_http_ntp);
     echttp_static_route ("/", "/usr/local/share/house/public");
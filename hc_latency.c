@@ -0,0 +1,192 @@
+/* houseclock - A simple GPS Time Server with Web console
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * hc_latency.c - Latency histograms of the main loop.
+ *
+ * This module records how late the main loop wakes up compared to its
+ * timer deadline, and how long the NMEA and NTP handlers run. This helps
+ * telling apart a drift caused by the GPS from one caused by local
+ * scheduling delays.
+ *
+ * Each metric is recorded in log-linear histograms (as in HDR histograms):
+ * each power of 2 microseconds is divided into 8 linear buckets, so the
+ * precision is better than 12.5% from 8 microseconds to one minute. The
+ * buckets are fixed: recording a value never allocates memory.
+ *
+ * Each metric has three histograms: since startup, the current window
+ * of HC_LATENCY_WINDOW seconds, and the latest complete window.
+ *
+ * SYNOPSYS:
+ *
+ * void hc_latency_initialize (void);
+ *
+ *    Create the histograms in the live database.
+ *
+ * void hc_latency_record (int metric, long long duration);
+ *
+ *    Record one value (ns) for the specified metric.
+ *
+ * time_t hc_latency_periodic (time_t now);
+ *
+ *    Close the current window if it has ended. Returns the time when
+ *    this function should be called next.
+ *
+ * long long hc_latency_bucket (int index);
+ *
+ *    Return the lowest value (ns) of the specified bucket.
+ *
+ * long long hc_latency_percentile (const int *histogram, int count,
+ *                                  int percent);
+ *
+ *    Return the value (ns) below which the specified percentage of the
+ *    count values recorded in the histogram fall. The value returned is
+ *    the upper limit of the bucket that contains the percentile.
+ */
+
+#include <time.h>
+
+#include "houseclock.h"
+#include "hc_db.h"
+#include "hc_latency.h"
+
+static hc_latency_metric *hc_latency_db = 0;
+
+static time_t hc_latency_window = 0; // Start of the current window.
+
+static const char *hc_latency_names[HC_LATENCY_METRICS] = {
+    "wakeup", "nmea", "ntp", "periodic"
+};
+
+
+void hc_latency_initialize (void) {
+
+    int i = hc_db_new (HC_LATENCY,
+                       sizeof(hc_latency_metric), HC_LATENCY_METRICS);
+    if (i != 0) {
+        fprintf (stderr, "[%s %d] cannot create %s: %s\n",
+                 __FILE__, __LINE__, HC_LATENCY, strerror(i));
+        exit (1);
+    }
+    hc_latency_db = (hc_latency_metric *) hc_db_get (HC_LATENCY);
+    hc_db_update_begin (hc_latency_db);
+    memset (hc_latency_db, 0, sizeof(hc_latency_metric) * HC_LATENCY_METRICS);
+    for (i = 0; i < HC_LATENCY_METRICS; ++i) {
+        snprintf (hc_latency_db[i].name, sizeof(hc_latency_db[i].name),
+                  "%s", hc_latency_names[i]);
+    }
+    hc_db_update_end (hc_latency_db);
+    hc_latency_window = time(0);
+}
+
+static int hc_latency_index (long long duration) {
+
+    // Values below 8 microseconds have one bucket per microsecond.
+    // Above that, the 3 bits after the most significant bit select
+    // the bucket within the power of 2.
+
+    long long value = duration / 1000; // Microseconds.
+    int magnitude;
+    int index;
+
+    if (value < HC_LATENCY_SUBBUCKETS) return (int)(value < 0 ? 0 : value);
+
+    magnitude = 63 - __builtin_clzll ((unsigned long long)value); // >= 3
+    index = ((magnitude - 2) * HC_LATENCY_SUBBUCKETS)
+            + (int)((value >> (magnitude - 3)) & (HC_LATENCY_SUBBUCKETS - 1));
+    if (index >= HC_LATENCY_BUCKETS) index = HC_LATENCY_BUCKETS - 1;
+    return index;
+}
+
+long long hc_latency_bucket (int index) {
+
+    int magnitude;
+
+    if (index < HC_LATENCY_SUBBUCKETS) return index * 1000LL;
+
+    magnitude = (index / HC_LATENCY_SUBBUCKETS) + 2;
+    return ((1LL << magnitude)
+            + ((long long)(index % HC_LATENCY_SUBBUCKETS) << (magnitude - 3)))
+           * 1000LL;
+}
+
+long long hc_latency_percentile (const int *histogram, int count,
+                                 int percent) {
+
+    int i;
+    long long rank = ((long long)count * percent + 99) / 100;
+    long long seen = 0;
+
+    if (count <= 0) return 0;
+    if (rank < 1) rank = 1;
+
+    for (i = 0; i < HC_LATENCY_BUCKETS - 1; ++i) {
+        seen += histogram[i];
+        if (seen >= rank) return hc_latency_bucket (i + 1);
+    }
+    return hc_latency_bucket (HC_LATENCY_BUCKETS - 1);
+}
+
+void hc_latency_record (int metric, long long duration) {
+
+    hc_latency_metric *m;
+    int index;
+
+    if ((!hc_latency_db) || (metric < 0) || (metric >= HC_LATENCY_METRICS))
+        return;
+
+    m = hc_latency_db + metric;
+    index = hc_latency_index (duration);
+
+    hc_db_update_begin (hc_latency_db);
+    m->total[index] += 1;
+    m->count += 1;
+    if (duration > m->max) m->max = duration;
+    m->current[index] += 1;
+    m->currentcount += 1;
+    if (duration > m->currentmax) m->currentmax = duration;
+    hc_db_update_end (hc_latency_db);
+}
+
+time_t hc_latency_periodic (time_t now) {
+
+    int i;
+
+    if (!hc_latency_db) return now + HC_LATENCY_WINDOW;
+
+    if (now < hc_latency_window) hc_latency_window = now; // Time went back.
+    if (now < hc_latency_window + HC_LATENCY_WINDOW)
+        return hc_latency_window + HC_LATENCY_WINDOW;
+
+    hc_db_update_begin (hc_latency_db);
+    for (i = 0; i < HC_LATENCY_METRICS; ++i) {
+        hc_latency_metric *m = hc_latency_db + i;
+        memcpy (m->latest, m->current, sizeof(m->latest));
+        m->latestcount = m->currentcount;
+        m->latestmax = m->currentmax;
+        m->latesttime = now;
+        memset (m->current, 0, sizeof(m->current));
+        m->currentcount = 0;
+        m->currentmax = 0;
+    }
+    hc_db_update_end (hc_latency_db);
+
+    hc_latency_window = now;
+    return now + HC_LATENCY_WINDOW;
+}
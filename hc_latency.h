@@ -0,0 +1,56 @@
+/* houseclock - A simple GPS Time Server with Web console
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * hc_latency.h - Latency histograms of the main loop.
+ */
+#define HC_LATENCY_WAKEUP   0 // How late the timer wakeups are.
+#define HC_LATENCY_NMEA     1 // Duration of hc_nmea_process().
+#define HC_LATENCY_NTP      2 // Duration of hc_ntp_process().
+#define HC_LATENCY_PERIODIC 3 // Duration of hc_ntp_periodic().
+#define HC_LATENCY_METRICS  4
+
+void   hc_latency_initialize (void);
+void   hc_latency_record   (int metric, long long duration);
+time_t hc_latency_periodic (time_t now);
+
+long long hc_latency_bucket (int index);
+long long hc_latency_percentile (const int *histogram, int count, int percent);
+
+/* Live database.
+ */
+#define HC_LATENCY "Latency"
+
+#define HC_LATENCY_SUBBUCKETS 8   // Linear buckets per power of 2.
+#define HC_LATENCY_BUCKETS    192 // Up to about one minute.
+#define HC_LATENCY_WINDOW     60  // Seconds.
+
+typedef struct {
+    char name[16];
+    int  count;                         // Since startup.
+    long long max;                      // ns, since startup.
+    int  total[HC_LATENCY_BUCKETS];     // Since startup.
+    int  current[HC_LATENCY_BUCKETS];   // The current window.
+    int  currentcount;
+    long long currentmax;               // ns
+    int  latest[HC_LATENCY_BUCKETS];    // The latest complete window.
+    int  latestcount;
+    long long latestmax;                // ns
+    time_t latesttime;                  // End of the latest window.
+} hc_latency_metric;
@@ -23,7 +23,7 @@
  * This module consumes raw NMEA data from a serial port or USB, with
  * receive timing information as precise as possible.
  *
- * This module assumes that the timezone was set to "UTC".
+ * The GPS date and time are decoded as UTC, whatever the local timezone.
  *
  * Once a NMEA sentence has been decoded, the module determines:
  * - the status of the fix.
@@ -37,18 +37,25 @@
  * The module determines the first sentence of a fix as the sentence in
  * which the fix time changed.
  *
- * The transmission speed is calculated as the average transmission time
- * of the subsequent blocks of data within a fix. That speed is then used
- * to estimate the actual transmission time for any character in the NMEA
- * stream, and then retrieve when the start of the sentence was received.
- * This estimation is subject to instabilities: the goal is to reach a
- * precision of about 1/10 or 1/100 second, which is way more than needed
- * for a home network.
+ * The timing of the data is fitted by least squares: within a burst, the
+ * time when each block of data is received is a linear function of the
+ * count of bytes received so far. The slope (the line speed) is fitted
+ * over the recent bursts, the start time over the current burst. This is
+ * then used to estimate the actual transmission time for any character in
+ * the NMEA stream, and then retrieve when the start of the sentence was
+ * received. A sentence received in a block that does not fit the model
+ * is flagged. The goal is to reach a precision of about 1/100 second or
+ * better, which is way more than needed for a home network.
  *
  * Once the module has decided which sentence came first, it uses the
  * estimated start time of this sentence as the comparison point with the
  * GPS time, i.e. the local time used to calculate the local time delta.
  *
+ * The GPS time includes the fraction of second, if any. Receivers set to
+ * 5 or 10 fixes per second are supported: the fix period is learned from
+ * the GPS time and defines what gap in the data starts a new burst. Only
+ * the first fix of each second is used to synchronize the clock.
+ *
  * If there is a different, adjtime() is called to correct the local time,
  * unless the delta is too large, in which case the time is just reset.
  *
@@ -76,27 +83,34 @@
  *
  *    The latency depends on the GPS device. It can be estimated by using
  *    the options -drift and -latency=0, and then estimating the average
- *    drift, on a machine where the time is already synchronized using NTP.
- *    Default is 70 ms.
+ *    drift, on a machine where the time is already synchronized using NTP,
+ *    or automatically using the -calibrate option (see hc_calibrate.c).
+ *    Default is 70 ms, or the latency saved in the persistent state for
+ *    this device (calibrated), or else the latest latency used.
  *
  * int hc_nmea_listen (void);
  *
  *    Return the file descriptor to listen to, or else -1 (no device).
  *
- * int hc_nmea_process (const struct timeval *received)
+ * int hc_nmea_process (const struct timespec *received)
  *
  *    Called when new data is available, with the best know receive time,
  *    typically when the application was notified that data is available.
  *    This time will be associated with the last received byte.
  *
- * void hc_nmea_periodic (const struct timeval *now);
+ * time_t hc_nmea_periodic (const struct timespec *now);
  *
  *    This function must be called at regular interval. It is used to detect
- *    stale NMEA and GPS data.
+ *    stale NMEA and GPS data. Return the time (in seconds) when this
+ *    function should be called next.
  *
  * void hc_nmea_active (void);
  *
  *    True if there is an active GPS unit accessible.
+ *
+ * void hc_nmea_set_latency (int latency);
+ *
+ *    Change the GPS latency (ms), typically after a calibration.
  */
 
 /* NMEA sentences:
@@ -107,14 +121,22 @@
  * NMEA frame:
  *    $<sentence>*crc\r\n (crc: 2 hex digits, xor of characters in sentence)
  *
+ * A sentence is only decoded if its checksum is present and valid: noise
+ * on the serial line must not move the clock.
+ *
  * The NMEA sentences that matter to us:
  * GPGLL,lat,N|S,long,E|W,time,A,A*crc  - Current position.
  * GPRMC,time,A|V,lat,N|S,long,E|W,speed,course,date,variation,E|W*crc
  * GPGGA,time,lat,N|S,long,E|W,0|1|2|3|4|5|6|7|8,count,hdop,alt,M,sea,M,n/a,n/a
+ * GPGNS,time,lat,N|S,long,E|W,mode,count,hdop,alt,sea,n/a,n/a[,status]*crc
+ * GPZDA,time,day,month,year,timezone,minutes*crc
  *
  * Other probably rares:
  * GPTRF,time,date,lat,N|S,long,E|W,alt,iterations,doppler,distance,sat*crc
- * GPZDA,time,day,month,year,timezone,minutes*crc
+ *
+ * The talker (the "GP" prefix) depends on the constellations used by the
+ * receiver: GP (GPS), GL (Glonass), GA (Galileo), GB or BD (BeiDou),
+ * GQ (QZSS) or GN (a combination of several systems).
  *
  * There are 2 possible ways to determine the first sentence of a fix:
  * - timing: the largest delay between sentences indicate a new fix.
@@ -128,23 +150,77 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <time.h>
+#include <math.h>
 
 #include "houseclock.h"
 #include "hc_db.h"
 #include "hc_clock.h"
 #include "hc_tty.h"
 #include "hc_nmea.h"
+#include "hc_state.h"
+#include "hc_calibrate.h"
 
 static int gpsLatency;
 
 static char gpsBuffer[2048]; // 2 seconds of NMEA data, even in worst case.
-static int  gpsCount = 0;    // How much NMEA data is stored.
+
+// The NMEA parser consumes one byte at a time, so that only the new data
+// is looked at. Only the sentence being received is stored.
+//
+#define GPSPARSER_IDLE      0 // Waiting for a '$'.
+#define GPSPARSER_BODY      1
+#define GPSPARSER_CHECKSUM1 2
+#define GPSPARSER_CHECKSUM2 3
+
+static int  gpsParser = GPSPARSER_IDLE;
+static char gpsLine[HC_NMEA_MAX_SENTENCE]; // Without '$' and checksum.
+static int  gpsLineLength = 0;
+static long long gpsLineStart = 0;     // Stream offset of the '$'.
+static unsigned char gpsChecksum = 0;  // XOR of the sentence's characters.
+static unsigned char gpsExpected = 0;  // Checksum received.
+static long long gpsStream = 0;        // Bytes received so far.
+
+// The timing model: within a burst, the time when each read returns is
+// a linear function of the count of bytes received so far in the burst.
+// The line rate (the slope) is common to all bursts and is fitted by
+// least squares over the recent bursts, while the start time is fitted
+// for each burst separately. This also works when the driver delivers
+// the data in chunks (e.g. 64 bytes for USB): each chunk is one point.
+//
+// Times are in nanoseconds relative to the first read of the burst.
+// Until a slope can be fitted (e.g. each burst comes in a single read),
+// the data is assumed to have been received all at once.
+//
+#define GPSMODEL_SLOPE  0.0       // ns per byte, until fitted.
+#define GPSMODEL_MEMORY 0.98      // Forgetting factor, per burst.
+#define GPSMODEL_MINDOF 8         // Minimum data before rejecting a point.
+#define GPSMODEL_GATE   4.0       // Maximum residual (standard deviations).
+#define GPSMODEL_FLOOR  2000000.0 // ns, ignore residuals smaller than this.
+
+static struct {
+    struct timespec origin; // When the first read of the burst returned.
+    long long stream;       // Stream offset of the burst's first byte.
+    double n, x, t;         // Count and sums of points (bytes, ns).
+    double xx, xt, tt;      // Sums of products.
+} gpsBurst;
+
+static struct {
+    double xx, xt, tt; // Centered sums of products from previous bursts.
+    double dof;
+} gpsModel;
+
+#define HC_NMEA_PACK2(a,b)   (((a) << 8) | (b))
+#define HC_NMEA_PACK3(a,b,c) (((a) << 16) | ((b) << 8) | (c))
 
 #define GPSFLAGS_NEWFIX    1
 #define GPSFLAGS_NEWBURST  2
+#define GPSFLAGS_OUTLIER   4 // The sentence's timing does not fit the model.
 
 #define GPS_EXPIRES 5
 
+#define GPS_ROLLOVER 1554595200 // The latest GPS week rollover (2019-04-07).
+#define GPS_ROLLOVER_PERIOD (1024 * 7 * 86400)
+
 static const char *gpsDevice = "/dev/ttyACM0";
 static int gpsTty = -1;
 
@@ -155,6 +231,8 @@ static int gpsSpeed = 0;
 
 static time_t gpsInitialized = 0;
 
+static int gpsFixPeriod = 1000; // ms, learned from the GPS time.
+
 static hc_nmea_status *hc_nmea_status_db = 0;
 
 const char *hc_nmea_help (int level) {
@@ -174,8 +252,9 @@ const char *hc_nmea_help (int level) {
 
 static void hc_nmea_reset (void) {
 
-    int i;
-    gpsCount = 0;
+    gpsParser = GPSPARSER_IDLE;
+    gpsBurst.n = 0;
+    hc_db_update_begin (hc_nmea_status_db);
     hc_nmea_status_db->fix = 0;
     hc_nmea_status_db->fixtime = 0;
     hc_nmea_status_db->gpsdevice[0] = 0;
@@ -185,6 +264,7 @@ static void hc_nmea_reset (void) {
     hc_nmea_status_db->longitude[0] = 0;
     hc_nmea_status_db->textcount = 0;
     hc_nmea_status_db->gpscount = 0;
+    hc_db_update_end (hc_nmea_status_db);
 
     if (gpsTty >= 0) close(gpsTty);
     gpsTty = -1;
@@ -193,8 +273,10 @@ static void hc_nmea_reset (void) {
 void hc_nmea_initialize (int argc, const char **argv) {
 
     int i;
-    const char *latency_option = "70";
+    const char *latency_option = 0;
     const char *speed_option = "0";
+    long long latency;
+    char calibrated[128];
 
     gpsDevice = "/dev/ttyACM0";
     gpsUseBurst = 0;
@@ -207,7 +289,17 @@ void hc_nmea_initialize (int argc, const char **argv) {
         if (echttp_option_present ("-privacy", argv[i])) gpsPrivacy = 1;
         if (echttp_option_present ("-show-nmea", argv[i])) gpsShowNmea = 1;
     }
-    gpsLatency = atoi(latency_option);
+    snprintf (calibrated, sizeof(calibrated), "latency:%s", gpsDevice);
+    if (latency_option) {
+        gpsLatency = atoi(latency_option);
+    } else if (hc_state_get (calibrated, &latency)) {
+        gpsLatency = (int)latency;
+    } else if (hc_state_get ("latency", &latency)) {
+        gpsLatency = (int)latency;
+    } else {
+        gpsLatency = 70;
+    }
+    hc_state_set ("latency", gpsLatency);
     gpsSpeed = atoi(speed_option);
 
     if (hc_nmea_status_db == 0) {
@@ -228,31 +320,83 @@ void hc_nmea_initialize (int argc, const char **argv) {
 }
 
 
-static int hc_nmea_splitlines (int *sentences) {
+static int hc_nmea_hex (char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
 
-    int i = 0;
-    int count = 0;
-    int begin;
+static int hc_nmea_parse (char c, long long offset) {
+
+    // Consume one byte of NMEA data, located at the specified offset in
+    // the stream. Return 1 when a complete sentence with a valid checksum
+    // is available in gpsLine, 0 otherwise.
 
-    while (i < gpsCount &&
-           (gpsBuffer[i] == '\n' || gpsBuffer[i] == '\r')) ++i;
-    begin = i;
+    int digit;
 
-    for (; i < gpsCount; ++i) {
-        if (gpsBuffer[i] == '*') { // Eliminate the CRC part.
-            gpsBuffer[i] = 0;
-            continue;
+    if (c == '$') {
+        if (gpsParser != GPSPARSER_IDLE) {
+            hc_nmea_status_db->framingerrors += 1; // Truncated sentence.
+        }
+        gpsParser = GPSPARSER_BODY;
+        gpsLineStart = offset;
+        gpsLineLength = 0;
+        gpsChecksum = 0;
+        return 0;
+    }
+
+    switch (gpsParser) {
+
+    case GPSPARSER_BODY:
+        if (c == '*') {
+            gpsParser = GPSPARSER_CHECKSUM1;
+            return 0;
+        }
+        if (c == '\r' || c == '\n') {
+            DEBUG printf ("NMEA sentence without checksum\n");
+            hc_nmea_status_db->checksumerrors += 1;
+            gpsParser = GPSPARSER_IDLE;
+            return 0;
         }
-        if (gpsBuffer[i] == '\n' || gpsBuffer[i] == '\r') {
-            gpsBuffer[i] = 0;
-            sentences[count++] = begin;
-            while (++i < gpsCount &&
-                   (gpsBuffer[i] == '\n' || gpsBuffer[i] == '\r'));
-            begin = i;
+        if (gpsLineLength >= sizeof(gpsLine) - 1) {
+            hc_nmea_status_db->framingerrors += 1; // Too long.
+            gpsParser = GPSPARSER_IDLE;
+            return 0;
         }
+        gpsLine[gpsLineLength++] = c;
+        gpsChecksum ^= (unsigned char)c;
+        return 0;
+
+    case GPSPARSER_CHECKSUM1:
+        digit = hc_nmea_hex (c);
+        if (digit < 0) break;
+        gpsExpected = digit << 4;
+        gpsParser = GPSPARSER_CHECKSUM2;
+        return 0;
+
+    case GPSPARSER_CHECKSUM2:
+        digit = hc_nmea_hex (c);
+        if (digit < 0) break;
+        gpsParser = GPSPARSER_IDLE;
+        if ((gpsExpected | digit) != gpsChecksum) {
+            gpsLine[gpsLineLength] = 0;
+            DEBUG printf ("NMEA checksum error (%02X, expected %02X): %s\n",
+                          gpsExpected | digit, gpsChecksum, gpsLine);
+            hc_nmea_status_db->checksumerrors += 1;
+            return 0;
+        }
+        gpsLine[gpsLineLength] = 0;
+        return 1;
+
+    default: // Not in a sentence: ignore everything until the next '$'.
+        return 0;
     }
-    sentences[count] = -1; // End of list.
-    return begin;
+
+    // Invalid character in the checksum.
+    hc_nmea_status_db->checksumerrors += 1;
+    gpsParser = GPSPARSER_IDLE;
+    return 0;
 }
 
 static int hc_nmea_splitfields (char *sentence, char *fields[]) {
@@ -286,32 +430,87 @@ static char hc_nmea_isnew (const char *received, char *memorized) {
     return is_new;
 }
 
-static int hc_nmea_2digit (const char *ascii) {
-    return ascii[1] - '0' + 10 * (ascii[0] - '0');
+static int hc_nmea_digits (const char *ascii, int count) {
+
+    // Decode a fixed count of decimal digits. Return -1 if invalid.
+
+    int i;
+    int value = 0;
+
+    for (i = 0; i < count; ++i) {
+        int digit = ascii[i] - '0';
+        if ((digit < 0) || (digit > 9)) return -1;
+        value = (value * 10) + digit;
+    }
+    return value;
+}
+
+static long long hc_nmea_days (int year, int month, int day) {
+
+    // Count of days since 1970-01-01 in the proleptic Gregorian calendar
+    // (Howard Hinnant's days_from_civil). The year starts in March, so
+    // that the leap day is the last day of the year.
+
+    int era, yoe, doy, doe;
+
+    year -= (month <= 2);
+    era = year / 400; // The year is always positive here.
+    yoe = year - (era * 400);
+    doy = ((153 * (month > 2 ? month - 3 : month + 9)) + 2) / 5 + day - 1;
+    doe = (yoe * 365) + (yoe / 4) - (yoe / 100) + doy;
+    return (era * 146097LL) + doe - 719468;
 }
 
-static int hc_nmea_gettime (struct timeval *gmt) {
+static int hc_nmea_gettime (struct timespec *gmt) {
 
-    time_t now = time(0L);
-    struct tm local;
+    // Decode the NMEA date and time into a UTC time. This does not depend
+    // on the local timezone. The date is always stored as ddmmyyyy (see
+    // hc_nmea_rmc()), the time is hhmmss with an optional fraction.
 
-    char *gpsDate = hc_nmea_status_db->gpsdate;
-    char *gpsTime = hc_nmea_status_db->gpstime;
+    const char *gpsDate = hc_nmea_status_db->gpsdate;
+    const char *gpsTime = hc_nmea_status_db->gpstime;
+
+    int year, month, day, hour, minute, second;
+    long nsec = 0;
+    long scale = 100000000;
+    const char *fraction;
 
     if ((gpsDate[0] == 0) || (gpsTime[0] == 0)) return 0;
 
-    // Decode the NMEA time into a GMT timeval value.
-    // TBD: GPS rollover?
-    localtime_r(&now, &local);
-    local.tm_year = 100 + hc_nmea_2digit(gpsDate+4);
-    local.tm_mon = hc_nmea_2digit(gpsDate+2) - 1;
-    local.tm_mday = hc_nmea_2digit(gpsDate);
-    local.tm_hour = hc_nmea_2digit(gpsTime);
-    local.tm_min = hc_nmea_2digit(gpsTime+2);
-    local.tm_sec = hc_nmea_2digit(gpsTime+4);
-    local.tm_isdst = -1;
-    gmt->tv_sec = mktime(&local);
-    gmt->tv_usec = 0;
+    day = hc_nmea_digits (gpsDate, 2);
+    month = hc_nmea_digits (gpsDate+2, 2);
+    year = hc_nmea_digits (gpsDate+4, 4);
+    hour = hc_nmea_digits (gpsTime, 2);
+    minute = hc_nmea_digits (gpsTime+2, 2);
+    second = hc_nmea_digits (gpsTime+4, 2);
+
+    if ((day < 1) || (day > 31) || (month < 1) || (month > 12) ||
+        (year < 2000) || (hour < 0) || (hour > 23) ||
+        (minute < 0) || (minute > 59) || (second < 0) || (second > 60)) {
+        DEBUG printf ("Invalid GPS date or time: %s %s\n", gpsDate, gpsTime);
+        return 0;
+    }
+
+    if (gpsTime[6] == '.') {
+        for (fraction = gpsTime + 7; *fraction && scale > 0; ++fraction) {
+            int digit = *fraction - '0';
+            if ((digit < 0) || (digit > 9)) break;
+            nsec += digit * scale;
+            scale /= 10;
+        }
+    }
+
+    gmt->tv_sec = (time_t)((hc_nmea_days (year, month, day) * 86400LL)
+                           + (hour * 3600) + (minute * 60) + second);
+    gmt->tv_nsec = nsec;
+
+    // Receivers with an old firmware may not handle the GPS week number
+    // rollover, and report a date 1024 weeks too early. No valid date
+    // can be older than the latest rollover.
+    //
+    while (gmt->tv_sec < GPS_ROLLOVER) {
+        gmt->tv_sec += GPS_ROLLOVER_PERIOD;
+    }
     return 1;
 }
 
@@ -324,7 +523,7 @@ static int hc_nmea_valid (const char *status, const char *integrity) {
 }
 
 static void hc_nmea_record (const char *sentence,
-                            struct timeval *timing) {
+                            struct timespec *timing) {
 
     gpsSentence *decoded;
 
@@ -337,7 +536,7 @@ static void hc_nmea_record (const char *sentence,
     decoded->flags = 0;
 }
 
-static void hc_nmea_mark (int flags, const struct timeval *timestamp) {
+static void hc_nmea_mark (int flags, const struct timespec *timestamp) {
     hc_nmea_status_db->history[hc_nmea_status_db->gpscount].flags = flags;
     hc_nmea_status_db->timestamp = *timestamp;
 }
@@ -357,81 +556,165 @@ static void hc_nmea_store_position (char **fields) {
 
 static int hc_nmea_is_valid_talker (const char *name) {
 
-    // We only accept GP (GPS), GA (Galileo) and GL (Glonass).
-    static char isvalid[128] = {0};
-    if (!isvalid['P']) {
-        isvalid['P'] = isvalid['A'] = isvalid['L'] = 1;
+    switch (HC_NMEA_PACK2(name[0], name[1])) {
+        case HC_NMEA_PACK2('G','P'): // GPS
+        case HC_NMEA_PACK2('G','L'): // Glonass
+        case HC_NMEA_PACK2('G','A'): // Galileo
+        case HC_NMEA_PACK2('G','B'): // BeiDou
+        case HC_NMEA_PACK2('B','D'): // BeiDou (older receivers)
+        case HC_NMEA_PACK2('G','Q'): // QZSS
+        case HC_NMEA_PACK2('G','N'): // Multiple constellations.
+            return 1;
     }
+    return 0;
+}
 
-    if (name[0] != 'G') return 0;
-    return (int)(isvalid[name[1] & 0x7f]);
+static int hc_nmea_rmc (char **fields, int count) {
+
+    // GPRMC,time,A|V,lat,N|S,long,E|W,speed,course,date,variation,E|W,...
+
+    int newfix = 0;
+    char date[12];
+
+    if (hc_nmea_valid (fields[2], fields[12])) {
+        // Store the date as ddmmyyyy, like ZDA does, so that both
+        // sentences can be mixed. NMEA receivers were not in use
+        // before 2000.
+        if (strlen(fields[9]) != 6) return 0;
+        snprintf (date, sizeof(date), "%4.4s20%2.2s", fields[9], fields[9]+4);
+
+        newfix = hc_nmea_isnew(fields[1], hc_nmea_status_db->gpstime) |
+                 hc_nmea_isnew(date, hc_nmea_status_db->gpsdate);
+        if (newfix) hc_nmea_store_position (fields+3);
+    } else {
+        hc_nmea_status_db->fix = 0;
+    }
+    return newfix;
 }
 
-static int hc_nmea_decode (char *sentence) {
+static int hc_nmea_gga (char **fields, int count) {
+
+    // GPGGA,time,lat,N|S,long,E|W,0|1|2|3|4|5|6|7|8,count,...
 
-    char *fields[80]; // large enough for no overflow ever.
-    int count;
     int newfix = 0;
+    char fix = fields[6][0];
+    int  sats = atoi(fields[7]);
+
+    if (fix >= '1' && fix <= '5' && sats >= 3) {
+        newfix = hc_nmea_isnew(fields[1], hc_nmea_status_db->gpstime);
+        if (newfix) hc_nmea_store_position (fields+2);
+    } else {
+        hc_nmea_status_db->fix = 0;
+    }
+    return newfix;
+}
+
+static int hc_nmea_gll (char **fields, int count) {
 
-    char *gpsDate = hc_nmea_status_db->gpsdate;
-    char *gpsTime = hc_nmea_status_db->gpstime;
+    // GPGLL,lat,N|S,long,E|W,time,A|V,A|D|E|N|S
+
+    int newfix = 0;
+
+    if (hc_nmea_valid (fields[6], fields[7])) {
+        newfix = hc_nmea_isnew(fields[5], hc_nmea_status_db->gpstime);
+        if (newfix) hc_nmea_store_position (fields+1);
+    } else {
+        hc_nmea_status_db->fix = 0;
+    }
+    return newfix;
+}
+
+static int hc_nmea_gns (char **fields, int count) {
+
+    // GPGNS,time,lat,N|S,long,E|W,mode,count,...
+    //
+    // The mode has one character per constellation: the fix is valid
+    // if at least one is autonomous, differential, precise or RTK.
+
+    int newfix = 0;
+    int sats = atoi(fields[7]);
+
+    if ((strpbrk (fields[6], "ADPRF") != 0) && (sats >= 3)) {
+        newfix = hc_nmea_isnew(fields[1], hc_nmea_status_db->gpstime);
+        if (newfix) hc_nmea_store_position (fields+2);
+    } else {
+        hc_nmea_status_db->fix = 0;
+    }
+    return newfix;
+}
+
+static int hc_nmea_zda (char **fields, int count) {
+
+    // GPZDA,time,day,month,year,timezone,minutes
+    //
+    // This sentence has no fix status: the receiver may report the time
+    // from its own RTC. It is only trusted when another sentence reported
+    // a valid fix.
+
+    char date[12];
+
+    if (!hc_nmea_status_db->fix) return 0;
+    if ((strlen(fields[2]) != 2) ||
+        (strlen(fields[3]) != 2) || (strlen(fields[4]) != 4)) return 0;
+
+    // The full year is kept: ddmmyyyy.
+    snprintf (date, sizeof(date), "%s%s%s", fields[2], fields[3], fields[4]);
+
+    return hc_nmea_isnew(fields[1], hc_nmea_status_db->gpstime) |
+           hc_nmea_isnew(date, hc_nmea_status_db->gpsdate);
+}
+
+static int hc_nmea_txt (char **fields, int count) {
+
+    int line = hc_nmea_status_db->textcount;
+
+    if (line < HC_NMEA_TEXT_LINES) {
+        strncpy (hc_nmea_status_db->text[line].line,
+                 fields[4], sizeof (hc_nmea_status_db->text[0].line));
+        hc_nmea_status_db->textcount += 1;
+    }
+    return 0;
+}
+
+static const struct {
+    int code;   // The message type: 3 characters packed.
+    int fields; // The minimum number of fields, including the address.
+    int (*decode) (char **fields, int count);
+} hc_nmea_sentences[] = {
+    {HC_NMEA_PACK3('R','M','C'), 13, hc_nmea_rmc},
+    {HC_NMEA_PACK3('G','G','A'),  8, hc_nmea_gga},
+    {HC_NMEA_PACK3('G','L','L'),  8, hc_nmea_gll},
+    {HC_NMEA_PACK3('G','N','S'),  8, hc_nmea_gns},
+    {HC_NMEA_PACK3('Z','D','A'),  5, hc_nmea_zda},
+    {HC_NMEA_PACK3('T','X','T'),  5, hc_nmea_txt},
+    {0, 0, 0}
+};
+
+static int hc_nmea_decode (char *sentence) {
+
+    char *fields[HC_NMEA_MAX_SENTENCE + 1]; // One more than the commas.
+    int count;
+    int code;
+    int i;
 
     count = hc_nmea_splitfields(sentence, fields);
 
+    // The address field is a 2-character talker and a 3-character type.
+    if (strlen(fields[0]) != 5) return 0;
     if (!hc_nmea_is_valid_talker(fields[0])) return 0;
 
-    const char *message = fields[0] + 2;
-
-    if (strcmp ("RMC", message) == 0) {
-        // GPRMC,time,A|V,lat,N|S,long,E|W,speed,course,date,variation,E|W,...
-        if (count > 12) {
-            if (hc_nmea_valid (fields[2], fields[12])) {
-                newfix =
-                    hc_nmea_isnew(fields[1], gpsTime) |
-                    hc_nmea_isnew(fields[9], gpsDate);
-                if (newfix) hc_nmea_store_position (fields+3);
-            } else {
-                hc_nmea_status_db->fix = 0;
-            }
-        } else {
-            DEBUG printf ("Invalid RMC sentence: too few fields\n");
-        }
-    } else if (strcmp ("GGA", message) == 0) {
-        // GPGGA,time,lat,N|S,long,E|W,0|1|2|3|4|5|6|7|8,count,...
-        if (count > 6) {
-            char fix = fields[6][0];
-            int  sats = atoi(fields[7]);
-            if (fix >= '1' && fix <= '5' && sats >= 3) {
-                newfix = hc_nmea_isnew(fields[1], gpsTime);
-                if (newfix) hc_nmea_store_position (fields+2);
-            } else {
-                hc_nmea_status_db->fix = 0;
-            }
-        } else {
-            DEBUG printf ("Invalid GGA sentence: too few fields\n");
-        }
-    } else if (strcmp ("GLL", message) == 0) {
-        // GPGLL,lat,N|S,long,E|W,time,A|V,A|D|E|N|S
-        if (count > 7) {
-            if (hc_nmea_valid (fields[6], fields[7])) {
-                newfix = hc_nmea_isnew(fields[5], gpsTime);
-                if (newfix) hc_nmea_store_position (fields+1);
-            } else {
-                hc_nmea_status_db->fix = 0;
-            }
-        } else {
-            DEBUG printf ("Invalid GLL sentence: too few fields\n");
-        }
-    } else if (strcmp ("TXT", message) == 0) {
-        int count = hc_nmea_status_db->textcount;
-        if (count < HC_NMEA_TEXT_LINES) {
-            strncpy (hc_nmea_status_db->text[count].line,
-                 fields[4], sizeof (hc_nmea_status_db->text[0].line));
-            hc_nmea_status_db->textcount += 1;
+    code = HC_NMEA_PACK3(fields[0][2], fields[0][3], fields[0][4]);
+
+    for (i = 0; hc_nmea_sentences[i].code; ++i) {
+        if (hc_nmea_sentences[i].code != code) continue;
+        if (count < hc_nmea_sentences[i].fields) {
+            DEBUG printf ("Invalid %s sentence: too few fields\n",
+                          fields[0]+2);
+            return 0;
         }
+        return hc_nmea_sentences[i].decode (fields, count)?GPSFLAGS_NEWFIX:0;
     }
-
-    return newfix?GPSFLAGS_NEWFIX:0;
+    return 0;
 }
 
 static int hc_nmea_ready (int flags) {
@@ -448,127 +731,249 @@ static int hc_nmea_ready (int flags) {
     return (flags == GPSFLAGS_NEWFIX+GPSFLAGS_NEWBURST);
 }
 
-static void hc_nmea_timing (const struct timeval *received,
-                            struct timeval *timing, int speed, int count) {
+static void hc_nmea_model_start (const struct timespec *received) {
 
-    int64_t usdelta = (count * 1000L) / speed;
+    // Fold the burst that just ended into the model, then start a new one.
+    // The older bursts are progressively forgotten.
 
-    if (usdelta > received->tv_usec) {
-        timing->tv_usec = 1000000 + received->tv_usec - usdelta;
-        timing->tv_sec = received->tv_sec - 1;
-    } else {
-        timing->tv_usec = received->tv_usec - usdelta;
-        timing->tv_sec = received->tv_sec;
+    if (gpsBurst.n >= 2) {
+        gpsModel.xx = (gpsModel.xx * GPSMODEL_MEMORY)
+                      + gpsBurst.xx - (gpsBurst.x * gpsBurst.x / gpsBurst.n);
+        gpsModel.xt = (gpsModel.xt * GPSMODEL_MEMORY)
+                      + gpsBurst.xt - (gpsBurst.x * gpsBurst.t / gpsBurst.n);
+        gpsModel.tt = (gpsModel.tt * GPSMODEL_MEMORY)
+                      + gpsBurst.tt - (gpsBurst.t * gpsBurst.t / gpsBurst.n);
+        gpsModel.dof = (gpsModel.dof * GPSMODEL_MEMORY) + gpsBurst.n - 1;
+    }
+    gpsBurst.origin = *received;
+    gpsBurst.stream = gpsStream;
+    gpsBurst.n = gpsBurst.x = gpsBurst.t = 0.0;
+    gpsBurst.xx = gpsBurst.xt = gpsBurst.tt = 0.0;
+}
+
+static double hc_nmea_model_slope (void) {
+
+    // The time per byte (ns): the slope pooled over all bursts, including
+    // the current one. Each burst has its own start time.
+
+    double xx = gpsModel.xx;
+    double xt = gpsModel.xt;
+
+    if (gpsBurst.n >= 2) {
+        xx += gpsBurst.xx - (gpsBurst.x * gpsBurst.x / gpsBurst.n);
+        xt += gpsBurst.xt - (gpsBurst.x * gpsBurst.t / gpsBurst.n);
     }
+    if ((xx < 1.0) || (xt <= 0.0)) return GPSMODEL_SLOPE;
+    return xt / xx;
 }
-                            
-int hc_nmea_process (const struct timeval *received) {
 
-    static int64_t gpsTotal = 0;
-    static int64_t gpsDuration = 0;
-    static struct timeval previous;
-    static struct timeval bursttiming;
+static double hc_nmea_model_sigma (double slope, double *dof) {
+
+    // The standard deviation of the residuals (ns).
+
+    double xx = gpsModel.xx;
+    double xt = gpsModel.xt;
+    double tt = gpsModel.tt;
+    double ssr;
+
+    *dof = gpsModel.dof - 1;
+    if (gpsBurst.n >= 2) {
+        xx += gpsBurst.xx - (gpsBurst.x * gpsBurst.x / gpsBurst.n);
+        xt += gpsBurst.xt - (gpsBurst.x * gpsBurst.t / gpsBurst.n);
+        tt += gpsBurst.tt - (gpsBurst.t * gpsBurst.t / gpsBurst.n);
+        *dof += gpsBurst.n - 1;
+    }
+    if (*dof < 1.0) return 0.0;
+
+    ssr = tt - (slope * xt);
+    if (ssr <= 0.0) return 0.0;
+    return sqrt (ssr / *dof);
+}
+
+static double hc_nmea_model_start_time (double slope) {
+
+    // When the first byte of the current burst was received (ns, relative
+    // to the burst's origin), according to the model.
+
+    if (gpsBurst.n <= 0) return 0.0;
+    return (gpsBurst.t - (slope * gpsBurst.x)) / gpsBurst.n;
+}
+
+static int hc_nmea_model_add (const struct timespec *received, int bytes) {
+
+    // Add one data point: the data received so far in the burst, up to
+    // the last byte of this read. Return 1 if this point does not fit the
+    // model, i.e. the read was unexpectedly delayed (or early): such a
+    // point is left out of the fit.
+
+    double x = (double)(gpsStream + bytes - gpsBurst.stream);
+    double t = (double)hc_clock_delta (received, &gpsBurst.origin);
+    double slope = hc_nmea_model_slope ();
+    double dof;
+    double sigma = hc_nmea_model_sigma (slope, &dof);
+    double residual = 0.0;
+
+    if (gpsBurst.n > 0) {
+        residual = t - (hc_nmea_model_start_time (slope) + (slope * x));
+        if ((dof >= GPSMODEL_MINDOF) &&
+            (fabs(residual) > GPSMODEL_GATE * sigma) &&
+            (fabs(residual) > GPSMODEL_FLOOR)) {
+            if (gpsShowNmea)
+                printf ("Data received %.3f ms off the timing model\n",
+                        residual / 1000000.0);
+            return 1;
+        }
+    }
+    gpsBurst.n += 1;
+    gpsBurst.x += x;
+    gpsBurst.t += t;
+    gpsBurst.xx += x * x;
+    gpsBurst.xt += x * t;
+    gpsBurst.tt += t * t;
+    return 0;
+}
+
+static void hc_nmea_model_publish (double slope) {
+
+    double dof;
+    double sigma = hc_nmea_model_sigma (slope, &dof);
+    double xx = gpsModel.xx;
+    double mean;
+    double bound = 0.0;
+
+    if (gpsBurst.n >= 2)
+        xx += gpsBurst.xx - (gpsBurst.x * gpsBurst.x / gpsBurst.n);
+
+    // The uncertainty on the burst start time, from the residuals.
+    if ((gpsBurst.n > 0) && (xx >= 1.0)) {
+        mean = gpsBurst.x / gpsBurst.n;
+        bound = sigma * sqrt ((1.0 / gpsBurst.n) + (mean * mean / xx));
+    }
+    hc_nmea_status_db->rate = (slope > 0.0) ? (int)(HC_CLOCK_NSEC / slope) : 0;
+    hc_nmea_status_db->jitter = (long long)sigma;
+    hc_nmea_status_db->bound = (long long)bound;
+}
+
+static void hc_nmea_timing (struct timespec *timing, double slope,
+                            long long offset) {
+
+    // The time when the byte at this stream offset was received.
+
+    double t = hc_nmea_model_start_time (slope)
+               + (slope * (double)(offset - gpsBurst.stream + 1));
+
+    *timing = gpsBurst.origin;
+    hc_clock_shift (timing, (long long)t);
+}
+
+int hc_nmea_process (const struct timespec *received) {
+
+    static struct timespec previous;
+    static struct timespec bursttiming;
 
     static int flags = 0;
+    static struct timespec latestfix;
+    static time_t synchronized = 0;
 
     time_t interval;
-    int speed;
-    int i, j, leftover;
+    double slope;
+    int i;
+    int decoded;
+    int outlier;
     ssize_t length;
-    int sentences [1024]; // Large enough to never overflow.
 
-    if (gpsCount == sizeof(gpsBuffer)) {
-        gpsCount = 0; // Buffer should never be full: forget accumulated data.
-    }
-    length = read (gpsTty, gpsBuffer+gpsCount, sizeof(gpsBuffer)-gpsCount);
+    length = read (gpsTty, gpsBuffer, sizeof(gpsBuffer));
     if (length <= 0) {
         hc_nmea_reset();
         return -1;
     }
-    gpsCount += length;
 
-    // Calculate timing.
-    //
-    interval = (received->tv_usec - previous.tv_usec) / 1000 +
-               (received->tv_sec - previous.tv_sec) * 1000;
+    interval = (time_t)(hc_clock_delta (received, &previous) / 1000000);
 
-    if (interval < 300) {
-        if (gpsTotal > 1000000) {
-            gpsTotal /= 2;
-            gpsDuration /= 2;
+    // Update the status as a whole, so that the HTTP process never sees
+    // the decoding of the data just read half done.
+    //
+    hc_db_update_begin (hc_nmea_status_db);
+
+    if ((gpsBurst.n <= 0) || (interval > gpsFixPeriod / 2)) {
+        hc_nmea_model_start (received);
+        if (previous.tv_nsec > 0) {
+            // Whatever GPS time we got before is now old.
+            hc_nmea_status_db->gpsdate[0] = hc_nmea_status_db->gpstime[0] = 0;
+            flags = GPSFLAGS_NEWBURST;
         }
-        gpsTotal += length;
-        gpsDuration += interval;
-    }
-
-    if (gpsDuration > 0) {
-        // We multiply the speed by 1000 to get some precision.
-        // The other 1000 is because gpsDuration is in milliseconds.
-        speed = (1000 * 1000 * gpsTotal) / gpsDuration;
-        if(gpsShowNmea)
-            printf ("Calculated speed: %d.%03d Bytes/s\n",
-                    speed/1000, speed%1000);
-    } else {
-        speed = 115000; // Arbitrary speed at the beginning.
     }
+    previous = *received;
 
-    if (previous.tv_usec > 0 && interval > 500) {
-        hc_nmea_timing (received, &bursttiming, speed, gpsCount);
-        if (gpsShowNmea) {
-            printf ("Data received at %d.%03d, burst started at %d.%03d\n",
-                     received->tv_sec, received->tv_usec/1000,
-                     bursttiming.tv_sec, bursttiming.tv_usec/1000);
-        }
-        // Whatever GPS time we got before is now old.
-        hc_nmea_status_db->gpsdate[0] = hc_nmea_status_db->gpstime[0] = 0;
-        flags = GPSFLAGS_NEWBURST;
+    // Calculate timing: fit the data received in this burst so far.
+    //
+    outlier = hc_nmea_model_add (received, length);
+    slope = hc_nmea_model_slope ();
+    hc_nmea_timing (&bursttiming, slope, gpsBurst.stream);
+    hc_nmea_model_publish (slope);
+
+    if (gpsShowNmea) {
+        printf ("Data received at %d.%03d, burst started at %d.%03d"
+                " (%d Bytes/s)\n",
+                (int)received->tv_sec, (int)(received->tv_nsec / 1000000),
+                (int)bursttiming.tv_sec, (int)(bursttiming.tv_nsec / 1000000),
+                hc_nmea_status_db->rate);
     }
-    previous = *received;
 
-    // Analyze the NMEA data we have accumulated.
+    // Analyze the new NMEA data, one verified sentence at a time.
     //
-    leftover = hc_nmea_splitlines (sentences);
+    for (i = 0; i < length; ++i) {
 
-    for (i = 0; sentences[i] >= 0; ++i) {
+        struct timespec timing;
 
-        int start = sentences[i];
+        if (!hc_nmea_parse (gpsBuffer[i], gpsStream + i)) continue;
 
         // Calculate the timing of the '$'.
-        struct timeval timing;
-        hc_nmea_timing (received, &timing, speed, gpsCount - start);
-
-        if (gpsBuffer[start++] != '$') continue; // Skip invalid sentence.
+        hc_nmea_timing (&timing, slope, gpsLineStart);
 
         if (gpsShowNmea) {
             printf ("%11d.%03.3d: %s\n",
-                    timing.tv_sec, timing.tv_usec/1000, gpsBuffer+start);
+                    (int)timing.tv_sec, (int)(timing.tv_nsec / 1000000),
+                    gpsLine);
         }
 
-        hc_nmea_record (gpsBuffer+start, &timing);
+        hc_nmea_record (gpsLine, &timing);
+
+        decoded = hc_nmea_decode (gpsLine);
+        flags |= decoded;
 
-        flags |= hc_nmea_decode (gpsBuffer+start);
+        hc_nmea_mark (outlier?(flags|GPSFLAGS_OUTLIER):flags, &bursttiming);
 
-        hc_nmea_mark (flags, &bursttiming);
+        if (decoded & GPSFLAGS_NEWFIX) {
+            // Learn the fix period, for receivers set to 5 or 10 Hz.
+            struct timespec gmt;
+            if (hc_nmea_gettime(&gmt)) {
+                long long period = hc_clock_delta (&gmt, &latestfix) / 1000000;
+                if ((period >= 50) && (period <= 1000)) gpsFixPeriod = period;
+                latestfix = gmt;
+            }
+        }
 
         if (hc_nmea_ready(flags)) {
-            struct timeval gmt;
+            struct timespec gmt;
             if (hc_nmea_gettime(&gmt)) {
-                if (gpsUseBurst)
-                   hc_clock_synchronize (&gmt, &bursttiming, gpsLatency);
-                else
-                   hc_clock_synchronize (&gmt, &timing, gpsLatency);
+                // The clock discipline expects one sample per second:
+                // only use the first fix of each second.
+                if (gmt.tv_sec != synchronized) {
+                    const struct timespec *reference =
+                        gpsUseBurst ? &bursttiming : &timing;
+                    hc_clock_synchronize
+                        (&gmt, reference, gpsLatency * 1000000LL);
+                    hc_calibrate_fix (gpsDevice, &gmt, reference);
+                    synchronized = gmt.tv_sec;
+                }
                 flags = 0;
             }
         }
     }
+    gpsStream += length;
 
-    // Move the leftover to the beginning of the buffer, for future decoding.
-
-    if (leftover > 0) {
-        gpsCount -= leftover;
-        if (gpsCount > 0)
-            memmove (gpsBuffer, gpsBuffer+leftover, gpsCount);
-    }
+    hc_db_update_end (hc_nmea_status_db);
 
     return gpsTty;
 }
@@ -596,20 +1001,27 @@ void hc_nmea_convert (char *buffer, int size,
 }
 
 
-void hc_nmea_periodic (const struct timeval *now) {
+time_t hc_nmea_periodic (const struct timespec *now) {
+
+    time_t expires;
 
     // Do not check during initialization.
-    if ((gpsInitialized == 0) || (hc_nmea_status_db == 0)) return;
-    if (now->tv_sec <= gpsInitialized + GPS_EXPIRES) return;
+    if ((gpsInitialized == 0) || (hc_nmea_status_db == 0))
+        return now->tv_sec + 1;
+    if (now->tv_sec <= gpsInitialized + GPS_EXPIRES)
+        return gpsInitialized + GPS_EXPIRES + 1;
 
-    if (now->tv_sec > hc_nmea_status_db->timestamp.tv_sec + GPS_EXPIRES) {
+    expires = hc_nmea_status_db->timestamp.tv_sec + GPS_EXPIRES;
+    if (now->tv_sec > expires) {
         if (gpsShowNmea) {
             printf ("GPS data expired at %u\n", (unsigned int)now->tv_sec);
         }
         if (gpsTty >= 0) {
             hc_nmea_reset();
         }
+        return now->tv_sec + 1;
     }
+    return expires + 1;
 }
 
 int hc_nmea_listen (void) {
@@ -625,11 +1037,18 @@ int hc_nmea_listen (void) {
 
     // Remove echo of characters from the GPS device.
     hc_tty_set (gpsTty, gpsSpeed);
+    hc_db_update_begin (hc_nmea_status_db);
     snprintf (hc_nmea_status_db->gpsdevice,
               sizeof(hc_nmea_status_db->gpsdevice), "%s", gpsDevice);
+    hc_db_update_end (hc_nmea_status_db);
     return gpsTty;
 }
 
+void hc_nmea_set_latency (int latency) {
+    gpsLatency = latency;
+    hc_state_set ("latency", gpsLatency);
+}
+
 int hc_nmea_active (void) {
     if (gpsTty < 0 ) return 0;
     if (hc_nmea_status_db == 0) return 0;
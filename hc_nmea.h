@@ -24,9 +24,10 @@ const char *hc_nmea_help (int level);
 
 void hc_nmea_initialize (int argc, const char **argv);
 int  hc_nmea_listen (void);
-int  hc_nmea_process (const struct timeval *received);
-void hc_nmea_periodic (const struct timeval *now);
+int  hc_nmea_process (const struct timespec *received);
+time_t hc_nmea_periodic (const struct timespec *now);
 int  hc_nmea_active (void);
+void hc_nmea_set_latency (int latency);
 
 /* The GPS database:
  */
@@ -38,7 +39,7 @@ int  hc_nmea_active (void);
 typedef struct {
     char sentence[HC_NMEA_MAX_SENTENCE];
     char flags;
-    struct timeval timing;
+    struct timespec timing;
 } gpsSentence;
 
 typedef struct {
@@ -50,13 +51,18 @@ typedef struct {
     char   latitude[20];
     char   longitude[20];
     char   hemisphere[2];
-    struct timeval timestamp;
+    struct timespec timestamp;
     struct {
         char line[HC_NMEA_MAX_SENTENCE];
     } text[HC_NMEA_TEXT_LINES];
     int textcount;
     gpsSentence history[HC_NMEA_DEPTH];
     int gpscount;
+    int checksumerrors; // Sentences rejected: bad or missing checksum.
+    int framingerrors;  // Sentences rejected: truncated or too long.
+    int rate;           // Bytes/s, fitted by the timing model.
+    long long jitter;   // ns, standard deviation of the model residuals.
+    long long bound;    // ns, uncertainty of the latest burst start time.
 } hc_nmea_status;
 
 void hc_nmea_convert (char *buffer, int size,
@@ -28,19 +28,101 @@
  *
  * int hc_ntp_initialize (const char *service);
  *
- *    Initialize the NTP context. Returns a socket or -1.
+ *    Initialize the NTP context. Returns the file descriptor to listen to
+ *    (a socket, or an io_uring), or -1.
  *
- * void hc_ntp_process (const struct timeval *receive);
+ *    The command line options processed here are:
+ *      -ntp-service=<name> Name or port number of the NTP socket.
+ *      -ntp-period=<N>     Period of the NTP broadcast (seconds).
+ *      -ntp-batch=<N>      Max number of requests processed per wakeup.
+ *      -ntp-workers=<N>    Number of worker threads answering requests.
+ *      -ntp-interleaved    Support the NTP interleaved modes.
+ *      -ntp-no-uring       Do not use io_uring, even if available.
+ *      -ntp-clients=<N>    Max number of clients remembered. More than
+ *                          about 4000 clients requires a larger -db.
+ *      -ntp-limit-interval=<N> Min average interval between requests from
+ *                          one client (seconds, 0 means no limit).
+ *      -ntp-limit-burst=<N> Max number of requests in a burst.
+ *      -ntp-xdp=<name>     Answer requests in an XDP program on interface.
+ *      -ntp-xdp-object=<path> The BPF object file for -ntp-xdp.
  *
- *    Process one available NTP message. The receive parameter indicates
- *    when it was detected that data is available.
+ *    Each worker thread has its own socket, bound to the NTP port with
+ *    SO_REUSEPORT, and is pinned to a CPU. A worker only answers client
+ *    requests: all other NTP messages are processed by the main loop.
+ *    The workers build their responses from a snapshot of the clock state,
+ *    which only the main loop updates.
  *
- * void hc_ntp_periodic (const struct timeval *now);
+ *    The clock state snapshot holds a prebuilt response, in network order,
+ *    which is rebuilt only when the clock or time source state changes.
+ *    Answering a request only requires copying this prototype and setting
+ *    the origin, receive and transmit timestamps.
  *
- *    Send a periodic NTP time message.
+ *    In the interleaved modes (see RFC 5905 and the NTP interleaved modes
+ *    draft), the transmit timestamp sent is the kernel timestamp of when
+ *    the previous packet actually left. This requires remembering, for each
+ *    client, the receive time of its latest request and the transmit time
+ *    of the latest response. The interleaved basic mode is enabled when the
+ *    client asks for it, i.e. when its request's origin timestamp matches
+ *    the receive timestamp of the previous response. In the interleaved
+ *    broadcast mode, the origin timestamp of each broadcast is the kernel
+ *    transmit timestamp of the previous broadcast on the same interface.
+ *
+ *    When the kernel supports it, the NTP sockets are served through
+ *    io_uring (see hc_uring.c): the responses are then built in place,
+ *    in the buffer of the request, and no system call is needed to
+ *    receive. The recvmmsg()/sendmmsg() datapath is used otherwise.
+ *
+ *    The clients are remembered in the NtpClients table, an open-addressing
+ *    hash table keyed by the client address (linear probing, deletion by
+ *    backward shift). The table is kept at most 3/4 full: when full, the
+ *    least recently seen client is forgotten. Each entry records when the
+ *    client was first and last seen, how many requests it sent, and the
+ *    offset between its clock and ours (ignoring the network delay) for
+ *    its latest few requests.
+ *
+ *    When a rate limit is set, each client has a token bucket: a request
+ *    is answered only if the client did not exceed the average interval,
+ *    allowing for short bursts. A request over the limit is answered with
+ *    a RATE Kiss-o'-Death packet, and then dropped silently if the client
+ *    keeps insisting. The limited requests are not recorded in the clients
+ *    history.
+ *
+ *    With the -ntp-xdp option, plain client requests are answered by an
+ *    XDP program (see hc_xdp.c), which uses the same response prototype.
+ *    Every other packet is passed to the datapath above. The clients
+ *    answered that way do not appear in the clients history. This is not
+ *    compatible with the interleaved modes or with the rate limit, which
+ *    the XDP program would bypass: -ntp-xdp is then ignored.
+ *
+ * void hc_ntp_process (const struct timespec *receive);
+ *
+ *    Process the available NTP messages, up to the batch size. All the
+ *    responses are sent together, after all the requests were processed.
+ *    The receive time of each message is the kernel timestamp, if any.
+ *    The receive parameter indicates when it was detected that data is
+ *    available: it is used only when no kernel timestamp is available.
+ *
+ * void hc_ntp_refresh (void);
+ *
+ *    Publish the clock state to the workers and the XDP program, if it
+ *    changed. This must be called after the time source was processed,
+ *    since the clock might have been stepped: once XDP or the workers are
+ *    active, few requests reach the main loop to trigger it.
+ *
+ * time_t hc_ntp_periodic (const struct timespec *now);
+ *
+ *    Send a periodic NTP time message. Return the time (in seconds)
+ *    when this function should be called next.
  */
 
+#define _GNU_SOURCE // For pthread_setaffinity_np().
+
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sched.h>
+#include <pthread.h>
 
 #include "houseclock.h"
 #include "hc_db.h"
@@ -48,6 +130,10 @@
 #include "hc_nmea.h"
 #include "hc_clock.h"
 #include "hc_broadcast.h"
+#include "hc_uring.h"
+#include "hc_xdp.h"
+#include "hc_archive.h"
+#include "hc_calibrate.h"
 
 #define NTP_VERSION 3
 #define NTP_UNIX_EPOCH 2208988800ull
@@ -122,30 +208,338 @@ static const ntpTimestamp zeroTimestamp = {0, 0};
 static hc_ntp_status *hc_ntp_status_db = 0;
 
 static int hc_ntp_period;
-static int hc_ntp_client_cursor = 0;
+
+// The clients history is split into shards, selected by the client
+// address, so that the workers rarely wait for each other. Each shard
+// is a separate table in the database, with its own lock and LRU list:
+// the HTTP process copies one shard while the others keep changing.
+// All shards have the same size (a power of 2).
+//
+#define HC_NTP_CLIENT_SHARDBITS 4 // See HC_NTP_CLIENT_SHARDS.
+
+typedef struct {
+    pthread_mutex_t lock;
+    struct hc_ntp_client *table;
+    int oldest;
+    int newest;
+    int count;
+} hc_ntp_client_shard;
+
+static hc_ntp_client_shard hc_ntp_client_shards[HC_NTP_CLIENT_SHARDS];
+static int hc_ntp_client_size = 0;
+static int hc_ntp_client_shift = 0;
+
+// The receive buffers only need to be large enough for the NTP header:
+// any extension field or MAC is ignored, so truncation does not matter.
+//
+#define HC_NTP_PACKET 1024
+
+static int hc_ntp_batch = 16;
+
+// The clock state used to build responses. Only the main loop updates
+// it (see hc_ntp_publish()), while the workers read it concurrently.
+// The sequence number is odd while an update is in progress.
+//
+typedef struct {
+    int serving; // 0 if no time source is available.
+    ntpHeaderV3 prototype;
+} hc_ntp_clockstate;
+
+// The context used to answer requests, either from the main loop or
+// from a worker thread.
+//
+typedef struct {
+    int socket;
+    int uring;  // The io_uring serving this socket, or -1.
+    int worker; // Index in the workers table, or -1 for the main loop.
+    struct hc_ntp_traffic traffic;  // Written only by the responder's thread.
+    struct hc_ntp_traffic reported; // Already added to the NtpStatus table.
+    char buffer[HC_BROADCAST_BATCH][HC_NTP_PACKET];
+    hc_broadcast_message request[HC_BROADCAST_BATCH];
+    ntpHeaderV3 response[HC_BROADCAST_BATCH];
+    hc_broadcast_message reply[HC_BROADCAST_BATCH];
+    int count;
+    pthread_t thread;
+    unsigned int sequence; // The version of the clock state cached below.
+    hc_ntp_clockstate state;
+
+    // Interleaved mode support.
+    int txstamp;   // True if the kernel timestamps transmitted packets.
+    int slot[HC_BROADCAST_BATCH]; // Interleaved table entry, or -1.
+    ntpTimestamp previous[HC_BROADCAST_BATCH]; // Interleaved transmit.
+    uint32_t txid; // Identifier of the next transmitted packet.
+    struct {
+        uint32_t id;
+        int      slot;
+        in_addr_t address;
+    } pending[HC_BROADCAST_BATCH * 4];
+} hc_ntp_responder;
+
+static hc_ntp_responder hc_ntp_main;
+static hc_ntp_responder *hc_ntp_workers = 0;
+static int hc_ntp_worker_count = 0;
+
+static void *hc_ntp_worker (void *context);
+
+// The rate limit and interleaved tables are shared by the main
+// loop and the workers.
+//
+static pthread_mutex_t hc_ntp_client_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The per-client information used to support the interleaved basic mode.
+// This is a small direct-mapped cache: a client whose entry was taken by
+// another client just falls back to the basic mode for one exchange.
+//
+#define HC_NTP_INTERLEAVED 256 // Must be a power of 2.
+
+typedef struct {
+    in_addr_t    address;
+    ntpTimestamp receive;  // Receive time of the latest request.
+    ntpTimestamp transmit; // Transmit time of the latest response.
+} hc_ntp_xleave;
+
+static hc_ntp_xleave hc_ntp_xleave_table[HC_NTP_INTERLEAVED];
+static int hc_ntp_interleaved = 0;
+
+// The per-client token buckets used for rate limiting. This is a fixed
+// size hash table: a new client takes the least recently seen entry among
+// the few that are probed.
+//
+#define HC_NTP_RATELIMIT 1024 // Must be a power of 2.
+#define HC_NTP_RATEPROBE 4
+#define HC_NTP_RATEKOD   4    // Kiss-o'-Death sent before dropping.
+
+typedef struct {
+    in_addr_t address;
+    long long latest;  // Time of the latest request (nanoseconds).
+    long long credit;  // Time credit available (nanoseconds).
+    int       strikes; // Consecutive requests over the limit.
+} hc_ntp_rate;
+
+static hc_ntp_rate hc_ntp_rate_table[HC_NTP_RATELIMIT];
+static long long hc_ntp_rate_interval = 0; // 0: no rate limiting.
+static int hc_ntp_rate_burst = 8;
+
+#define HC_NTP_ACCEPT 0
+#define HC_NTP_LIMIT  1
+#define HC_NTP_DROP   2
+static int hc_ntp_uring = 1;
+static int hc_ntp_xdp = 0;
+static long long hc_ntp_xdp_latest = 0;
+
+static struct {
+    unsigned int sequence;
+    hc_ntp_clockstate state;
+} hc_ntp_snapshot;
+
+// What the current prototype was built from.
+//
+static struct {
+    int generation;
+    int stratum;
+    int source;
+    int active;
+} hc_ntp_published = {0, -1, -1, -1};
 
 
 const char *hc_ntp_help (int level) {
 
     static const char *ntpHelp[] = {
-        " [-ntp-service=NAME] [-ntp-period=INT]",
+        " [-ntp-service=NAME] [-ntp-period=INT] [-ntp-batch=INT]"
+        " [-ntp-workers=INT] [-ntp-interleaved] [-ntp-no-uring]"
+        " [-ntp-clients=INT] [-ntp-limit-interval=INT] [-ntp-limit-burst=INT]"
+        " [-ntp-xdp=NAME] [-ntp-xdp-object=PATH]",
         "-ntp-service=NAME:   name or port for the NTP socket",
         "-ntp-period=INT:     how often the NTP server advertises itself",
+        "-ntp-batch=INT:      max number of requests processed at once (16)",
+        "-ntp-workers=INT:    number of threads answering requests (0)",
+        "-ntp-interleaved:    support the NTP interleaved modes",
+        "-ntp-no-uring:       do not use io_uring for the NTP sockets",
+        "-ntp-clients=INT:    max number of clients remembered (1024),"
+                             " more than 4000 requires a larger -db",
+        "-ntp-limit-interval=INT: min average seconds between requests (0)",
+        "-ntp-limit-burst=INT: max requests in a burst (8)",
+        "-ntp-xdp=NAME:       answer requests in XDP on this interface",
+        "-ntp-xdp-object=PATH: the XDP program to load (" HC_XDP_OBJECT ")",
         NULL
     };
 
     return ntpHelp[level];
 }
 
+// The NTP fraction is a 32 bit fixed point value. These conversions use
+// 64 bit integer math, rounded to the nearest value: nanoseconds always
+// fit in 30 bits, so there is no overflow.
+//
+static uint32_t fraction2nsec(uint32_t fraction)
+{
+    return (uint32_t)(((uint64_t)fraction * HC_CLOCK_NSEC + 0x80000000ull) >> 32);
+}
+ 
+static uint32_t nsec2fraction(uint32_t nsec)
+{
+    return (uint32_t)((((uint64_t)nsec << 32) + (HC_CLOCK_NSEC / 2))
+                          / HC_CLOCK_NSEC);
+}
+
+static void hc_ntp_get_timestamp (struct timespec *local,
+                                  const ntpTimestamp *ntp) {
+    local->tv_sec = ntohl(ntp->seconds) - NTP_UNIX_EPOCH;
+    local->tv_nsec = fraction2nsec(ntohl(ntp->fraction));
+}
+
+static void hc_ntp_set_timestamp (ntpTimestamp *ntp,
+                                  const struct timespec *local) {
+    ntp->seconds = htonl((uint32_t) (local->tv_sec) + NTP_UNIX_EPOCH);
+    ntp->fraction = htonl(nsec2fraction(local->tv_nsec));
+}
+
+static void hc_ntp_set_reference (ntpHeaderV3 *packet) {
+
+    struct timespec timestamp;
+    hc_clock_reference (&timestamp);
+    hc_ntp_set_timestamp (&(packet->reference), &timestamp);
+}
+
+static void hc_ntp_set_dispersion (long long dispersion, ntpHeaderV3 *packet) {
+    // The dispersion is in nanoseconds.
+    packet->rootDispersion.seconds =
+        htons((uint16_t) (dispersion / HC_CLOCK_NSEC));
+    packet->rootDispersion.fraction =
+        htons((uint16_t) (((dispersion % HC_CLOCK_NSEC) << 16) / HC_CLOCK_NSEC));
+}
+
+static void hc_ntp_setup (hc_ntp_responder *responder,
+                          int socket, int worker) {
+    int i;
+
+    responder->socket = socket;
+    responder->uring = hc_ntp_uring ? hc_uring_open (socket) : -1;
+    responder->worker = worker;
+    memset (&(responder->traffic), 0, sizeof(responder->traffic));
+    memset (&(responder->reported), 0, sizeof(responder->reported));
+    responder->count = 0;
+    responder->txid = 0;
+    responder->sequence = 0; // The initial, empty, clock state.
+    memset (&(responder->state), 0, sizeof(responder->state));
+
+    responder->txstamp = 0;
+    if (hc_ntp_interleaved) {
+        responder->txstamp = (hc_broadcast_enable_txstamp (socket) == 0);
+    }
+    for (i = 0; i < HC_BROADCAST_BATCH * 4; ++i) {
+        responder->pending[i].slot = -1;
+    }
+
+    for (i = 0; i < HC_BROADCAST_BATCH; ++i) {
+        responder->request[i].data = responder->buffer[i];
+        responder->request[i].size = sizeof(responder->buffer[i]);
+        responder->reply[i].data = (char *)(responder->response + i);
+        responder->reply[i].size = sizeof(responder->response[i]);
+        responder->reply[i].length = sizeof(responder->response[i]);
+    }
+}
+
+static void hc_ntp_publish (void) {
+
+    hc_ntp_clockstate state;
+    struct timespec reference;
+    int generation = hc_clock_generation();
+    int active = hc_nmea_active();
+
+    // Rebuild the response prototype only if something changed.
+    //
+    if ((generation == hc_ntp_published.generation) &&
+        (active == hc_ntp_published.active) &&
+        (hc_ntp_status_db->stratum == hc_ntp_published.stratum) &&
+        (hc_ntp_status_db->source == hc_ntp_published.source)) return;
+
+    hc_ntp_published.generation = generation;
+    hc_ntp_published.active = active;
+    hc_ntp_published.stratum = hc_ntp_status_db->stratum;
+    hc_ntp_published.source = hc_ntp_status_db->source;
+    hc_db_update_begin (hc_ntp_status_db);
+    hc_ntp_status_db->live.rebuilds += 1;
+    hc_db_update_end (hc_ntp_status_db);
+
+    state.serving = 0;
+    state.prototype = ntpResponse;
+
+    if ((hc_ntp_status_db->stratum > 0) && hc_clock_synchronized()) {
+        if (active) {
+            state.serving = 1;
+        } else if (hc_ntp_status_db->source >= 0) {
+            int ntpsource = hc_ntp_status_db->source;
+            state.serving = 1;
+            state.prototype.stratum = (uint8_t) hc_ntp_status_db->stratum;
+            memcpy (state.prototype.refid,
+                    &(hc_ntp_status_db->pool[ntpsource].address.sin_addr),
+                    sizeof(state.prototype.refid));
+        }
+    }
+    hc_ntp_set_dispersion (hc_clock_dispersion(), &state.prototype);
+    hc_clock_reference (&reference);
+    hc_ntp_set_timestamp (&state.prototype.reference, &reference);
+
+    // Single writer: no need for an atomic increment, only for ordering.
+    //
+    __atomic_store_n (&hc_ntp_snapshot.sequence,
+                      hc_ntp_snapshot.sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence (__ATOMIC_RELEASE);
+    hc_ntp_snapshot.state = state;
+    __atomic_store_n (&hc_ntp_snapshot.sequence,
+                      hc_ntp_snapshot.sequence + 1, __ATOMIC_RELEASE);
+
+    if (hc_ntp_xdp)
+        hc_xdp_publish (state.serving,
+                        &state.prototype, sizeof(state.prototype));
+}
+
+static void hc_ntp_clockstate_get (hc_ntp_responder *responder) {
+
+    // The responder keeps its own copy, refreshed only when it changed.
+
+    unsigned int sequence;
+
+    for (;;) {
+        sequence = __atomic_load_n (&hc_ntp_snapshot.sequence, __ATOMIC_ACQUIRE);
+        if (sequence == responder->sequence) return; // No change.
+        if (sequence & 1) continue; // Update in progress.
+        responder->state = hc_ntp_snapshot.state;
+        __atomic_thread_fence (__ATOMIC_ACQUIRE);
+        if (__atomic_load_n (&hc_ntp_snapshot.sequence,
+                             __ATOMIC_RELAXED) == sequence) break;
+    }
+    responder->sequence = sequence;
+}
+
 int hc_ntp_initialize (int argc, const char **argv) {
 
     int i;
     const char *ntpservice = "ntp";
     const char *ntpperiod = "300";
+    const char *ntpbatch = "16";
+    const char *ntpworkers = "0";
+    const char *ntpclients = "1024";
+    const char *ntplimit = "0";
+    const char *ntpburst = "8";
+    const char *ntpxdp = 0;
+    const char *ntpxdpobject = HC_XDP_OBJECT;
 
     for (i = 1; i < argc; ++i) {
         echttp_option_match ("-ntp-service=", argv[i], &ntpservice);
         echttp_option_match ("-ntp-period=", argv[i], &ntpperiod);
+        echttp_option_match ("-ntp-batch=", argv[i], &ntpbatch);
+        echttp_option_match ("-ntp-workers=", argv[i], &ntpworkers);
+        echttp_option_match ("-ntp-clients=", argv[i], &ntpclients);
+        echttp_option_match ("-ntp-limit-interval=", argv[i], &ntplimit);
+        echttp_option_match ("-ntp-limit-burst=", argv[i], &ntpburst);
+        echttp_option_match ("-ntp-xdp=", argv[i], &ntpxdp);
+        echttp_option_match ("-ntp-xdp-object=", argv[i], &ntpxdpobject);
+        if (echttp_option_present ("-ntp-interleaved", argv[i]))
+            hc_ntp_interleaved = 1;
+        if (echttp_option_present ("-ntp-no-uring", argv[i]))
+            hc_ntp_uring = 0;
     }
     if (strcmp(ntpservice, "none") == 0) {
         return 0; // Do not act as a NTP server.
@@ -153,6 +547,20 @@ int hc_ntp_initialize (int argc, const char **argv) {
     hc_ntp_period = atoi(ntpperiod);
     if (hc_ntp_period < 10) hc_ntp_period = 10;
 
+    hc_ntp_batch = atoi(ntpbatch);
+    if (hc_ntp_batch < 1) hc_ntp_batch = 1;
+    if (hc_ntp_batch > HC_BROADCAST_BATCH) hc_ntp_batch = HC_BROADCAST_BATCH;
+
+    hc_ntp_rate_interval = atoi(ntplimit) * HC_CLOCK_NSEC;
+    if (hc_ntp_rate_interval < 0) hc_ntp_rate_interval = 0;
+    hc_ntp_rate_burst = atoi(ntpburst);
+    if (hc_ntp_rate_burst < 1) hc_ntp_rate_burst = 1;
+
+    hc_ntp_worker_count = atoi(ntpworkers);
+    if (hc_ntp_worker_count < 0) hc_ntp_worker_count = 0;
+    if (hc_ntp_worker_count > HC_NTP_WORKERS)
+        hc_ntp_worker_count = HC_NTP_WORKERS;
+
     i = hc_db_new (HC_NTP_STATUS, sizeof(hc_ntp_status), 1);
     if (i != 0) {
         fprintf (stderr, "[%s %d] cannot create %s: %s\n",
@@ -160,14 +568,27 @@ int hc_ntp_initialize (int argc, const char **argv) {
         exit (1);
     }
     hc_ntp_status_db = (hc_ntp_status *) hc_db_get (HC_NTP_STATUS);
+    hc_db_update_begin (hc_ntp_status_db);
     hc_ntp_status_db->live.received = 0;
     hc_ntp_status_db->live.client = 0;
     hc_ntp_status_db->live.broadcast = 0;
+    hc_ntp_status_db->live.batches = 0;
+    hc_ntp_status_db->live.maxbatch = 0;
+    hc_ntp_status_db->live.rebuilds = 0;
+    hc_ntp_status_db->live.xdp = 0;
+    hc_ntp_status_db->live.limited = 0;
+    hc_ntp_status_db->live.dropped = 0;
     hc_ntp_status_db->live.timestamp = 0;
     for (i = 0; i < HC_NTP_DEPTH; ++i) {
         hc_ntp_status_db->history[i].received = 0;
         hc_ntp_status_db->history[i].client = 0;
         hc_ntp_status_db->history[i].broadcast = 0;
+        hc_ntp_status_db->history[i].batches = 0;
+        hc_ntp_status_db->history[i].maxbatch = 0;
+        hc_ntp_status_db->history[i].rebuilds = 0;
+        hc_ntp_status_db->history[i].xdp = 0;
+        hc_ntp_status_db->history[i].limited = 0;
+        hc_ntp_status_db->history[i].dropped = 0;
         hc_ntp_status_db->history[i].timestamp = 0;
     }
     for (i = 0; i < HC_NTP_POOL; ++i) {
@@ -176,58 +597,149 @@ int hc_ntp_initialize (int argc, const char **argv) {
     hc_ntp_status_db->source = -1;
     hc_ntp_status_db->mode = 'I';
     hc_ntp_status_db->stratum = 0;
+    hc_ntp_status_db->workers = 0;
+    hc_db_update_end (hc_ntp_status_db);
 
-    if (hc_test_mode()) return -1;
+    // Size the clients shards so that they remain at most 3/4 full.
+    //
+    hc_ntp_client_size = 16;
+    hc_ntp_client_shift = 28;
+    while (hc_ntp_client_size * 3 / 4 * HC_NTP_CLIENT_SHARDS
+               < atoi(ntpclients)) {
+        hc_ntp_client_size *= 2;
+        hc_ntp_client_shift -= 1;
+        if (hc_ntp_client_shift <= 16) break; // 1M clients.
+    }
+    for (i = 0; i < HC_NTP_CLIENT_SHARDS; ++i) {
+        hc_ntp_client_shard *shard = hc_ntp_client_shards + i;
+        char name[32];
+        int error;
+
+        snprintf (name, sizeof(name), HC_NTP_CLIENT_SHARD, i);
+        error = hc_db_new (name,
+                           sizeof(struct hc_ntp_client), hc_ntp_client_size);
+        if (error == ENOMEM) {
+            // The database is sized before the options of this module
+            // are known.
+            long long needed = hc_db_get_space()
+                + (long long)sizeof(struct hc_ntp_client)
+                      * hc_ntp_client_size * HC_NTP_CLIENT_SHARDS;
+            fprintf (stderr, "[%s %d] no room for %d NTP clients: "
+                             "use -db=%lld or more\n",
+                     __FILE__, __LINE__, atoi(ntpclients),
+                     (needed + (1024*1024) - 1) / (1024*1024));
+            exit (1);
+        }
+        if (error != 0) {
+            fprintf (stderr, "[%s %d] cannot create %s: %s\n",
+                     __FILE__, __LINE__, name, strerror(error));
+            exit (1);
+        }
+        shard->table = (struct hc_ntp_client *) hc_db_get (name);
+        hc_db_update_begin (shard->table);
+        memset (shard->table, 0,
+                sizeof(struct hc_ntp_client) * hc_ntp_client_size);
+        hc_db_update_end (shard->table);
+        pthread_mutex_init (&(shard->lock), 0);
+        shard->oldest = -1;
+        shard->newest = -1;
+        shard->count = 0;
+    }
 
-    return hc_broadcast_open (ntpservice);
-}
+    if (hc_test_mode()) return -1;
 
+    if (hc_ntp_interleaved) hc_broadcast_enable_txstamp (-1);
 
-static uint32_t fraction2usec(uint32_t fraction)
-{
-    return (uint32_t)((double)fraction * 1.0e6 / 4294967296.0);
-}
- 
-static uint32_t usec2fraction(uint32_t usec)
-{
-    return (uint32_t)((double)usec * 4294967296.0 / 1.0e6);
-}
+    hc_ntp_setup (&hc_ntp_main,
+                  hc_broadcast_open (ntpservice, hc_ntp_worker_count > 0), -1);
 
-static void hc_ntp_get_timestamp (struct timeval *local,
-                                  const ntpTimestamp *ntp) {
-    local->tv_sec = ntohl(ntp->seconds) - NTP_UNIX_EPOCH;
-    local->tv_usec = fraction2usec(ntohl(ntp->fraction));
-}
+    if (hc_ntp_worker_count > 0) {
+        int cpus = (int) sysconf (_SC_NPROCESSORS_ONLN);
+        if (cpus < 1) cpus = 1;
 
-static void hc_ntp_set_timestamp (ntpTimestamp *ntp,
-                                  const struct timeval *local) {
-    ntp->seconds = htonl((uint32_t) (local->tv_sec) + NTP_UNIX_EPOCH);
-    ntp->fraction = htonl(usec2fraction(local->tv_usec));
-}
+        hc_ntp_workers =
+            (hc_ntp_responder *) calloc (hc_ntp_worker_count,
+                                         sizeof(hc_ntp_responder));
+        if (hc_ntp_workers == 0) {
+            fprintf (stderr, "[%s %d] no memory for %d workers\n",
+                     __FILE__, __LINE__, hc_ntp_worker_count);
+            exit (1);
+        }
+        hc_ntp_publish ();
+
+        for (i = 0; i < hc_ntp_worker_count; ++i) {
+
+            hc_ntp_responder *worker = hc_ntp_workers + i;
+            struct hc_ntp_worker *status = hc_ntp_status_db->worker + i;
+            int cpu = (cpus > 1) ? 1 + (i % (cpus - 1)) : 0;
+            pthread_attr_t attributes;
+            cpu_set_t cpuset;
+            int error;
+
+            hc_ntp_setup (worker, hc_broadcast_open_worker(), i);
+
+            // Pin the worker before it starts, leaving CPU 0 to the main
+            // loop if possible. If that CPU is not allowed, the thread
+            // cannot be created: start it unpinned instead.
+            CPU_ZERO (&cpuset);
+            CPU_SET (cpu, &cpuset);
+            pthread_attr_init (&attributes);
+            pthread_attr_setaffinity_np (&attributes, sizeof(cpuset), &cpuset);
+            error = pthread_create (&(worker->thread), &attributes,
+                                    hc_ntp_worker, worker);
+            pthread_attr_destroy (&attributes);
+            if (error != 0) {
+                DEBUG printf ("Cannot pin worker %d to CPU %d\n", i, cpu);
+                cpu = -1;
+                error = pthread_create (&(worker->thread), NULL,
+                                        hc_ntp_worker, worker);
+            }
+            if (error != 0) {
+                fprintf (stderr, "[%s %d] cannot start worker %d: %s\n",
+                         __FILE__, __LINE__, i, strerror(error));
+                exit (1);
+            }
+            hc_db_update_begin (hc_ntp_status_db);
+            memset (status, 0, sizeof(*status));
+            status->cpu = cpu;
+            hc_db_update_end (hc_ntp_status_db);
+        }
+        hc_db_update_begin (hc_ntp_status_db);
+        hc_ntp_status_db->workers = hc_ntp_worker_count;
+        hc_db_update_end (hc_ntp_status_db);
+    }
 
-static void hc_ntp_set_reference (ntpHeaderV3 *packet) {
+    if (ntpxdp) {
+        struct sockaddr_in local;
+        socklen_t length = sizeof(local);
+
+        if (hc_ntp_interleaved) {
+            fprintf (stderr, "[%s %d] -ntp-xdp ignored: "
+                             "not compatible with -ntp-interleaved\n",
+                     __FILE__, __LINE__);
+        } else if (hc_ntp_rate_interval > 0) {
+            fprintf (stderr, "[%s %d] -ntp-xdp ignored: "
+                             "not compatible with -ntp-limit-interval\n",
+                     __FILE__, __LINE__);
+        } else if (getsockname (hc_ntp_main.socket,
+                                (struct sockaddr *)&local, &length) == 0) {
+            hc_ntp_xdp = (hc_xdp_attach (ntpxdp, ntpxdpobject,
+                                         ntohs(local.sin_port)) == 0);
+            if (hc_ntp_xdp) hc_ntp_published.generation = -1; // Publish.
+        }
+    }
 
-    struct timeval timestamp;
-    hc_clock_reference (&timestamp);
-    hc_ntp_set_timestamp (&(packet->reference), &timestamp);
+    if (hc_ntp_main.uring >= 0) return hc_uring_fd (hc_ntp_main.uring);
+    return hc_ntp_main.socket;
 }
 
-static void hc_ntp_set_dispersion (int dispersion, ntpHeaderV3 *packet) {
-    if (dispersion > 1000) {
-        packet->rootDispersion.seconds = htons((uint16_t) (dispersion / 1000));
-        dispersion = dispersion % 1000;
-    } else {
-        packet->rootDispersion.seconds = 0;
-    }
-    packet->rootDispersion.fraction =
-        htons((uint16_t) (double)(dispersion / 1e3) * 65536.);
-}
 
-static void hc_ntp_broadcastmsg (const ntpHeaderV3 *head,
-                                 const struct sockaddr_in *source,
-                                 const struct timeval *receive) {
+static void hc_ntp_broadcast_update (const ntpHeaderV3 *head,
+                                     const struct sockaddr_in *source,
+                                     const struct timespec *receive) {
 
     int i, sender, available, weakest, worst;
+    struct timespec previous = {0, 0};
     time_t death = receive->tv_sec - (hc_ntp_period * 3);
     const char *name = hc_broadcast_format(source);
     int ipaddress = source->sin_addr.s_addr;
@@ -240,7 +752,7 @@ static void hc_ntp_broadcastmsg (const ntpHeaderV3 *head,
         printf ("Received broadcast from %s at %ld.%03.3d: "
                 "stratum=%d transmit=%u/%08x\n",
                 name,
-                (long)(receive->tv_sec), (int)(receive->tv_usec / 1000),
+                (long)(receive->tv_sec), (int)(receive->tv_nsec / 1000000),
                 head->stratum,
                 ntohl(head->transmit.seconds),
                 ntohl(head->transmit.fraction));
@@ -278,7 +790,9 @@ static void hc_ntp_broadcastmsg (const ntpHeaderV3 *head,
     // If that time server was not known yet it goes to an empty slot,
     // replaces a dead server or else replaces the lowest-quality server.
     //
-    if (sender < 0) {
+    if (sender >= 0) {
+        previous = hc_ntp_status_db->pool[sender].local;
+    } else {
         char *column;
 
         if (available < 0) {
@@ -305,7 +819,6 @@ static void hc_ntp_broadcastmsg (const ntpHeaderV3 *head,
     hc_ntp_status_db->pool[sender].stratum = head->stratum;
     hc_ntp_get_timestamp
          (&(hc_ntp_status_db->pool[sender].origin), &(head->transmit));
-    hc_ntp_status_db->pool[sender].logged = 0;
 
     // Elect a time source. Choose the lowest stratum available.
     //
@@ -344,8 +857,21 @@ static void hc_ntp_broadcastmsg (const ntpHeaderV3 *head,
     // Synchronize our time on the elected time source.
     //
     if (sender == hc_ntp_status_db->source) {
-        hc_clock_synchronize
-            (&(hc_ntp_status_db->pool[sender].origin), receive, 0);
+
+        struct timespec origin;
+
+        // In interleaved broadcast mode, the origin is the actual transmit
+        // time of the previous broadcast, which matches the previous
+        // receive time--unless that broadcast was lost.
+        //
+        hc_ntp_get_timestamp (&origin, &(head->origin));
+        if ((head->origin.seconds != 0) && (previous.tv_sec != 0)
+                && (labs ((long)(origin.tv_sec - previous.tv_sec)) <= 1)) {
+            hc_clock_synchronize (&origin, &previous, 0);
+        } else {
+            hc_clock_synchronize
+                (&(hc_ntp_status_db->pool[sender].origin), receive, 0);
+        }
         hc_ntp_status_db->stratum = hc_ntp_status_db->pool[sender].stratum + 1;
         if (hc_debug_enabled())
             printf ("Using time from NTP server %s\n",
@@ -353,125 +879,669 @@ static void hc_ntp_broadcastmsg (const ntpHeaderV3 *head,
     }
 }
 
-static void hc_ntp_requestmsg (const ntpHeaderV3 *head,
+static void hc_ntp_broadcastmsg (const ntpHeaderV3 *head,
+                                 const struct sockaddr_in *source,
+                                 const struct timespec *receive) {
+    hc_db_update_begin (hc_ntp_status_db);
+    hc_ntp_broadcast_update (head, source, receive);
+    hc_db_update_end (hc_ntp_status_db);
+}
+
+static void hc_ntp_calibrate (const ntpHeaderV3 *head,
+                              const struct sockaddr_in *source,
+                              const struct timespec *receive) {
+
+    // While the GPS is active, the broadcasts from other synchronized
+    // time servers are a reference for the GPS latency calibration.
+    // Only stratum 1 servers are independent references: a server at a
+    // higher stratum might be synchronized from this very GPS clock.
+
+    struct timespec transmit;
+    int ipaddress = source->sin_addr.s_addr;
+
+    if (head->stratum != 1) return;
+    if ((head->liVnMode >> 6) == 3) return; // Not synchronized.
+    if (hc_broadcast_local (ipaddress) == ipaddress) return; // Our own.
+
+    hc_ntp_get_timestamp (&transmit, &(head->transmit));
+    hc_calibrate_reference (hc_broadcast_format(source), &transmit, receive);
+}
+
+static void hc_ntp_lock (void) {
+    if (hc_ntp_worker_count > 0) pthread_mutex_lock (&hc_ntp_client_lock);
+}
+
+static void hc_ntp_unlock (void) {
+    if (hc_ntp_worker_count > 0) pthread_mutex_unlock (&hc_ntp_client_lock);
+}
+
+static uint32_t hc_ntp_client_hash (in_addr_t address) {
+    return (uint32_t)address * 2654435761u; // Knuth's multiplier.
+}
+
+static hc_ntp_client_shard *hc_ntp_client_shard_of (in_addr_t address) {
+
+    // The highest bits of the hash select the shard, the next bits
+    // select the home slot within the shard.
+
+    uint32_t hash = hc_ntp_client_hash (address);
+    return hc_ntp_client_shards + (hash >> (32 - HC_NTP_CLIENT_SHARDBITS));
+}
+
+static int hc_ntp_client_home (in_addr_t address) {
+    uint32_t hash = hc_ntp_client_hash (address) << HC_NTP_CLIENT_SHARDBITS;
+    return (int)(hash >> hc_ntp_client_shift);
+}
+
+static void hc_ntp_client_unlink (hc_ntp_client_shard *shard, int index) {
+
+    struct hc_ntp_client *client = shard->table + index;
+
+    if (client->older >= 0)
+        shard->table[client->older].newer = client->newer;
+    else
+        shard->oldest = client->newer;
+
+    if (client->newer >= 0)
+        shard->table[client->newer].older = client->older;
+    else
+        shard->newest = client->older;
+}
+
+static void hc_ntp_client_link (hc_ntp_client_shard *shard, int index) {
+
+    // Insert as the most recently seen client.
+
+    struct hc_ntp_client *client = shard->table + index;
+
+    client->newer = -1;
+    client->older = shard->newest;
+    if (client->older >= 0)
+        shard->table[client->older].newer = index;
+    else
+        shard->oldest = index;
+    shard->newest = index;
+}
+
+static void hc_ntp_client_move (hc_ntp_client_shard *shard, int from, int to) {
+
+    struct hc_ntp_client *client = shard->table + to;
+
+    *client = shard->table[from];
+    if (client->older >= 0)
+        shard->table[client->older].newer = to;
+    else
+        shard->oldest = to;
+    if (client->newer >= 0)
+        shard->table[client->newer].older = to;
+    else
+        shard->newest = to;
+}
+
+static void hc_ntp_client_remove (hc_ntp_client_shard *shard, int index) {
+
+    // Backward shift deletion: move up the entries that were displaced
+    // by the one removed, so that no tombstone is needed.
+
+    int mask = hc_ntp_client_size - 1;
+    int hole = index;
+    int next = index;
+
+    hc_ntp_client_unlink (shard, index);
+
+    for (;;) {
+        next = (next + 1) & mask;
+        struct hc_ntp_client *client = shard->table + next;
+        if (client->address.sin_family == 0) break;
+
+        // Leave the entry alone if its home slot is between the hole
+        // and its current slot.
+        int home = hc_ntp_client_home (client->address.sin_addr.s_addr);
+        if (((next - home) & mask) < ((next - hole) & mask)) continue;
+
+        hc_ntp_client_move (shard, next, hole);
+        hole = next;
+    }
+    memset (shard->table + hole, 0, sizeof(struct hc_ntp_client));
+    shard->count -= 1;
+}
+
+static int hc_ntp_client_search (hc_ntp_client_shard *shard,
+                                 in_addr_t address) {
+
+    // Return the slot of this client, or else the free slot where it
+    // should be inserted.
+
+    int mask = hc_ntp_client_size - 1;
+    int index = hc_ntp_client_home (address);
+
+    while (shard->table[index].address.sin_family != 0) {
+        if (shard->table[index].address.sin_addr.s_addr == address) break;
+        index = (index + 1) & mask;
+    }
+    return index;
+}
+
+static void hc_ntp_record_client (const struct sockaddr_in *source,
+                                  const ntpTimestamp *origin,
+                                  const struct timespec *receive) {
+
+    in_addr_t address = source->sin_addr.s_addr;
+    hc_ntp_client_shard *shard = hc_ntp_client_shard_of (address);
+    int index;
+    struct hc_ntp_client *client;
+
+    if (hc_ntp_worker_count > 0) pthread_mutex_lock (&(shard->lock));
+    hc_db_update_begin (shard->table);
+
+    index = hc_ntp_client_search (shard, address);
+    client = shard->table + index;
+
+    if (client->address.sin_family == 0) {
+        // A new client. Forget the oldest one if the shard is full:
+        // this may move entries, so search again for a free slot.
+        //
+        if (shard->count >= hc_ntp_client_size * 3 / 4) {
+            hc_ntp_client_remove (shard, shard->oldest);
+            index = hc_ntp_client_search (shard, address);
+            client = shard->table + index;
+        }
+        memset (client, 0, sizeof(*client));
+        client->first = *receive;
+        shard->count += 1;
+    } else {
+        hc_ntp_client_unlink (shard, index);
+    }
+    hc_ntp_client_link (shard, index);
+
+    client->address = *source;
+    hc_ntp_get_timestamp (&(client->origin), origin);
+    client->local = *receive;
+    client->offset[client->count % HC_NTP_OFFSETS] =
+        hc_clock_delta (&(client->origin), receive);
+    client->count += 1;
+
+    hc_db_update_end (shard->table);
+    if (hc_ntp_worker_count > 0) pthread_mutex_unlock (&(shard->lock));
+}
+
+static int hc_ntp_same (const ntpTimestamp *a, const ntpTimestamp *b) {
+    return (a->seconds == b->seconds) && (a->fraction == b->fraction);
+}
+
+static int hc_ntp_xleave_hash (in_addr_t address) {
+    uint32_t hash = (uint32_t)address * 2654435761u; // Knuth's multiplier.
+    return (int)(hash >> 24) & (HC_NTP_INTERLEAVED - 1);
+}
+
+static int hc_ntp_xleave_request (const ntpHeaderV3 *head,
+                                  const struct sockaddr_in *source,
+                                  ntpHeaderV3 *response,
+                                  ntpTimestamp *previous) {
+
+    // Detect if the client uses the interleaved mode: the request's origin
+    // is then our receive timestamp for its previous request. The client's
+    // receive and transmit timestamps must also differ, or else this is
+    // a basic mode client that just echoed the values it got.
+    // Returns the table slot used for this client.
+
+    int slot = hc_ntp_xleave_hash (source->sin_addr.s_addr);
+    hc_ntp_xleave *client = hc_ntp_xleave_table + slot;
+
+    hc_ntp_lock ();
+    if ((client->address == source->sin_addr.s_addr)
+            && (client->receive.seconds != 0)
+            && hc_ntp_same (&(head->origin), &(client->receive))
+            && (! hc_ntp_same (&(head->receive), &(head->transmit)))
+            && (client->transmit.seconds != 0)) {
+        response->origin = head->receive;
+        *previous = client->transmit;
+    }
+    client->address = source->sin_addr.s_addr;
+    client->receive = response->receive;
+    client->transmit = zeroTimestamp;
+    hc_ntp_unlock ();
+
+    return slot;
+}
+
+static void hc_ntp_xleave_transmit (int slot, in_addr_t address,
+                                    const ntpTimestamp *transmit) {
+
+    hc_ntp_xleave *client = hc_ntp_xleave_table + slot;
+
+    hc_ntp_lock ();
+    if (client->address == address) client->transmit = *transmit;
+    hc_ntp_unlock ();
+}
+
+static void hc_ntp_xleave_drain (hc_ntp_responder *responder) {
+
+    // Retrieve the actual transmit time of the latest responses,
+    // and store them for use in the next exchange with each client.
+
+    int i, count;
+    hc_broadcast_txstamp stamps[16];
+
+    do {
+        count = hc_broadcast_get_txstamp (responder->socket, stamps, 16);
+        for (i = 0; i < count; ++i) {
+            int index = stamps[i].id % (HC_BROADCAST_BATCH * 4);
+            ntpTimestamp transmit;
+
+            if (responder->pending[index].id != stamps[i].id) continue;
+            if (responder->pending[index].slot < 0) continue;
+
+            hc_ntp_set_timestamp (&transmit, &(stamps[i].timestamp));
+            hc_ntp_xleave_transmit (responder->pending[index].slot,
+                                    responder->pending[index].address,
+                                    &transmit);
+            responder->pending[index].slot = -1;
+        }
+    } while (count >= 16);
+}
+
+static int hc_ntp_rate_check (in_addr_t address,
+                              const struct timespec *receive) {
+
+    // Token bucket: each request costs one interval worth of credit,
+    // and the credit grows with time, up to a full burst.
+
+    int i;
+    int result = HC_NTP_ACCEPT;
+    long long now = (receive->tv_sec * HC_CLOCK_NSEC) + receive->tv_nsec;
+    long long full = hc_ntp_rate_interval * hc_ntp_rate_burst;
+    uint32_t hash = (uint32_t)address * 2654435761u; // Knuth's multiplier.
+    int slot = (int)(hash >> 22);
+    hc_ntp_rate *client = 0;
+    hc_ntp_rate *oldest = 0;
+
+    hc_ntp_lock ();
+    for (i = 0; i < HC_NTP_RATEPROBE; ++i) {
+        hc_ntp_rate *entry =
+            hc_ntp_rate_table + ((slot + i) & (HC_NTP_RATELIMIT - 1));
+        if (entry->address == address) {
+            client = entry;
+            break;
+        }
+        if ((!oldest) || (entry->latest < oldest->latest)) oldest = entry;
+    }
+    if (!client) {
+        client = oldest;
+        client->address = address;
+        client->credit = full;
+        client->strikes = 0;
+    } else if (now > client->latest) {
+        client->credit += now - client->latest;
+        if (client->credit > full) client->credit = full;
+    }
+    client->latest = now;
+
+    if (client->credit >= hc_ntp_rate_interval) {
+        client->credit -= hc_ntp_rate_interval;
+        client->strikes = 0;
+    } else {
+        client->strikes += 1;
+        result =
+            (client->strikes > HC_NTP_RATEKOD) ? HC_NTP_DROP : HC_NTP_LIMIT;
+    }
+    hc_ntp_unlock ();
+
+    return result;
+}
+
+// The responder counters are cumulative and written only by the
+// responder's own thread, while the main loop reads them concurrently
+// (see hc_ntp_collect()). The largest batch is per period: the main
+// loop resets it when collecting.
+//
+static void hc_ntp_count (int *counter, int value) {
+    __atomic_store_n (counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+static void hc_ntp_count_max (int *counter, int value) {
+    int current = __atomic_load_n (counter, __ATOMIC_RELAXED);
+    while (value > current) {
+        if (__atomic_compare_exchange_n (counter, &current, value, 0,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+    }
+}
+
+static void hc_ntp_requestmsg (hc_ntp_responder *responder,
+                               const ntpHeaderV3 *head,
                                const struct sockaddr_in *source,
-                               const struct timeval *receive) {
+                               const struct timespec *receive) {
 
     // Build the response using the local system clock, if it has been
-    // synchronized with GPS or remote broadcast server.
+    // synchronized with GPS or remote broadcast server. The response is
+    // only queued here: its transmit timestamp is set when the whole batch
+    // is sent. With io_uring, the response overwrites the request.
 
-    int dispersion;
-    struct timeval transmit;
+    ntpHeaderV3 request = *head;
+    ntpHeaderV3 *response;
+    int rate = HC_NTP_ACCEPT;
 
-    if (hc_nmea_active()) {
-        ntpResponse.stratum = 1;
-        strncpy (ntpResponse.refid, "GPS", sizeof(ntpResponse.refid));
-    } else {
-        int ntpsource = hc_ntp_status_db->source;
-        if (ntpsource < 0) return; // No time source.
+    if (responder->count >= HC_BROADCAST_BATCH) return; // Never happens.
+
+    if (hc_ntp_rate_interval > 0) {
+        rate = hc_ntp_rate_check (source->sin_addr.s_addr, receive);
+        if (rate == HC_NTP_DROP) {
+            hc_ntp_count (&(responder->traffic.dropped), 1);
+            return;
+        }
+    }
+    hc_ntp_count (&(responder->traffic.client), 1);
+
+    if (responder->uring >= 0)
+        response = (ntpHeaderV3 *)head;
+    else
+        response = responder->response + responder->count;
+    *response = responder->state.prototype;
+    response->origin = request.transmit;
+    hc_ntp_set_timestamp (&response->receive, receive);
+
+    responder->slot[responder->count] = -1;
+    responder->previous[responder->count] = zeroTimestamp;
+
+    if (rate == HC_NTP_LIMIT) {
+        // Kiss-o'-Death: alarm condition, stratum 0, RATE kiss code.
+        response->liVnMode = 0xc0 | (response->liVnMode & 0x3f);
+        response->stratum = 0;
+        memcpy (response->refid, "RATE", sizeof(response->refid));
+        hc_ntp_count (&(responder->traffic.limited), 1);
+        responder->reply[responder->count].data = (char *)response;
+        responder->reply[responder->count++].address = *source;
+        return;
+    }
 
-        ntpResponse.stratum = (uint8_t) hc_ntp_status_db->stratum;
-        *((int *)(ntpResponse.refid)) =
-            hc_ntp_status_db->pool[ntpsource].address.sin_addr.s_addr;
+    if (hc_ntp_interleaved) {
+        responder->slot[responder->count] =
+            hc_ntp_xleave_request (&request, source, response,
+                                   responder->previous + responder->count);
     }
+    responder->reply[responder->count].data = (char *)response;
+    responder->reply[responder->count++].address = *source;
 
-    hc_ntp_status_db->live.client += 1;
+    hc_ntp_record_client (source, &(request.transmit), receive);
+}
 
-    ntpResponse.origin = head->transmit;
+static void hc_ntp_respond (hc_ntp_responder *responder) {
 
-    dispersion = hc_clock_dispersion();
-    hc_ntp_set_dispersion (dispersion, &ntpResponse);
-    hc_ntp_set_reference (&ntpResponse);
-    hc_ntp_set_timestamp (&ntpResponse.receive, receive);
+    int i;
+    int sent;
+    struct timespec transmit;
 
-    gettimeofday (&transmit, NULL);
-    hc_ntp_set_timestamp (&ntpResponse.transmit, &transmit);
+    if (responder->count <= 0) {
+        // Give the buffers of the requests back to io_uring.
+        if (responder->uring >= 0) hc_uring_reply (responder->uring, 0, 0);
+        return;
+    }
 
-    hc_broadcast_reply ((char *)&ntpResponse, sizeof(ntpResponse), source);
+    // All the queued responses share the same transmit timestamp, taken
+    // as late as possible. In interleaved mode, this is replaced with
+    // the actual transmit time of the previous response.
+    //
+    clock_gettime (CLOCK_REALTIME, &transmit);
 
-    if (hc_debug_enabled())
-        printf ("Response to %s at %d.%0.03d: "
-                "stratum=%d origin=%u/%08x reference=%u/%08x "
-                "receive=%u/%08x transmit=%u/%08x dispersion=%dms\n",
-            hc_broadcast_format (source),
-            (long)(transmit.tv_sec),
-            (int)(transmit.tv_usec / 1000),
-            ntpResponse.stratum,
-            ntohl(ntpResponse.origin.seconds),
-            ntohl(ntpResponse.origin.fraction),
-            ntohl(ntpResponse.reference.seconds),
-            ntohl(ntpResponse.reference.fraction),
-            ntohl(ntpResponse.receive.seconds),
-            ntohl(ntpResponse.receive.fraction),
-            ntohl(ntpResponse.transmit.seconds),
-            ntohl(ntpResponse.transmit.fraction),
-            dispersion);
-
-    if (++hc_ntp_client_cursor >= HC_NTP_DEPTH) hc_ntp_client_cursor = 0;
-
-    hc_ntp_status_db->clients[hc_ntp_client_cursor].address = *source;
-    hc_ntp_get_timestamp
-        (&(hc_ntp_status_db->clients[hc_ntp_client_cursor].origin),
-         &(ntpResponse.origin));
-    hc_ntp_status_db->clients[hc_ntp_client_cursor].local = *receive;
-    hc_ntp_status_db->clients[hc_ntp_client_cursor].logged = 0;
+    for (i = 0; i < responder->count; ++i) {
+
+        ntpHeaderV3 *response = (ntpHeaderV3 *)(responder->reply[i].data);
+
+        hc_ntp_set_timestamp (&response->transmit, &transmit);
+        if (responder->slot[i] >= 0) {
+            hc_ntp_xleave_transmit (responder->slot[i],
+                                    responder->reply[i].address.sin_addr.s_addr,
+                                    &(response->transmit));
+            if (responder->previous[i].seconds != 0)
+                response->transmit = responder->previous[i];
+        }
+
+        // (hc_broadcast_format() is not thread safe.)
+        if (hc_debug_enabled() && (responder->worker < 0))
+            printf ("Response to %s at %ld.%03.3d: "
+                    "stratum=%d origin=%u/%08x reference=%u/%08x "
+                    "receive=%u/%08x transmit=%u/%08x\n",
+                hc_broadcast_format (&(responder->reply[i].address)),
+                (long)(transmit.tv_sec),
+                (int)(transmit.tv_nsec / 1000000),
+                response->stratum,
+                ntohl(response->origin.seconds),
+                ntohl(response->origin.fraction),
+                ntohl(response->reference.seconds),
+                ntohl(response->reference.fraction),
+                ntohl(response->receive.seconds),
+                ntohl(response->receive.fraction),
+                ntohl(response->transmit.seconds),
+                ntohl(response->transmit.fraction));
+    }
+    if (responder->uring >= 0)
+        sent = hc_uring_reply
+                   (responder->uring, responder->reply, responder->count);
+    else
+        sent = hc_broadcast_reply_batch
+                   (responder->socket, responder->reply, responder->count);
+
+    // The kernel identifies each transmitted packet with a counter.
+    //
+    if (responder->txstamp) {
+        for (i = 0; i < sent; ++i) {
+            int index = responder->txid % (HC_BROADCAST_BATCH * 4);
+            responder->pending[index].id = responder->txid++;
+            responder->pending[index].slot = responder->slot[i];
+            responder->pending[index].address =
+                responder->reply[i].address.sin_addr.s_addr;
+        }
+    }
+    responder->count = 0;
 }
 
+static void hc_ntp_serve (hc_ntp_responder *responder,
+                          const struct timespec *receive) {
+
+    int i;
+    int count;
+
+    // Pending transmit timestamps make the socket readable: always get
+    // them first.
+    if (responder->txstamp) hc_ntp_xleave_drain (responder);
+
+    if (responder->uring >= 0) {
+        count = hc_uring_receive
+                    (responder->uring, responder->request, hc_ntp_batch);
+        if (count <= 0) {
+            hc_uring_reply (responder->uring, 0, 0);
+            return;
+        }
+    } else {
+        count = hc_broadcast_receive_batch
+                    (responder->socket, responder->request, hc_ntp_batch);
+        if (count <= 0) return;
+    }
+
+    hc_ntp_count (&(responder->traffic.received), count);
+    hc_ntp_count (&(responder->traffic.batches), 1);
+    hc_ntp_count_max (&(responder->traffic.maxbatch), count);
+
+    hc_ntp_clockstate_get (responder);
 
-void hc_ntp_process (const struct timeval *receive) {
+    for (i = 0; i < count; ++i) {
 
-    struct sockaddr_in source;
+        const struct sockaddr_in *source = &(responder->request[i].address);
+        const struct timespec *timestamp = &(responder->request[i].timestamp);
 
-    // The receive buffer is as large as the max UDP packet: no overflow ever.
-    char buffer[0x10000];
-    int length = hc_broadcast_receive(buffer, sizeof(buffer), &source);
+        if (responder->request[i].length < sizeof(ntpHeaderV3)) continue;
 
-    hc_ntp_status_db->live.received += 1;
+        // Prefer the kernel's timestamp, which does not include
+        // the OS scheduling delays.
+        if (timestamp->tv_sec == 0) timestamp = receive;
 
-    if (length >= sizeof(ntpHeaderV3)) {
-        ntpHeaderV3 *head = (ntpHeaderV3 *)buffer;
+        ntpHeaderV3 *head = (ntpHeaderV3 *)(responder->request[i].data);
         int version = (head->liVnMode >> 3) & 0x7;
 
         switch (head->liVnMode & 0x7) {
             case 6: break; // Control.
             case 5: // Broadcast from a remote server.
+                // Every socket gets a copy: only the main loop handles it.
+                if (responder->worker >= 0) break;
                 if (! hc_nmea_active()) {
-                    hc_ntp_broadcastmsg (head, &source, receive);
+                    hc_ntp_broadcastmsg (head, source, timestamp);
+                } else if (hc_calibrate_active()) {
+                    hc_ntp_calibrate (head, source, timestamp);
                 }
                 break;
             case 4: break; // Server response.
             case 3: // Client request.
-                if ((hc_ntp_status_db->stratum > 0)
-                        && hc_clock_synchronized()) {
-                    hc_ntp_requestmsg (head, &source, receive);
+                if (responder->state.serving) {
+                    hc_ntp_requestmsg (responder, head, source, timestamp);
                 }
                 break;
             default:
-                if (hc_debug_enabled())
+                if (hc_debug_enabled() && (responder->worker < 0))
                     printf ("Ignore packet from %s: version=%d, mode=%d\n",
-                            hc_broadcast_format (&source),
+                            hc_broadcast_format (source),
                             version, head->liVnMode & 0x7);
                 break;
         }
     }
+
+    // Send all the responses for this batch at once.
+    hc_ntp_respond (responder);
 }
 
-void hc_ntp_periodic (const struct timeval *wakeup) {
+static void *hc_ntp_worker (void *context) {
+
+    hc_ntp_responder *responder = (hc_ntp_responder *)context;
+    struct pollfd watch;
+
+    if (responder->uring >= 0)
+        watch.fd = hc_uring_fd (responder->uring);
+    else
+        watch.fd = responder->socket;
+    watch.events = POLLIN;
+
+    for (;;) {
+        struct timespec receive;
+
+        if (poll (&watch, 1, -1) <= 0) continue;
+
+        clock_gettime (CLOCK_REALTIME, &receive);
+        hc_ntp_serve (responder, &receive);
+    }
+    return 0;
+}
+
+void hc_ntp_process (const struct timespec *receive) {
+
+    hc_ntp_publish ();
+    hc_ntp_serve (&hc_ntp_main, receive);
+    hc_ntp_publish (); // A broadcast might have changed the clock.
+}
+
+void hc_ntp_refresh (void) {
+    if (hc_ntp_status_db) hc_ntp_publish ();
+}
+
+static void hc_ntp_stamp_broadcast (char *data, int length,
+                                    const struct timespec *previous) {
+
+    // Interleaved broadcast mode: the origin is the actual transmit time
+    // of the previous broadcast on this interface.
+    //
+    ntpHeaderV3 *packet = (ntpHeaderV3 *)data;
+
+    if (previous->tv_sec == 0) {
+        packet->origin = zeroTimestamp;
+    } else {
+        hc_ntp_set_timestamp (&(packet->origin), previous);
+    }
+}
+
+static void hc_ntp_collect_counter (int *total,
+                                    int *counter, int *reported) {
+    int value = __atomic_load_n (counter, __ATOMIC_RELAXED);
+    *total += value - *reported;
+    *reported = value;
+}
+
+// Add the activity of one responder since the previous call to the
+// NtpStatus live counters. This must be called within an update of
+// the NtpStatus table.
+//
+static void hc_ntp_collect (hc_ntp_responder *responder) {
+
+    struct hc_ntp_traffic *live = &(hc_ntp_status_db->live);
+    struct hc_ntp_traffic *traffic = &(responder->traffic);
+    struct hc_ntp_traffic *reported = &(responder->reported);
+    int maxbatch = __atomic_exchange_n (&(traffic->maxbatch), 0,
+                                        __ATOMIC_RELAXED);
+
+    hc_ntp_collect_counter (&(live->received),
+                            &(traffic->received), &(reported->received));
+    hc_ntp_collect_counter (&(live->client),
+                            &(traffic->client), &(reported->client));
+    hc_ntp_collect_counter (&(live->batches),
+                            &(traffic->batches), &(reported->batches));
+    hc_ntp_collect_counter (&(live->limited),
+                            &(traffic->limited), &(reported->limited));
+    hc_ntp_collect_counter (&(live->dropped),
+                            &(traffic->dropped), &(reported->dropped));
+    if (maxbatch > reported->maxbatch) reported->maxbatch = maxbatch;
+    if (maxbatch > live->maxbatch) live->maxbatch = maxbatch;
+}
+
+time_t hc_ntp_periodic (const struct timespec *wakeup) {
 
     static time_t latestPeriod = 0;
     static time_t latestBroadcast = 0;
 
+    time_t deadline;
+
+    hc_db_update_begin (hc_ntp_status_db);
+
     if (latestPeriod == 0) {
         latestPeriod = wakeup->tv_sec / 10;
     } else if (wakeup->tv_sec / 10 > latestPeriod) {
+        int i;
         int slot = latestPeriod % HC_NTP_DEPTH;
+
+        // Add the activity of the main loop and workers during that period.
+        //
+        hc_ntp_collect (&hc_ntp_main);
+        for (i = 0; i < hc_ntp_worker_count; ++i) {
+            hc_ntp_collect (hc_ntp_workers + i);
+            hc_ntp_status_db->worker[i].traffic = hc_ntp_workers[i].reported;
+        }
+
+        // Add the requests answered by the XDP program.
+        //
+        if (hc_ntp_xdp) {
+            long long answered, passed;
+            if (hc_xdp_traffic (&answered, &passed) == 0) {
+                int delta = (int) (answered - hc_ntp_xdp_latest);
+                hc_ntp_status_db->live.received += delta;
+                hc_ntp_status_db->live.client += delta;
+                hc_ntp_status_db->live.xdp = delta;
+                hc_ntp_xdp_latest = answered;
+            }
+        }
         hc_ntp_status_db->live.timestamp = latestPeriod * 10;
         hc_ntp_status_db->latest = hc_ntp_status_db->live;
         hc_ntp_status_db->history[slot] = hc_ntp_status_db->live;
+        hc_archive_traffic (wakeup->tv_sec,
+                            hc_ntp_status_db->live.received,
+                            hc_ntp_status_db->live.client,
+                            hc_ntp_status_db->live.broadcast);
 
         hc_ntp_status_db->live.received = 0;
         hc_ntp_status_db->live.client = 0;
         hc_ntp_status_db->live.broadcast = 0;
+        hc_ntp_status_db->live.batches = 0;
+        hc_ntp_status_db->live.maxbatch = 0;
+        hc_ntp_status_db->live.rebuilds = 0;
+        hc_ntp_status_db->live.xdp = 0;
+        hc_ntp_status_db->live.limited = 0;
+        hc_ntp_status_db->live.dropped = 0;
         latestPeriod += 1;
     }
 
@@ -479,18 +1549,25 @@ void hc_ntp_periodic (const struct timeval *wakeup) {
         if (hc_clock_synchronized() &&
             (wakeup->tv_sec >= latestBroadcast + hc_ntp_period)) {
 
-            struct timeval timestamp;
-            int dispersion = hc_clock_dispersion();
+            struct timespec timestamp;
+            long long dispersion = hc_clock_dispersion();
 
             hc_ntp_set_dispersion (dispersion, &ntpBroadcast);
             hc_ntp_set_reference (&ntpBroadcast);
 
             hc_broadcast_enumerate();
 
-            gettimeofday (&timestamp, NULL);
+            clock_gettime (CLOCK_REALTIME, &timestamp);
             hc_ntp_set_timestamp (&ntpBroadcast.transmit, &timestamp);
 
-            hc_broadcast_send ((char *)&ntpBroadcast, sizeof(ntpBroadcast), 0);
+            if (hc_ntp_interleaved) {
+                hc_broadcast_send_stamped ((char *)&ntpBroadcast,
+                                           sizeof(ntpBroadcast),
+                                           hc_ntp_stamp_broadcast);
+            } else {
+                hc_broadcast_send
+                    ((char *)&ntpBroadcast, sizeof(ntpBroadcast), 0);
+            }
 
             latestBroadcast = wakeup->tv_sec;
             hc_ntp_status_db->live.broadcast += 1;
@@ -498,12 +1575,12 @@ void hc_ntp_periodic (const struct timeval *wakeup) {
 
             if (hc_debug_enabled())
                 printf ("Sent broadcast packet at %ld.%03.3d: "
-                        "transmit=%u/%08x, dispersion=%dms\n",
+                        "transmit=%u/%08x, dispersion=%.3fms\n",
                         (long)(timestamp.tv_sec),
-                        (int)(timestamp.tv_usec / 1000),
+                        (int)(timestamp.tv_nsec / 1000000),
                         ntohl(ntpBroadcast.transmit.seconds),
                         ntohl(ntpBroadcast.transmit.fraction),
-                        dispersion);
+                        dispersion / 1000000.0);
         }
         hc_ntp_status_db->mode = 'S';
         hc_ntp_status_db->source = -1;
@@ -520,5 +1597,25 @@ void hc_ntp_periodic (const struct timeval *wakeup) {
             hc_ntp_status_db->stratum = 0;
         }
     }
+    hc_db_update_end (hc_ntp_status_db);
+
+    hc_ntp_publish ();
+    if (hc_ntp_xdp) hc_xdp_refresh ();
+
+    // The traffic statistics are collected every 10 seconds, which also
+    // limits how long a change of time source can remain undetected.
+    //
+    deadline = (latestPeriod + 1) * 10;
+    if (hc_ntp_status_db->mode == 'S') {
+        if (hc_clock_synchronized() &&
+            (latestBroadcast + hc_ntp_period < deadline))
+            deadline = latestBroadcast + hc_ntp_period;
+    } else if (hc_ntp_status_db->source >= 0) {
+        int source = hc_ntp_status_db->source;
+        time_t death =
+            hc_ntp_status_db->pool[source].local.tv_sec + (hc_ntp_period * 3);
+        if (death < deadline) deadline = death + 1;
+    }
+    return deadline;
 }
 
@@ -26,34 +26,58 @@
 const char *hc_ntp_help (int level);
 
 int  hc_ntp_initialize (int argc, const char **argv);
-void hc_ntp_process    (const struct timeval *receive);
-void hc_ntp_periodic   (const struct timeval *now);
+void hc_ntp_process    (const struct timespec *receive);
+void hc_ntp_refresh    (void);
+time_t hc_ntp_periodic (const struct timespec *now);
 
 #define HC_NTP_DEPTH 128
 #define HC_NTP_POOL  4
+#define HC_NTP_WORKERS 16
 #define HC_NTP_STATUS "NtpStatus"
+#define HC_NTP_CLIENTS "NtpClients"
+#define HC_NTP_CLIENT_SHARD "NtpClients.%d" // One table per shard.
+#define HC_NTP_CLIENT_SHARDS 16
+#define HC_NTP_OFFSETS 4
 
 struct hc_ntp_traffic {
     int received;
-    int client;
+    int client;    // Requests answered, including the limited ones.
     int broadcast;
+    int batches;   // Count of receive batches.
+    int maxbatch;  // Largest receive batch.
+    int rebuilds;  // Count of response prototype rebuilds.
+    int xdp;       // Requests answered by the XDP program.
+    int limited;   // Requests answered with a RATE Kiss-o'-Death.
+    int dropped;   // Requests ignored because of their rate.
     time_t timestamp;
 };
 
+struct hc_ntp_worker {
+    int cpu; // -1 if not pinned.
+    struct hc_ntp_traffic traffic; // Cumulative, updated every period.
+};
+
+// The NtpClients tables are open-addressing hash tables, keyed by the
+// client address, which also selects the table (shard) used. An entry
+// with address family 0 is free.
+//
 struct hc_ntp_client {
     struct sockaddr_in address;
-    struct timeval origin;
-    struct timeval local;
-    int logged;
+    struct timespec origin;  // Transmit time of the latest request.
+    struct timespec local;   // Receive time of the latest request.
+    struct timespec first;   // Receive time of the first request.
+    int count;               // Requests received.
+    long long offset[HC_NTP_OFFSETS]; // Latest origin - local (ns).
+    int older;               // LRU list within the shard, -1 at the end.
+    int newer;               // -1 for the most recently seen client.
 };
 
 struct hc_ntp_server {
-    struct timeval origin;
-    struct timeval local;
+    struct timespec origin;
+    struct timespec local;
     short  stratum;
     struct sockaddr_in address;
     char   name[48];
-    int logged;
 };
 
 typedef struct {
@@ -65,6 +89,8 @@ typedef struct {
     struct hc_ntp_traffic live;
     struct hc_ntp_traffic latest;
     struct hc_ntp_traffic history[HC_NTP_DEPTH];
-    struct hc_ntp_client  clients[HC_NTP_DEPTH];
+
+    int workers;
+    struct hc_ntp_worker  worker[HC_NTP_WORKERS];
 } hc_ntp_status;
 
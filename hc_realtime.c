@@ -0,0 +1,185 @@
+/* houseclock - A simple GPS Time Server with Web console
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * hc_realtime.c - Realtime settings for the time-critical process.
+ *
+ * The GPS and NTP timestamps are only as good as the process latency:
+ * page faults and preemption by other processes directly add to them.
+ * This module applies optional realtime settings to the time process:
+ * SCHED_FIFO scheduling, CPU affinity, memory locking (with the stack
+ * pre-faulted) and a lower timer slack.
+ *
+ * Each setting is verified after being applied, and what could not be
+ * applied is reported in the live database (and in /ntp/status).
+ *
+ * SYNOPSYS:
+ *
+ * const char *hc_realtime_help (int level);
+ *
+ *    Prints the help information, two levels:
+ *      0: short help for one-line argument information.
+ *      1: multi-line description of each argument.
+ *
+ * void hc_realtime_initialize (int argc, const char **argv);
+ *
+ *    Apply the realtime settings to the calling process. This must be
+ *    called after the HTTP process was forked, and before any thread is
+ *    started, so that the threads inherit the scheduling policy.
+ *
+ *    The command line options processed here are:
+ *      -realtime=<N>   Use SCHED_FIFO with priority N (1 to 99).
+ *      -cpu=<N>        Run on CPU N only (typically an isolated CPU).
+ *      -mlock          Lock all memory, current and future.
+ *      -timerslack=<N> Set the timer slack to N nanoseconds.
+ */
+
+#define _GNU_SOURCE // For sched_setaffinity().
+
+#include <sched.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+
+#include "houseclock.h"
+#include "hc_db.h"
+#include "hc_realtime.h"
+
+#define HC_REALTIME_STACK (256 * 1024) // Stack pre-faulted when locked.
+
+static hc_realtime_status *hc_realtime_db = 0;
+
+
+const char *hc_realtime_help (int level) {
+
+    static const char *realtimeHelp[] = {
+        " [-realtime=N] [-cpu=N] [-mlock] [-timerslack=N]",
+        "-realtime=N:  run the time process with SCHED_FIFO priority N.\n"
+        "-cpu=N:       run the time process on CPU N only.\n"
+        "-mlock        lock the time process's memory.\n"
+        "-timerslack=N: set the timer slack of the time process (ns).",
+        NULL
+    };
+    return realtimeHelp[level];
+}
+
+static void hc_realtime_failed (const char *setting, int error) {
+
+    int used = strlen (hc_realtime_db->error);
+    int room = sizeof(hc_realtime_db->error) - used;
+
+    if (room > 1)
+        snprintf (hc_realtime_db->error + used, room, "%s%s: %s",
+                  used ? ", " : "", setting, strerror(error));
+    DEBUG printf ("Cannot apply %s: %s\n", setting, strerror(error));
+}
+
+static void hc_realtime_prefault (void) {
+
+    // Touch the stack, so that its pages are present (and locked) before
+    // they are needed.
+
+    volatile char stack[HC_REALTIME_STACK];
+    int i;
+
+    for (i = 0; i < HC_REALTIME_STACK; i += 1024) stack[i] = 0;
+    (void) stack[0]; // Read back, so that the writes are not unused.
+}
+
+void hc_realtime_initialize (int argc, const char **argv) {
+
+    int i;
+    const char *priority_option = "0";
+    const char *cpu_option = "-1";
+    const char *slack_option = "-1";
+    int mlock_option = 0;
+
+    for (i = 1; i < argc; ++i) {
+        echttp_option_match ("-realtime=", argv[i], &priority_option);
+        echttp_option_match ("-cpu=", argv[i], &cpu_option);
+        echttp_option_match ("-timerslack=", argv[i], &slack_option);
+        mlock_option |= echttp_option_present ("-mlock", argv[i]);
+    }
+
+    i = hc_db_new (HC_REALTIME_STATUS, sizeof(hc_realtime_status), 1);
+    if (i != 0) {
+        fprintf (stderr, "[%s %d] cannot create %s: %s\n",
+                 __FILE__, __LINE__, HC_REALTIME_STATUS, strerror(i));
+        exit (1);
+    }
+    hc_realtime_db = (hc_realtime_status *) hc_db_get (HC_REALTIME_STATUS);
+
+    hc_db_update_begin (hc_realtime_db);
+    memset (hc_realtime_db, 0, sizeof(hc_realtime_status));
+    hc_realtime_db->priority = atoi (priority_option);
+    hc_realtime_db->cpu = atoi (cpu_option);
+    hc_realtime_db->slack = atol (slack_option);
+    hc_realtime_db->mlock = mlock_option;
+
+    if (hc_realtime_db->priority > 0) {
+        struct sched_param param;
+        memset (&param, 0, sizeof(param));
+        param.sched_priority = hc_realtime_db->priority;
+        if (sched_setscheduler (0, SCHED_FIFO, &param) != 0)
+            hc_realtime_failed ("SCHED_FIFO", errno);
+    }
+    hc_realtime_db->policy = sched_getscheduler (0);
+
+    if (hc_realtime_db->cpu >= 0) {
+        cpu_set_t cpuset;
+        CPU_ZERO (&cpuset);
+        CPU_SET (hc_realtime_db->cpu, &cpuset);
+        if (sched_setaffinity (0, sizeof(cpuset), &cpuset) != 0) {
+            hc_realtime_failed ("CPU affinity", errno);
+        } else if (sched_getaffinity (0, sizeof(cpuset), &cpuset) == 0) {
+            hc_realtime_db->pinned = (CPU_COUNT(&cpuset) == 1)
+                                  && CPU_ISSET(hc_realtime_db->cpu, &cpuset);
+        }
+    }
+
+    if (hc_realtime_db->mlock) {
+        if (mlockall (MCL_CURRENT | MCL_FUTURE) != 0) {
+            hc_realtime_failed ("mlockall", errno);
+        } else {
+            hc_realtime_db->locked = 1;
+            hc_realtime_prefault ();
+        }
+    }
+
+    if (hc_realtime_db->slack >= 0) {
+        // A slack of 0 means "use the default": 1 ns is the lowest.
+        unsigned long slack = hc_realtime_db->slack ? hc_realtime_db->slack : 1;
+        if (prctl (PR_SET_TIMERSLACK, slack, 0, 0, 0) != 0)
+            hc_realtime_failed ("timer slack", errno);
+    }
+    hc_realtime_db->timerslack = (long) prctl (PR_GET_TIMERSLACK, 0, 0, 0, 0);
+
+    // Verify that the policy matches what was requested, even if the
+    // calls above did not fail (e.g. a container could ignore them).
+    //
+    if ((hc_realtime_db->priority > 0) &&
+        (hc_realtime_db->policy != SCHED_FIFO)
+        && (!strstr (hc_realtime_db->error, "SCHED_FIFO")))
+        hc_realtime_failed ("SCHED_FIFO", EPERM);
+    if ((hc_realtime_db->cpu >= 0) && (!hc_realtime_db->pinned)
+        && (!strstr (hc_realtime_db->error, "CPU")))
+        hc_realtime_failed ("CPU affinity", EINVAL);
+
+    hc_db_update_end (hc_realtime_db);
+}
@@ -0,0 +1,41 @@
+/* houseclock - A simple GPS Time Server with Web console
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * hc_realtime.h - Realtime settings for the time-critical process.
+ */
+const char *hc_realtime_help (int level);
+
+void hc_realtime_initialize (int argc, const char **argv);
+
+/* Live database.
+ */
+#define HC_REALTIME_STATUS "RealtimeStatus"
+
+typedef struct {
+    int  priority;    // SCHED_FIFO priority requested, 0 if none.
+    int  policy;      // Actual scheduling policy (SCHED_xxx).
+    int  cpu;         // CPU requested, -1 if none.
+    char pinned;      // The process runs on the requested CPU only.
+    char mlock;       // Memory locking was requested.
+    char locked;      // Memory is locked.
+    long slack;       // ns, timer slack requested, -1 if none.
+    long timerslack;  // ns, actual timer slack.
+    char error[128];  // The settings that could not be applied.
+} hc_realtime_status;
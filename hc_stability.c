@@ -0,0 +1,180 @@
+/* houseclock - A simple GPS Time Server with Web console
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * hc_stability.c - Frequency stability statistics of the local clock.
+ *
+ * This module tells whether the offset between the time source and the
+ * local clock is dominated by white phase noise (typically OS scheduling
+ * delays) or by oscillator wander. It calculates the Allan deviation
+ * (ADEV), the modified Allan deviation (MDEV), the time deviation (TDEV)
+ * and the maximum time interval error (MTIE) at octave-spaced values of
+ * tau, from 1 second to 65536 seconds.
+ *
+ * The statistics are calculated online, using a cascade of decimators:
+ * level N receives one block every 2^N seconds, which provides the phase
+ * at the start of the block, its average and its range over the block.
+ * Two consecutive blocks are combined into one block of level N+1. The
+ * memory used is thus proportional to log(n). The drawback is that the
+ * deviations at level N use second differences tau apart, instead of
+ * the fully overlapping estimators, and that MTIE is estimated over
+ * windows of two consecutive blocks, moving by tau.
+ *
+ * The offset samples are those measured by the clock module, i.e. this
+ * describes the local clock, as disciplined, relative to the source.
+ *
+ * SYNOPSYS:
+ *
+ * void hc_stability_initialize (void);
+ *
+ *    Create the live database table for the statistics.
+ *
+ * void hc_stability_sample (const struct timespec *local, long long offset);
+ *
+ *    Add one offset sample (ns) measured at the specified local time.
+ *    The samples are expected every second: a missing sample interrupts
+ *    the series, i.e. the statistics accumulated remain, but the
+ *    decimation restarts.
+ *
+ * void hc_stability_restart (void);
+ *
+ *    Interrupt the series, for example because the time was stepped.
+ */
+
+#include <time.h>
+
+#include "houseclock.h"
+#include "hc_db.h"
+#include "hc_clock.h"
+#include "hc_stability.h"
+
+static hc_stability_level *hc_stability_db = 0;
+
+static struct timespec hc_stability_latest = {0, 0};
+
+
+void hc_stability_initialize (void) {
+
+    int i = hc_db_new (HC_STABILITY,
+                       sizeof(hc_stability_level), HC_STABILITY_LEVELS);
+    if (i != 0) {
+        fprintf (stderr, "[%s %d] cannot create %s: %s\n",
+                 __FILE__, __LINE__, HC_STABILITY, strerror(i));
+        exit (1);
+    }
+    hc_stability_db = (hc_stability_level *) hc_db_get (HC_STABILITY);
+    hc_db_update_begin (hc_stability_db);
+    memset (hc_stability_db, 0,
+            sizeof(hc_stability_level) * HC_STABILITY_LEVELS);
+    for (i = 0; i < HC_STABILITY_LEVELS; ++i) {
+        hc_stability_db[i].tau = 1 << i;
+    }
+    hc_db_update_end (hc_stability_db);
+}
+
+void hc_stability_restart (void) {
+
+    int i;
+
+    if (!hc_stability_db) return;
+
+    hc_db_update_begin (hc_stability_db);
+    for (i = 0; i < HC_STABILITY_LEVELS; ++i) {
+        hc_stability_db[i].filled = 0;
+        hc_stability_db[i].pending = 0;
+    }
+    hc_db_update_end (hc_stability_db);
+    hc_stability_latest.tv_sec = 0;
+}
+
+static void hc_stability_push (int level, double phase, double average,
+                               double low, double high) {
+
+    hc_stability_level *l;
+    double d;
+
+    if (level >= HC_STABILITY_LEVELS) return;
+    l = hc_stability_db + level;
+
+    l->phase[0] = l->phase[1];
+    l->phase[1] = l->phase[2];
+    l->phase[2] = phase;
+    l->average[0] = l->average[1];
+    l->average[1] = l->average[2];
+    l->average[2] = average;
+    if (l->filled < 3) l->filled += 1;
+
+    if (l->filled >= 3) {
+        d = l->phase[2] - (2 * l->phase[1]) + l->phase[0];
+        l->adev += d * d;
+        d = l->average[2] - (2 * l->average[1]) + l->average[0];
+        l->mdev += d * d;
+        l->terms += 1;
+    }
+
+    // MTIE over this block and the previous one.
+    //
+    if (l->filled >= 2) {
+        double range = ((high > l->high) ? high : l->high)
+                       - ((low < l->low) ? low : l->low);
+        if (range > l->mtie) l->mtie = range;
+    }
+    l->low = low;
+    l->high = high;
+
+    // Combine two consecutive blocks into one for the next level.
+    //
+    if (!l->pending) {
+        l->pendingphase = phase;
+        l->pendingaverage = average;
+        l->pendinglow = low;
+        l->pendinghigh = high;
+        l->pending = 1;
+        return;
+    }
+    l->pending = 0;
+    hc_stability_push (level + 1,
+                       l->pendingphase,
+                       (l->pendingaverage + average) / 2,
+                       (low < l->pendinglow) ? low : l->pendinglow,
+                       (high > l->pendinghigh) ? high : l->pendinghigh);
+}
+
+void hc_stability_sample (const struct timespec *local, long long offset) {
+
+    long long elapsed;
+
+    if (!hc_stability_db) return;
+
+    if (hc_stability_latest.tv_sec) {
+        elapsed = hc_clock_delta (local, &hc_stability_latest);
+        if (elapsed < HC_CLOCK_NSEC / 2) return; // Same second.
+        if (elapsed > (3 * HC_CLOCK_NSEC) / 2) {
+            DEBUG printf ("Stability series interrupted after %.3f s\n",
+                          elapsed / (double)HC_CLOCK_NSEC);
+            hc_stability_restart ();
+        }
+    }
+    hc_stability_latest = *local;
+
+    hc_db_update_begin (hc_stability_db);
+    hc_stability_push (0, (double)offset, (double)offset,
+                       (double)offset, (double)offset);
+    hc_db_update_end (hc_stability_db);
+}
@@ -0,0 +1,49 @@
+/* houseclock - A simple GPS Time Server with Web console
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * hc_stability.h - Frequency stability statistics of the local clock.
+ */
+void hc_stability_initialize (void);
+void hc_stability_sample (const struct timespec *local, long long offset);
+void hc_stability_restart (void);
+
+/* Live database.
+ */
+#define HC_STABILITY "ClockStability"
+
+#define HC_STABILITY_LEVELS 17 // tau = 1 s to 65536 s (about one day).
+
+typedef struct {
+    int    tau;        // seconds.
+    int    terms;      // Count of second differences accumulated.
+    double adev;       // ns², sum of squared second differences (phase).
+    double mdev;       // ns², same with the phase averaged over tau.
+    double mtie;       // ns, max phase range over a 2 * tau window.
+
+    // The decimation state (internal).
+    int    filled;
+    double phase[3];   // ns, latest phase samples, tau apart.
+    double average[3]; // ns, latest phase averages over tau.
+    double low, high;  // ns, phase range of the latest block.
+    int    pending;    // One block is waiting for its pair.
+    double pendingphase;
+    double pendingaverage;
+    double pendinglow, pendinghigh;
+} hc_stability_level;
@@ -0,0 +1,196 @@
+/* houseclock - A simple GPS Time Server with Web console
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * hc_state.c - Keep a small persistent state across restarts.
+ *
+ * This module stores a few named integer values in a text file, one
+ * "name=value" line per item. The file is loaded at startup, so that
+ * the clock discipline does not restart from zero knowledge.
+ *
+ * Because the state is typically stored on a SD card, the file is not
+ * written more often than once per period (one hour by default), and
+ * only if a value changed. The file is replaced atomically.
+ *
+ * SYNOPSYS:
+ *
+ * void hc_state_initialize (int argc, const char **argv);
+ *
+ *    Load the state file. This must be called before the other modules
+ *    are initialized.
+ *
+ *    The command line options processed here are:
+ *      -state=<path>     The state file, or "none" for no state file.
+ *      -state-period=<N> The minimum interval between writes (seconds).
+ *
+ * int hc_state_get (const char *name, long long *value);
+ *
+ *    Get a value from the state. Return 1 if the value was found, 0
+ *    otherwise.
+ *
+ * void hc_state_set (const char *name, long long value);
+ *
+ *    Change a value of the state. This does not write the file.
+ *
+ * time_t hc_state_periodic (time_t now);
+ *
+ *    Write the state file if a value changed and the period has elapsed.
+ *    Returns the time when this function should be called next.
+ */
+
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "houseclock.h"
+#include "hc_state.h"
+
+#define HC_STATE_MAX 32
+
+static struct {
+    char name[128]; // Long enough for a device path.
+    long long value;
+} hc_state_items[HC_STATE_MAX];
+
+static int hc_state_count = 0;
+static int hc_state_changed = 0;
+
+static const char *hc_state_path = "/var/lib/house/houseclock.state";
+static int hc_state_period = 3600;
+static time_t hc_state_latest = 0;
+
+
+static int hc_state_search (const char *name) {
+    int i;
+    for (i = 0; i < hc_state_count; ++i) {
+        if (strcmp (hc_state_items[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+static void hc_state_store (const char *name, long long value) {
+
+    int i = hc_state_search (name);
+
+    if (i < 0) {
+        if (hc_state_count >= HC_STATE_MAX) return;
+        i = hc_state_count++;
+        snprintf (hc_state_items[i].name, sizeof(hc_state_items[i].name),
+                  "%s", name);
+    } else if (hc_state_items[i].value == value) {
+        return;
+    }
+    hc_state_items[i].value = value;
+    hc_state_changed = 1;
+}
+
+void hc_state_initialize (int argc, const char **argv) {
+
+    int i;
+    FILE *f;
+    char line[256];
+    const char *period_option = "3600";
+
+    for (i = 1; i < argc; ++i) {
+        echttp_option_match ("-state=", argv[i], &hc_state_path);
+        echttp_option_match ("-state-period=", argv[i], &period_option);
+    }
+    hc_state_period = atoi(period_option);
+    if (hc_state_period < 60) hc_state_period = 60;
+
+    // Do not write the file right after startup: the state is not
+    // known better than what was loaded.
+    hc_state_latest = time(0);
+
+    if (strcmp (hc_state_path, "none") == 0) {
+        hc_state_path = 0;
+        return;
+    }
+
+    f = fopen (hc_state_path, "r");
+    if (!f) {
+        DEBUG printf ("No state loaded from %s: %s\n",
+                      hc_state_path, strerror(errno));
+        return;
+    }
+    while (fgets (line, sizeof(line), f)) {
+        char *value = strchr (line, '=');
+        if (!value) continue;
+        *(value++) = 0;
+        hc_state_store (line, atoll(value));
+        DEBUG printf ("State %s = %lld\n", line, atoll(value));
+    }
+    fclose (f);
+    hc_state_changed = 0;
+}
+
+int hc_state_get (const char *name, long long *value) {
+
+    int i = hc_state_search (name);
+
+    if (i < 0) return 0;
+    *value = hc_state_items[i].value;
+    return 1;
+}
+
+void hc_state_set (const char *name, long long value) {
+    hc_state_store (name, value);
+}
+
+time_t hc_state_periodic (time_t now) {
+
+    int i;
+    FILE *f;
+    char temporary[256];
+
+    if ((!hc_state_path) || hc_test_mode()) return now + hc_state_period;
+
+    if (now < hc_state_latest) hc_state_latest = now; // Time went back.
+    if (now < hc_state_latest + hc_state_period)
+        return hc_state_latest + hc_state_period;
+    if (!hc_state_changed) return now + hc_state_period;
+
+    hc_state_latest = now;
+
+    // Write a new file and then rename it, so that a crash or power
+    // failure never leaves a truncated state.
+    //
+    snprintf (temporary, sizeof(temporary), "%s.new", hc_state_path);
+    f = fopen (temporary, "w");
+    if (!f) {
+        DEBUG printf ("Cannot write %s: %s\n", temporary, strerror(errno));
+        return now + hc_state_period;
+    }
+    for (i = 0; i < hc_state_count; ++i) {
+        fprintf (f, "%s=%lld\n",
+                 hc_state_items[i].name, hc_state_items[i].value);
+    }
+    fflush (f);
+    fsync (fileno(f));
+    fclose (f);
+    if (rename (temporary, hc_state_path) != 0) {
+        DEBUG printf ("Cannot rename %s: %s\n", temporary, strerror(errno));
+        return now + hc_state_period;
+    }
+    hc_state_changed = 0;
+    DEBUG printf ("State saved to %s\n", hc_state_path);
+
+    return now + hc_state_period;
+}
+
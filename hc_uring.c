@@ -0,0 +1,465 @@
+/* houseclock - A simple GPS Time Server with Web console
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * hc_uring.c - An io_uring based datapath for UDP servers.
+ *
+ *    This module is an alternative to the recvmmsg()/sendmmsg() functions
+ *    of hc_broadcast.c. A multishot receive stays armed on the socket,
+ *    which uses buffers from a ring registered with the kernel: receiving
+ *    data does not require any system call. The replies are built in place,
+ *    in the buffer of the request, and all the replies of a batch are
+ *    submitted with a single system call. A buffer is given back to the
+ *    kernel once its reply was sent.
+ *
+ *    This uses the raw system calls, so that there is no dependency on
+ *    liburing. If the kernel (or the system headers) do not support the
+ *    features needed, hc_uring_open() fails and the application should
+ *    use the hc_broadcast.c functions instead.
+ *
+ * SYNOPSYS:
+ *
+ * int hc_uring_open (int server);
+ *
+ *    Set up an io_uring for the specified UDP socket, which must have been
+ *    created by hc_broadcast_open() or hc_broadcast_open_worker(). Returns
+ *    an identifier to use with the other functions, or -1 if io_uring is
+ *    not available.
+ *
+ * int hc_uring_fd (int ring);
+ *
+ *    Return the file descriptor to poll: it becomes readable when there
+ *    are received packets (or other completions) to process.
+ *
+ * int hc_uring_receive (int ring, hc_broadcast_message *messages, int count);
+ *
+ *    Same as hc_broadcast_receive_batch(), except that this sets the data
+ *    field of each message, which points to the ring's buffers (and the
+ *    size field, which is the room available in that buffer). The data
+ *    remains valid until hc_uring_reply() is called.
+ *
+ * int hc_uring_reply (int ring, const hc_broadcast_message *messages, int count);
+ *
+ *    Send count response packets, each built in place in the buffer of
+ *    one of the messages returned by the latest call to hc_uring_receive().
+ *    This gives all the buffers from the latest receive back to the kernel,
+ *    either now or once the reply was sent: this must be called after each
+ *    receive, even if there is no reply (count 0). Returns the number of
+ *    packets submitted.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "houseclock.h"
+#include "hc_broadcast.h"
+#include "hc_uring.h"
+
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+
+#define HC_URING_MAX      32   // Main loop and workers.
+#define HC_URING_ENTRIES  256
+#define HC_URING_BUFFERS  256  // Must be a power of 2.
+#define HC_URING_BUFSIZE  2048
+#define HC_URING_GROUP    1
+
+// Room for the SO_TIMESTAMPNS receive timestamp, and some spare.
+#define HC_URING_CONTROL (2 * CMSG_SPACE(sizeof(struct timespec)))
+
+// The completion's user data tells what operation completed. For a send,
+// this also tells which buffer is now free.
+//
+#define HC_URING_RECEIVE 0x10000
+#define HC_URING_SEND    0x20000
+
+typedef struct {
+    int fd;
+    int server;
+
+    unsigned int *sqhead;
+    unsigned int *sqtail;
+    unsigned int  sqmask;
+    unsigned int  sqentries;
+    unsigned int *sqarray;
+    unsigned int  sqlocal; // Tail of the SQEs prepared, not yet submitted.
+    struct io_uring_sqe *sqes;
+
+    unsigned int *cqhead;
+    unsigned int *cqtail;
+    unsigned int  cqmask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *buffers;
+    unsigned short buftail;
+    char *data;
+
+    struct msghdr receive; // Template for the multishot receive.
+    int armed;
+
+    // The buffers used by the latest receive.
+    int batch[HC_BROADCAST_BATCH];
+    int batchcount;
+
+    // The send operations, indexed by buffer.
+    struct {
+        struct msghdr header;
+        struct iovec  vector;
+        struct sockaddr_in address;
+        int    busy;
+    } send[HC_URING_BUFFERS];
+} hc_uring;
+
+static hc_uring *hc_uring_table[HC_URING_MAX];
+static int hc_uring_count = 0;
+
+
+static struct io_uring_sqe *hc_uring_sqe (hc_uring *ring) {
+
+    struct io_uring_sqe *sqe;
+    unsigned int head = __atomic_load_n (ring->sqhead, __ATOMIC_ACQUIRE);
+    unsigned int index;
+
+    if (ring->sqlocal - head >= ring->sqentries) return 0; // Full.
+
+    index = ring->sqlocal & ring->sqmask;
+    sqe = ring->sqes + index;
+    memset (sqe, 0, sizeof(*sqe));
+    ring->sqarray[index] = index;
+    ring->sqlocal += 1;
+    return sqe;
+}
+
+static int hc_uring_submit (hc_uring *ring) {
+
+    unsigned int count = ring->sqlocal - *(ring->sqtail);
+
+    if (count == 0) return 0;
+
+    __atomic_store_n (ring->sqtail, ring->sqlocal, __ATOMIC_RELEASE);
+    if (syscall (__NR_io_uring_enter, ring->fd, count, 0, 0, NULL, 0) < 0) {
+        DEBUG printf ("io_uring_enter() error: %s\n", strerror(errno));
+        return -1;
+    }
+    return count;
+}
+
+static void hc_uring_recycle (hc_uring *ring, int id) {
+
+    struct io_uring_buf *buffer =
+        ring->buffers->bufs + (ring->buftail & (HC_URING_BUFFERS - 1));
+
+    buffer->addr = (unsigned long) (ring->data + (id * HC_URING_BUFSIZE));
+    buffer->len = HC_URING_BUFSIZE;
+    buffer->bid = id;
+    ring->buftail += 1;
+    __atomic_store_n (&(ring->buffers->tail), ring->buftail, __ATOMIC_RELEASE);
+}
+
+static void hc_uring_arm (hc_uring *ring) {
+
+    struct io_uring_sqe *sqe = hc_uring_sqe (ring);
+    if (!sqe) return;
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = ring->server;
+    sqe->addr = (unsigned long) &(ring->receive);
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = HC_URING_GROUP;
+    sqe->user_data = HC_URING_RECEIVE;
+    ring->armed = 1;
+}
+
+static void hc_uring_close (hc_uring *ring) {
+    if (ring->fd >= 0) close (ring->fd);
+    free (ring->data);
+    free (ring);
+}
+
+int hc_uring_open (int server) {
+
+    int i;
+    char *map;
+    size_t size;
+    hc_uring *ring;
+    struct io_uring_params params;
+    struct io_uring_buf_reg registration;
+
+    if (hc_uring_count >= HC_URING_MAX) return -1;
+
+    ring = calloc (1, sizeof(hc_uring));
+    if (!ring) return -1;
+    ring->server = server;
+
+    memset (&params, 0, sizeof(params));
+    ring->fd = syscall (__NR_io_uring_setup, HC_URING_ENTRIES, &params);
+    if (ring->fd < 0) {
+        DEBUG printf ("io_uring is not available: %s\n", strerror(errno));
+        free (ring);
+        return -1;
+    }
+    if (! (params.features & IORING_FEAT_SINGLE_MMAP)) {
+        DEBUG printf ("io_uring is too old\n");
+        hc_uring_close (ring);
+        return -1;
+    }
+
+    size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    if (size < params.cq_off.cqes
+                  + params.cq_entries * sizeof(struct io_uring_cqe))
+        size = params.cq_off.cqes
+                  + params.cq_entries * sizeof(struct io_uring_cqe);
+    map = mmap (0, size, PROT_READ|PROT_WRITE,
+                MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (map == MAP_FAILED) {
+        hc_uring_close (ring);
+        return -1;
+    }
+    ring->sqhead = (unsigned int *) (map + params.sq_off.head);
+    ring->sqtail = (unsigned int *) (map + params.sq_off.tail);
+    ring->sqmask = *(unsigned int *) (map + params.sq_off.ring_mask);
+    ring->sqentries = *(unsigned int *) (map + params.sq_off.ring_entries);
+    ring->sqarray = (unsigned int *) (map + params.sq_off.array);
+    ring->sqlocal = *(ring->sqtail);
+    ring->cqhead = (unsigned int *) (map + params.cq_off.head);
+    ring->cqtail = (unsigned int *) (map + params.cq_off.tail);
+    ring->cqmask = *(unsigned int *) (map + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (map + params.cq_off.cqes);
+
+    ring->sqes = mmap (0, params.sq_entries * sizeof(struct io_uring_sqe),
+                       PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                       ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        hc_uring_close (ring);
+        return -1;
+    }
+
+    // Register the buffer ring (Linux 5.19 or later).
+    //
+    ring->buffers = mmap (0, HC_URING_BUFFERS * sizeof(struct io_uring_buf),
+                          PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS,
+                          -1, 0);
+    ring->data = malloc (HC_URING_BUFFERS * HC_URING_BUFSIZE);
+    if ((ring->buffers == MAP_FAILED) || (!ring->data)) {
+        hc_uring_close (ring);
+        return -1;
+    }
+    memset (&registration, 0, sizeof(registration));
+    registration.ring_addr = (unsigned long) ring->buffers;
+    registration.ring_entries = HC_URING_BUFFERS;
+    registration.bgid = HC_URING_GROUP;
+    if (syscall (__NR_io_uring_register, ring->fd,
+                 IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+        DEBUG printf ("io_uring buffer ring not supported: %s\n",
+                      strerror(errno));
+        hc_uring_close (ring);
+        return -1;
+    }
+    ring->buftail = 0;
+    for (i = 0; i < HC_URING_BUFFERS; ++i) hc_uring_recycle (ring, i);
+
+    // Only the sizes matter for a multishot receive: the kernel
+    // lays out the address and control data at the start of the buffer.
+    //
+    ring->receive.msg_namelen = sizeof(struct sockaddr_in);
+    ring->receive.msg_controllen = HC_URING_CONTROL;
+
+    hc_uring_arm (ring);
+    if (hc_uring_submit (ring) < 0) {
+        hc_uring_close (ring);
+        return -1;
+    }
+
+    DEBUG printf ("Using io_uring for socket %d\n", server);
+    hc_uring_table[hc_uring_count] = ring;
+    return hc_uring_count++;
+}
+
+int hc_uring_fd (int ring) {
+    if ((ring < 0) || (ring >= hc_uring_count)) return -1;
+    return hc_uring_table[ring]->fd;
+}
+
+static int hc_uring_decode (hc_uring *ring, const struct io_uring_cqe *cqe,
+                            hc_broadcast_message *message) {
+
+    // A buffer received by a multishot recvmsg starts with a header,
+    // followed by the source address, the control data and the payload.
+
+    int id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    char *buffer = ring->data + (id * HC_URING_BUFSIZE);
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buffer;
+    char *name = buffer + sizeof(struct io_uring_recvmsg_out);
+    char *control = name + ring->receive.msg_namelen;
+    char *payload = control + ring->receive.msg_controllen;
+    struct msghdr header;
+
+    // A buffer that carries nothing to process is given back right away:
+    // otherwise empty datagrams would slowly exhaust the buffers.
+    //
+    if ((out->namelen < sizeof(struct sockaddr_in)) ||
+        (out->payloadlen == 0)) {
+        hc_uring_recycle (ring, id);
+        return 0;
+    }
+    ring->batch[ring->batchcount++] = id;
+
+    message->data = payload;
+    message->size = HC_URING_BUFSIZE - (payload - buffer);
+    message->length = out->payloadlen;
+    if (message->length > message->size) message->length = message->size;
+    memcpy (&(message->address), name, sizeof(struct sockaddr_in));
+
+    memset (&header, 0, sizeof(header));
+    header.msg_control = control;
+    header.msg_controllen = out->controllen;
+    hc_broadcast_timestamp (&header, &(message->timestamp));
+    return 1;
+}
+
+int hc_uring_receive (int index, hc_broadcast_message *messages, int count) {
+
+    int received = 0;
+    hc_uring *ring;
+    unsigned int head;
+
+    if ((index < 0) || (index >= hc_uring_count)) return 0;
+    ring = hc_uring_table[index];
+
+    if (count > HC_BROADCAST_BATCH) count = HC_BROADCAST_BATCH;
+    ring->batchcount = 0;
+
+    head = *(ring->cqhead);
+    while ((received < count) && (ring->batchcount < HC_BROADCAST_BATCH)) {
+
+        struct io_uring_cqe *cqe;
+
+        if (head == __atomic_load_n (ring->cqtail, __ATOMIC_ACQUIRE)) break;
+        cqe = ring->cqes + (head & ring->cqmask);
+
+        if (cqe->user_data == HC_URING_RECEIVE) {
+            if (! (cqe->flags & IORING_CQE_F_MORE)) ring->armed = 0;
+            if (cqe->res < 0) {
+                // ENOBUFS means that all buffers are in use: the receive
+                // is re-armed once some were given back.
+                if (cqe->res != -ENOBUFS)
+                    DEBUG printf ("io_uring receive error: %s\n",
+                                  strerror(-cqe->res));
+            } else if (cqe->flags & IORING_CQE_F_BUFFER) {
+                received += hc_uring_decode (ring, cqe, messages + received);
+            }
+        } else if (cqe->user_data & HC_URING_SEND) {
+            int id = (int) (cqe->user_data & 0xffff);
+            if (cqe->res < 0)
+                DEBUG printf ("io_uring send error: %s\n",
+                              strerror(-cqe->res));
+            ring->send[id].busy = 0;
+            hc_uring_recycle (ring, id);
+        }
+        head += 1;
+    }
+    __atomic_store_n (ring->cqhead, head, __ATOMIC_RELEASE);
+
+    if (! ring->armed) {
+        hc_uring_arm (ring);
+        hc_uring_submit (ring);
+    }
+    return received;
+}
+
+int hc_uring_reply (int index,
+                    const hc_broadcast_message *messages, int count) {
+
+    int i;
+    int sent = 0;
+    hc_uring *ring;
+
+    if ((index < 0) || (index >= hc_uring_count)) return 0;
+    ring = hc_uring_table[index];
+
+    for (i = 0; i < count; ++i) {
+
+        struct io_uring_sqe *sqe;
+        int id = (int) ((messages[i].data - ring->data) / HC_URING_BUFSIZE);
+
+        if ((messages[i].data < ring->data) ||
+            (id >= HC_URING_BUFFERS) || ring->send[id].busy) continue;
+
+        sqe = hc_uring_sqe (ring);
+        if (!sqe) break;
+
+        ring->send[id].address = messages[i].address;
+        ring->send[id].vector.iov_base = messages[i].data;
+        ring->send[id].vector.iov_len = messages[i].length;
+        memset (&(ring->send[id].header), 0, sizeof(struct msghdr));
+        ring->send[id].header.msg_name = &(ring->send[id].address);
+        ring->send[id].header.msg_namelen = sizeof(struct sockaddr_in);
+        ring->send[id].header.msg_iov = &(ring->send[id].vector);
+        ring->send[id].header.msg_iovlen = 1;
+        ring->send[id].busy = 1;
+
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = ring->server;
+        sqe->addr = (unsigned long) &(ring->send[id].header);
+        sqe->len = 1;
+        sqe->user_data = HC_URING_SEND | id;
+        sent += 1;
+    }
+
+    // The buffers without a reply can be reused immediately.
+    //
+    for (i = 0; i < ring->batchcount; ++i) {
+        int id = ring->batch[i];
+        if (! ring->send[id].busy) hc_uring_recycle (ring, id);
+    }
+    ring->batchcount = 0;
+
+    if (hc_uring_submit (ring) < 0) return 0;
+    return sent;
+}
+
+#else // No io_uring support in the system headers.
+
+int hc_uring_open (int server) {
+    return -1;
+}
+
+int hc_uring_fd (int ring) {
+    return -1;
+}
+
+int hc_uring_receive (int ring, hc_broadcast_message *messages, int count) {
+    return 0;
+}
+
+int hc_uring_reply (int ring, const hc_broadcast_message *messages, int count) {
+    return 0;
+}
+
+#endif
@@ -0,0 +1,186 @@
+/* houseclock - A simple GPS Time Server with Web console
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * hc_xdp.bpf.c - The XDP program answering NTP client requests.
+ *
+ *    This program is built with clang (-target bpf) and loaded by hc_xdp.c.
+ *
+ *    It answers plain NTP client requests (mode 3, no extension) sent to
+ *    the houseclock port, over IPv4 without IP options, and to a unicast
+ *    address only. The response is a copy of the prototype that houseclock
+ *    keeps up to date in the hc_xdp_state map, with the three timestamps
+ *    set from the monotonic clock plus the offset to the system time, as
+ *    published by houseclock. The state is copied under its spin lock, so
+ *    that a response never mixes two versions of the prototype.
+ *
+ *    Every other packet is passed to the network stack, i.e. to the
+ *    normal houseclock datapath: broadcasts, control messages, other
+ *    protocols, and all requests when houseclock is not synchronized.
+ */
+
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+#include "hc_xdp.h"
+
+#define NTP_UNIX_EPOCH 2208988800ull
+#define HC_XDP_NSEC    1000000000ull
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct hc_xdp_state);
+} hc_xdp_state SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct hc_xdp_counters);
+} hc_xdp_counters SEC(".maps");
+
+static __always_inline void hc_xdp_timestamp (unsigned char *ntp,
+                                              __s64 offset) {
+
+    __u64 now = bpf_ktime_get_ns() + offset;
+    __u64 fraction =
+        (((now % HC_XDP_NSEC) << 32) + (HC_XDP_NSEC / 2)) / HC_XDP_NSEC;
+    __u32 *field = (__u32 *)ntp;
+
+    field[0] = bpf_htonl ((__u32)(now / HC_XDP_NSEC + NTP_UNIX_EPOCH));
+    field[1] = bpf_htonl ((__u32)fraction);
+}
+
+static __always_inline __u16 hc_xdp_checksum (struct iphdr *ip) {
+
+    __u16 *word = (__u16 *)ip;
+    __u32 sum = 0;
+    int i;
+
+    ip->check = 0;
+#pragma unroll
+    for (i = 0; i < sizeof(struct iphdr) / 2; ++i) sum += word[i];
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return (__u16)~sum;
+}
+
+SEC("xdp")
+int hc_xdp_ntp (struct xdp_md *context) {
+
+    void *data = (void *)(long)context->data;
+    void *end = (void *)(long)context->data_end;
+    struct ethhdr *ethernet = data;
+    struct iphdr *ip;
+    struct udphdr *udp;
+    unsigned char *ntp;
+    unsigned char address[ETH_ALEN];
+    __u64 transmit;
+    __u32 key = 0;
+    __u32 ipaddress;
+    __u16 port;
+    __u32 serving;
+    __s64 offset;
+    unsigned char prototype[HC_XDP_NTP_SIZE];
+    struct hc_xdp_state *state;
+    struct hc_xdp_counters *counters;
+
+    if ((void *)(ethernet + 1) > end) return XDP_PASS;
+    if (ethernet->h_proto != bpf_htons(ETH_P_IP)) return XDP_PASS;
+    if (ethernet->h_dest[0] & 1) return XDP_PASS; // Multicast, broadcast.
+
+    ip = (struct iphdr *)(ethernet + 1);
+    if ((void *)(ip + 1) > end) return XDP_PASS;
+    if ((ip->ihl != 5) || (ip->protocol != IPPROTO_UDP)) return XDP_PASS;
+    if (ip->frag_off & bpf_htons(0x3fff)) return XDP_PASS; // Fragment.
+
+    // Never answer from, or to, a multicast or broadcast address.
+    if (bpf_ntohl(ip->daddr) >= 0xe0000000) return XDP_PASS;
+    if (bpf_ntohl(ip->saddr) >= 0xe0000000) return XDP_PASS;
+    if (ip->saddr == 0) return XDP_PASS;
+
+    udp = (struct udphdr *)(ip + 1);
+    if ((void *)(udp + 1) > end) return XDP_PASS;
+
+    state = bpf_map_lookup_elem (&hc_xdp_state, &key);
+    if (!state) return XDP_PASS;
+    if (udp->dest != state->port) return XDP_PASS;
+
+    counters = bpf_map_lookup_elem (&hc_xdp_counters, &key);
+    if (!counters) return XDP_PASS;
+
+    // Take a consistent copy of the state, which houseclock may update
+    // at any time (see hc_xdp_update()).
+    //
+    bpf_spin_lock (&state->lock);
+    serving = state->serving;
+    offset = state->offset;
+    __builtin_memcpy (prototype, state->prototype, HC_XDP_NTP_SIZE);
+    bpf_spin_unlock (&state->lock);
+
+    // Only answer what the prototype fits: a plain client request.
+    //
+    ntp = (unsigned char *)(udp + 1);
+    if ((!serving) ||
+        ((void *)(ntp + HC_XDP_NTP_SIZE) > end) ||
+        (udp->len != bpf_htons(sizeof(struct udphdr) + HC_XDP_NTP_SIZE)) ||
+        ((ntp[0] & 0x7) != 3)) {
+        counters->passed += 1;
+        return XDP_PASS;
+    }
+
+    // The client's transmit timestamp becomes the response's origin.
+    //
+    transmit = *(__u64 *)(ntp + 40);
+    __builtin_memcpy (ntp, prototype, HC_XDP_NTP_SIZE);
+    *(__u64 *)(ntp + 24) = transmit;
+    hc_xdp_timestamp (ntp + 32, offset); // Receive.
+
+    // Send the packet back where it came from.
+    //
+    __builtin_memcpy (address, ethernet->h_dest, ETH_ALEN);
+    __builtin_memcpy (ethernet->h_dest, ethernet->h_source, ETH_ALEN);
+    __builtin_memcpy (ethernet->h_source, address, ETH_ALEN);
+
+    ipaddress = ip->daddr;
+    ip->daddr = ip->saddr;
+    ip->saddr = ipaddress;
+    ip->ttl = 64;
+    ip->check = hc_xdp_checksum (ip);
+
+    port = udp->dest;
+    udp->dest = udp->source;
+    udp->source = port;
+    udp->check = 0; // Optional over IPv4.
+
+    hc_xdp_timestamp (ntp + 40, offset); // Transmit, as late as possible.
+
+    counters->answered += 1;
+    return XDP_TX;
+}
+
+char _license[] SEC("license") = "GPL";
+
@@ -0,0 +1,230 @@
+/* houseclock - A simple GPS Time Server with Web console
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * hc_xdp.c - Control the XDP fast path for answering NTP client requests.
+ *
+ *    This module loads the hc_xdp.bpf.c program, attaches it to a network
+ *    interface and keeps its state map up to date. The program remains
+ *    attached only as long as houseclock runs.
+ *
+ *    This requires libbpf, and is only built when HC_XDP is defined
+ *    (see the Makefile). Otherwise hc_xdp_attach() always fails.
+ *
+ * SYNOPSYS:
+ *
+ * int hc_xdp_attach (const char *interface, const char *object, int port);
+ *
+ *    Load the BPF object file and attach its XDP program to the specified
+ *    interface, to answer NTP requests sent to the specified UDP port
+ *    (host order). Returns 0 on success, -1 on failure. The program does
+ *    not answer any request until hc_xdp_publish() has been called.
+ *
+ * void hc_xdp_publish (int serving, const void *prototype, int length);
+ *
+ *    Update the response prototype used by the XDP program, and whether
+ *    it should answer requests at all.
+ *
+ * void hc_xdp_refresh (void);
+ *
+ *    Update the offset between the system time and the monotonic clock.
+ *    This must be called after the system time was changed, and is also
+ *    called periodically.
+ *
+ * int hc_xdp_traffic (long long *answered, long long *passed);
+ *
+ *    Get the cumulative count of requests answered by the XDP program,
+ *    and of NTP packets passed to the application. Returns 0 on success,
+ *    -1 if the XDP program is not active.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include "houseclock.h"
+#include "hc_xdp.h"
+
+#ifdef HC_XDP
+
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+static struct bpf_object *hc_xdp_object = 0;
+static struct bpf_link *hc_xdp_link = 0;
+static int hc_xdp_state_map = -1;
+static int hc_xdp_counters_map = -1;
+static int hc_xdp_cpus = 0;
+
+static struct hc_xdp_state hc_xdp_current;
+
+
+static long long hc_xdp_offset (void) {
+
+    // Bracket the monotonic clock between two readings of the system time.
+
+    struct timespec before, monotonic, after;
+
+    clock_gettime (CLOCK_REALTIME, &before);
+    clock_gettime (CLOCK_MONOTONIC, &monotonic);
+    clock_gettime (CLOCK_REALTIME, &after);
+
+    return ((before.tv_sec + after.tv_sec) * 500000000LL)
+               + ((before.tv_nsec + after.tv_nsec) / 2)
+           - ((monotonic.tv_sec * 1000000000LL) + monotonic.tv_nsec);
+}
+
+static void hc_xdp_update (void) {
+
+    __u32 key = 0;
+
+    if (hc_xdp_state_map < 0) return;
+
+    hc_xdp_current.offset = hc_xdp_offset ();
+    // The XDP program copies the state under its lock: a response never
+    // mixes the old and new prototypes.
+    if (bpf_map_update_elem (hc_xdp_state_map,
+                             &key, &hc_xdp_current, BPF_F_LOCK) != 0) {
+        DEBUG printf ("XDP state update failed: %s\n", strerror(errno));
+    }
+}
+
+int hc_xdp_attach (const char *interface, const char *object, int port) {
+
+    struct bpf_program *program;
+    int ifindex = if_nametoindex (interface);
+
+    if (ifindex == 0) {
+        fprintf (stderr, "[%s %d] invalid interface %s\n",
+                 __FILE__, __LINE__, interface);
+        return -1;
+    }
+
+    hc_xdp_object = bpf_object__open_file (object, NULL);
+    if (!hc_xdp_object) {
+        fprintf (stderr, "[%s %d] cannot open %s: %s\n",
+                 __FILE__, __LINE__, object, strerror(errno));
+        return -1;
+    }
+    if (bpf_object__load (hc_xdp_object) != 0) {
+        fprintf (stderr, "[%s %d] cannot load %s: %s\n",
+                 __FILE__, __LINE__, object, strerror(errno));
+        goto failure;
+    }
+    hc_xdp_state_map =
+        bpf_object__find_map_fd_by_name (hc_xdp_object, "hc_xdp_state");
+    hc_xdp_counters_map =
+        bpf_object__find_map_fd_by_name (hc_xdp_object, "hc_xdp_counters");
+    program = bpf_object__find_program_by_name (hc_xdp_object, "hc_xdp_ntp");
+    if ((hc_xdp_state_map < 0) || (hc_xdp_counters_map < 0) || (!program)) {
+        fprintf (stderr, "[%s %d] %s is not a houseclock XDP program\n",
+                 __FILE__, __LINE__, object);
+        goto failure;
+    }
+
+    hc_xdp_cpus = libbpf_num_possible_cpus ();
+    if (hc_xdp_cpus <= 0) goto failure;
+
+    // Nothing is answered until the first prototype is published.
+    //
+    memset (&hc_xdp_current, 0, sizeof(hc_xdp_current));
+    hc_xdp_current.port = htons((unsigned short)port);
+    hc_xdp_update ();
+
+    // A link is detached automatically when the process exits, so that
+    // the XDP program never answers on behalf of a dead server.
+    //
+    hc_xdp_link = bpf_program__attach_xdp (program, ifindex);
+    if (!hc_xdp_link) {
+        fprintf (stderr, "[%s %d] cannot attach XDP to %s: %s\n",
+                 __FILE__, __LINE__, interface, strerror(errno));
+        goto failure;
+    }
+    DEBUG printf ("XDP program attached to %s\n", interface);
+    return 0;
+
+failure:
+    bpf_object__close (hc_xdp_object);
+    hc_xdp_object = 0;
+    hc_xdp_state_map = -1;
+    hc_xdp_counters_map = -1;
+    return -1;
+}
+
+void hc_xdp_publish (int serving, const void *prototype, int length) {
+
+    if (hc_xdp_state_map < 0) return;
+
+    if (length > sizeof(hc_xdp_current.prototype))
+        length = sizeof(hc_xdp_current.prototype);
+    memcpy (hc_xdp_current.prototype, prototype, length);
+    hc_xdp_current.serving = serving;
+    hc_xdp_update ();
+}
+
+void hc_xdp_refresh (void) {
+    hc_xdp_update ();
+}
+
+int hc_xdp_traffic (long long *answered, long long *passed) {
+
+    int i;
+    __u32 key = 0;
+    struct hc_xdp_counters *counters;
+
+    if (hc_xdp_counters_map < 0) return -1;
+
+    counters = calloc (hc_xdp_cpus, sizeof(struct hc_xdp_counters));
+    if (!counters) return -1;
+
+    if (bpf_map_lookup_elem (hc_xdp_counters_map, &key, counters) != 0) {
+        free (counters);
+        return -1;
+    }
+    *answered = *passed = 0;
+    for (i = 0; i < hc_xdp_cpus; ++i) {
+        *answered += counters[i].answered;
+        *passed += counters[i].passed;
+    }
+    free (counters);
+    return 0;
+}
+
+#else // No libbpf.
+
+int hc_xdp_attach (const char *interface, const char *object, int port) {
+    fprintf (stderr, "[%s %d] XDP support was not built in\n",
+             __FILE__, __LINE__);
+    return -1;
+}
+
+void hc_xdp_publish (int serving, const void *prototype, int length) { }
+
+void hc_xdp_refresh (void) { }
+
+int hc_xdp_traffic (long long *answered, long long *passed) {
+    return -1;
+}
+
+#endif
+
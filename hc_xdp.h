@@ -0,0 +1,56 @@
+/* houseclock - A simple GPS Time Server with Web console
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * hc_xdp.h - An XDP fast path for answering NTP client requests.
+ *
+ * The map layouts below are shared by hc_xdp.c and hc_xdp.bpf.c.
+ */
+#include <linux/types.h>
+#include <linux/bpf.h>
+
+#define HC_XDP_NTP_SIZE 48 // A NTP header without extensions.
+
+struct hc_xdp_state {
+    struct bpf_spin_lock lock; // Held while the value is read or written.
+    __u32 serving;  // 0: pass all requests to the application.
+    __u16 port;     // UDP port of the NTP server, network order.
+    __u16 reserved;
+    __s64 offset;   // CLOCK_REALTIME - CLOCK_MONOTONIC (nanoseconds).
+    unsigned char prototype[HC_XDP_NTP_SIZE]; // Prebuilt response.
+};
+
+struct hc_xdp_counters {
+    __u64 answered; // Requests answered in the XDP program.
+    __u64 passed;   // NTP packets passed to the application.
+};
+
+#ifndef __bpf__
+
+#ifndef HC_XDP_OBJECT
+#define HC_XDP_OBJECT "/usr/local/share/house/bpf/hc_xdp.bpf.o"
+#endif
+
+int  hc_xdp_attach  (const char *interface, const char *object, int port);
+void hc_xdp_publish (int serving, const void *prototype, int length);
+void hc_xdp_refresh (void);
+int  hc_xdp_traffic (long long *answered, long long *passed);
+
+#endif
+
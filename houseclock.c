@@ -26,10 +26,22 @@
  *
  *   Return true if debug mode option (-debug) was enabled. Mostly used
  *   in the definition of DEBUG.
+ *
+ * The main loop waits for events using epoll: the NTP socket, the GPS
+ * device, the end of the HTTP process and a timer. The periodic functions
+ * of the NTP, NMEA, state, archive and latency modules return the time
+ * when they need to be called next: the timer is set to the earliest of
+ * these deadlines, converted to a CLOCK_MONOTONIC time so that the clock
+ * corrections do not affect it.
+ * The process does not wake up unless there is something to do. How late
+ * the timer wakes up, and how long each handler runs, is recorded in the
+ * latency histograms.
  */
 
 #include <stdlib.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
@@ -37,10 +49,17 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
 
 #include "houseclock.h"
 #include "hc_db.h"
 #include "hc_clock.h"
+#include "hc_state.h"
+#include "hc_stability.h"
+#include "hc_archive.h"
+#include "hc_realtime.h"
+#include "hc_latency.h"
+#include "hc_calibrate.h"
 #include "hc_nmea.h"
 #include "hc_ntp.h"
 #include "hc_broadcast.h"
@@ -51,6 +70,10 @@
 static int HcDebug = 0;
 static int HcTest = 0;
 
+static int HcEpoll = -1;
+static int HcTimer = -1;
+static struct timespec HcDeadline; // The timer expiration (monotonic).
+
 int hc_debug_enabled (void) {
     return HcDebug;
 }
@@ -64,14 +87,17 @@ static void hc_help (const char *argv0) {
     int i = 1;
     const char *help;
 
-    printf ("%s [-h] [-debug] [-test]%s%s%s\n",
-            argv0, hc_ntp_help(0), hc_nmea_help(0), hc_http_help(0));
+    printf ("%s [-h] [-debug] [-test]%s%s%s%s%s\n",
+            argv0, hc_ntp_help(0), hc_nmea_help(0), hc_calibrate_help(0),
+            hc_realtime_help(0), hc_http_help(0));
 
     printf ("\nGeneral options:\n");
     printf ("   -h:              print this help.\n");
     printf ("   -debug           prints a lot of debug traces.\n");
     printf ("   -test            prints time drift compare to GPS.\n");
     printf ("   -db=N            Size of the internal database, in MB\n");
+    printf ("   -state=PATH      File where to save the clock state (or none)\n");
+    printf ("   -state-period=N  Min interval between state saves (3600)\n");
 
     printf ("\nNTP options:\n");
     help = hc_ntp_help(i=1);
@@ -85,6 +111,18 @@ static void hc_help (const char *argv0) {
         printf ("   %s\n", help);
         help = hc_nmea_help(++i);
     }
+    printf ("\nGPS calibration options:\n");
+    help = hc_calibrate_help(i=1);
+    while (help) {
+        printf ("   %s\n", help);
+        help = hc_calibrate_help(++i);
+    }
+    printf ("\nRealtime options:\n");
+    help = hc_realtime_help(i=1);
+    while (help) {
+        printf ("   %s\n", help);
+        help = hc_realtime_help(++i);
+    }
     printf ("\nHTTP options:\n");
     help = hc_http_help(i=1);
     while (help) {
@@ -94,16 +132,80 @@ static void hc_help (const char *argv0) {
     exit (0);
 }
 
+static void hc_watch (int fd) {
+
+    struct epoll_event event;
+
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl (HcEpoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+        if (errno == EEXIST) return;
+        fprintf (stderr, "[%s %d] Cannot watch fd %d: %s\n",
+                 __FILE__, __LINE__, fd, strerror (errno));
+        exit (1);
+    }
+}
+
+static void hc_wakeup_at (time_t deadline) {
+
+    // The deadline is a system time (in seconds), but the timer runs on
+    // the monotonic clock: setting the time must not affect it.
+    //
+    struct timespec now;
+    struct itimerspec timer;
+    long long delay;
+
+    clock_gettime (CLOCK_REALTIME, &now);
+    delay = ((long long)(deadline - now.tv_sec) * HC_CLOCK_NSEC) - now.tv_nsec;
+    if (delay <= 0) delay = 1; // Now. (0 would disarm the timer.)
+
+    clock_gettime (CLOCK_MONOTONIC, &timer.it_value);
+    hc_clock_shift (&timer.it_value, delay);
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_nsec = 0;
+
+    timerfd_settime (HcTimer, TFD_TIMER_ABSTIME, &timer, NULL);
+    HcDeadline = timer.it_value;
+}
+
+static long long hc_since (const struct timespec *start) {
+
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return ((long long)(now.tv_sec - start->tv_sec) * HC_CLOCK_NSEC)
+           + (now.tv_nsec - start->tv_nsec);
+}
+
+static int hc_watch_child (pid_t child) {
+#ifdef SYS_pidfd_open
+    int fd = (int) syscall (SYS_pidfd_open, child, 0);
+    if (fd >= 0) hc_watch (fd);
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+static void hc_child_died (void) {
+    fprintf (stderr, "[%s %d] the HTTP server died, exit now\n",
+             __FILE__, __LINE__);
+    exit(1);
+}
+
 int main (int argc, const char **argv) {
 
-    int maxfd = 1;
     int count;
     int ntpsocket;
 
     int gpstty = -1;
+    int gpswatched = -1;
+    int httpwatch = -1;
 
-    time_t last_period = 0;
-    struct timeval now;
+    time_t next_period = 0;
+    struct timespec now;
+    struct timespec started;
+    struct timespec woken;
     const char *dbsizestr = "0";
 
     // These strange statements are to make sure that fds 0 to 2 are
@@ -138,72 +240,120 @@ int main (int argc, const char **argv) {
 
     nice (-20); // The NTP server is high priority.
 
+    // Before any thread is created, so that all inherit the settings.
+    hc_realtime_initialize (argc, argv);
+
+    HcEpoll = epoll_create1 (EPOLL_CLOEXEC);
+    HcTimer = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    if ((HcEpoll < 0) || (HcTimer < 0)) {
+        fprintf (stderr, "[%s %d] Cannot create the event loop: %s\n",
+                 __FILE__, __LINE__, strerror (errno));
+        exit (1);
+    }
+    hc_watch (HcTimer);
+
+    // If the kernel does not support watching a process, the HTTP process
+    // is checked at each periodic call, as a fallback.
+    httpwatch = hc_watch_child (httpid);
+
+    hc_state_initialize (argc, argv);
+
     hc_clock_initialize (argc, argv);
 
+    hc_stability_initialize ();
+
+    hc_archive_initialize ();
+
+    hc_latency_initialize ();
+
+    hc_calibrate_initialize (argc, argv);
+
     hc_nmea_initialize (argc, argv);
 
     ntpsocket = hc_ntp_initialize (argc, argv);
     if (!HcTest) {
         if (ntpsocket < 0) return 1;
     }
-    if (maxfd <= ntpsocket) maxfd = ntpsocket + 1;
+    if (ntpsocket > 0) hc_watch (ntpsocket);
 
 
     putenv("TZ=UTC"); // Always use UTC time.
 
     for (;;) {
-        struct timeval timeout;
-        fd_set readset;
-
-        FD_ZERO(&readset);
-        if (ntpsocket > 0) {
-            FD_SET(ntpsocket, &readset);
-        }
+        struct epoll_event events[8];
 
         gpstty = hc_nmea_listen();
-        if (gpstty >= 0) {
-            FD_SET(gpstty, &readset);
-            if (maxfd <= gpstty) maxfd = gpstty + 1;
+        if ((gpstty >= 0) && (gpstty != gpswatched)) {
+            hc_watch (gpstty);
+            gpswatched = gpstty;
         }
 
-        gettimeofday(&now, NULL);
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-
-        count = select(maxfd+1, &readset, NULL, NULL, &timeout);
-        gettimeofday(&now, NULL);
-
-        if (count >= 0) {
-            if (gpstty > 0) {
-                if (FD_ISSET(gpstty, &readset)) {
-                   gpstty = hc_nmea_process (&now);
-                }
-            }
-            if (ntpsocket) {
-                if (FD_ISSET(ntpsocket, &readset)) {
-                    hc_ntp_process (&now);
-                }
+        hc_wakeup_at (next_period);
+
+        count = epoll_wait (HcEpoll, events, 8, -1);
+        clock_gettime (CLOCK_REALTIME, &now);
+        clock_gettime (CLOCK_MONOTONIC, &woken);
+        started = woken;
+
+        for (i = 0; i < count; ++i) {
+            int fd = events[i].data.fd;
+
+            if (fd == gpstty) {
+                gpstty = hc_nmea_process (&now);
+                if (gpstty < 0) gpswatched = -1; // Closed: no longer watched.
+                if (ntpsocket > 0) hc_ntp_refresh (); // The clock may have moved.
+                hc_latency_record (HC_LATENCY_NMEA, hc_since (&started));
+                clock_gettime (CLOCK_MONOTONIC, &started);
+            } else if (fd == ntpsocket) {
+                hc_ntp_process (&now);
+                hc_latency_record (HC_LATENCY_NTP, hc_since (&started));
+                clock_gettime (CLOCK_MONOTONIC, &started);
+            } else if (fd == HcTimer) {
+                uint64_t expirations;
+                read (HcTimer, &expirations, sizeof(expirations));
+                // Only the timer has a known deadline to be late against.
+                // Measured at wakeup, not after the events handled before.
+                hc_latency_record (HC_LATENCY_WAKEUP,
+                                   hc_clock_delta (&woken, &HcDeadline));
+            } else if (fd == httpwatch) {
+                hc_child_died ();
             }
         }
 
-        if (now.tv_sec > last_period) {
+        if (now.tv_sec >= next_period) {
+            time_t deadline;
+
+            next_period = now.tv_sec + 60;
             if (ntpsocket > 0) {
-                hc_ntp_periodic (&now);
+                clock_gettime (CLOCK_MONOTONIC, &started);
+                deadline = hc_ntp_periodic (&now);
+                if (deadline < next_period) next_period = deadline;
+                hc_latency_record (HC_LATENCY_PERIODIC, hc_since (&started));
             }
             if (gpstty < 0) {
                 hc_nmea_initialize (argc, argv);
+                deadline = now.tv_sec + 5; // See hc_nmea_listen().
             } else {
-                hc_nmea_periodic (&now);
+                deadline = hc_nmea_periodic (&now);
             }
-            last_period = now.tv_sec;
-
-            int wstatus;
-            if (waitpid (httpid, &wstatus, WNOHANG) == httpid) {
-                fprintf (stderr, "[%s %d] the HTTP server died, exit now\n",
-                         __FILE__, __LINE__);
-                exit(1);
+            if (deadline < next_period) next_period = deadline;
+            deadline = hc_state_periodic (now.tv_sec);
+            if (deadline < next_period) next_period = deadline;
+            deadline = hc_archive_periodic (now.tv_sec);
+            if (deadline < next_period) next_period = deadline;
+            deadline = hc_latency_periodic (now.tv_sec);
+            if (deadline < next_period) next_period = deadline;
+            if (next_period <= now.tv_sec) next_period = now.tv_sec + 1;
+
+            // The GPS device might have been closed and reopened.
+            gpswatched = -1;
+
+            if (httpwatch < 0) {
+                int wstatus;
+                if (waitpid (httpid, &wstatus, WNOHANG) == httpid) {
+                    hc_child_died ();
+                }
             }
         }
     }
 }
-